@@ -0,0 +1,42 @@
+#!/bin/sh
+# compile every shader variant listed in the .comp sources
+#   ./gen_spirv.sh        .comp.spv files, read from the working directory at runtime
+#   ./gen_spirv.sh hex    .comp.spv.hex.h headers for a -DVKTEST_EMBED_SPIRV=1 build
+# the variant list is the "// glslangValidator -V" lines of each source, a new variant goes there
+# GLSLANG overrides the compiler, e.g. GLSLANG=/opt/vulkan-sdk/bin/glslangValidator
+
+set -e
+
+cd "$(dirname "$0")"
+
+GLSLANG=${GLSLANG:-glslangValidator}
+mode=${1:-spv}
+
+if [ "$mode" != spv ] && [ "$mode" != hex ]; then
+    echo "usage: $0 [spv|hex]" >&2
+    exit 1
+fi
+
+grep -h '^// glslangValidator -V ' *.comp | sed 's#^// glslangValidator ##' | while read -r line; do
+    # the output name is the last word after -o
+    out=${line##* -o }
+    args=${line% -o *}
+
+    if [ "$mode" = hex ]; then
+        $GLSLANG -x $args -o "$out.hex.h"
+    else
+        $GLSLANG $args -o "$out"
+    fi
+done
+
+# every header the embedded registry includes must come out of the list above
+if [ "$mode" = hex ]; then
+    missing=0
+    for header in $(grep -o '"[a-z0-9_]*\.comp\.spv\.hex\.h"' imagetest.cpp | tr -d '"'); do
+        if [ ! -f "$header" ]; then
+            echo "$header is included by imagetest.cpp but no .comp source lists its variant" >&2
+            missing=1
+        fi
+    done
+    exit $missing
+fi
@@ -1,19 +1,227 @@
 
 #include <vulkan/vulkan.h>
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <vector>
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if VKTEST_GLSLANG
+#include <glslang/Public/ShaderLang.h>
+#include <glslang/Public/ResourceLimits.h>
+#include <SPIRV/GlslangToSpv.h>
+#endif
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#if __F16C__
+#include <immintrin.h>
+#endif
+#if __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 // global
 static VkInstance instance = 0;
-static VkPhysicalDevice physicalDevice = 0;
-static VkDevice device = 0;
-static uint32_t queueFamilyIndex = -1;// compute queue
+static bool support_VK_KHR_get_physical_device_properties2 = false;
+static uint32_t instance_api_version = VK_MAKE_VERSION(1, 0, 0);// 1.1 when the loader has it
 
-static uint32_t memoryTypeIndex_devicelocal = -1;// device local
-static uint32_t memoryTypeIndex_hostvisible = -1;// host visible
+// VKTEST_LOG_LEVEL picks how much goes to stderr, errors are always printed
+// the default keeps startup free of stderr writes
+enum LogLevel
+{
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN = 1,// unusable devices, rejected caches
+    LOG_LEVEL_INFO = 2,// device selection, caches, pipeline creation
+    LOG_LEVEL_DEBUG = 3,// every limit, queue family, memory type, extension and allocation
+};
+
+static int read_log_level()
+{
+    const char* env = getenv("VKTEST_LOG_LEVEL");
+    return env ? atoi(env) : LOG_LEVEL_ERROR;
+}
+
+static int get_log_level()
+{
+    static const int log_level = read_log_level();
+    return log_level;
+}
+
+#define VKTEST_LOG(level, ...) do { if (get_log_level() >= level) fprintf(stderr, __VA_ARGS__); } while (0)
+#define VKTEST_LOGW(...) VKTEST_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define VKTEST_LOGI(...) VKTEST_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define VKTEST_LOGD(...) VKTEST_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// texel format of a storage image, pack4 formats hold 4 consecutive channels in one texel
+enum ImageStorageFormat
+{
+    IMAGE_FORMAT_FP32 = 0,// VK_FORMAT_R32_SFLOAT, always supported
+    IMAGE_FORMAT_FP16 = 1,// VK_FORMAT_R16_SFLOAT, needs shaderStorageImageExtendedFormats
+    IMAGE_FORMAT_FP32_PACK4 = 2,// VK_FORMAT_R32G32B32A32_SFLOAT
+    IMAGE_FORMAT_FP16_PACK4 = 3,// VK_FORMAT_R16G16B16A16_SFLOAT
+    IMAGE_FORMAT_COUNT = 4
+};
+
+VkFormat get_image_format_vkformat(ImageStorageFormat format)
+{
+    static const VkFormat vkformats[IMAGE_FORMAT_COUNT] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R16_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT };
+    return vkformats[format];
+}
+
+const char* get_image_format_name(ImageStorageFormat format)
+{
+    static const char* names[IMAGE_FORMAT_COUNT] = { "fp32", "fp16", "fp32_pack4", "fp16_pack4" };
+    return names[format];
+}
+
+int get_image_format_elempack(ImageStorageFormat format)
+{
+    return format == IMAGE_FORMAT_FP32_PACK4 || format == IMAGE_FORMAT_FP16_PACK4 ? 4 : 1;
+}
+
+// bytes per texel
+size_t get_image_format_elemsize(ImageStorageFormat format)
+{
+    const size_t scalar_size = format == IMAGE_FORMAT_FP16 || format == IMAGE_FORMAT_FP16_PACK4 ? 2 : 4;
+    return scalar_size * get_image_format_elempack(format);
+}
+
+// how a storage image holds the channels of a w x h x c tensor
+enum ImageChannelLayout
+{
+    IMAGE_CHANNEL_2D = 0,// single channel image2D
+    IMAGE_CHANNEL_3D = 1,// image3D, channel z is depth slice z
+    IMAGE_CHANNEL_ARRAY = 2,// image2DArray, channel z is array layer z
+};
+
+// where a VkBlob keeps its data, kernels are built once per backend from the same source
+enum BlobBackend
+{
+    BLOB_BACKEND_IMAGE = 0,// fp32 storage image
+    BLOB_BACKEND_BUFFER = 1,// fp32 storage buffer
+    BLOB_BACKEND_COUNT = 2
+};
+
+// device capabilities and the queues and memory types init_gpu_device would use on it
+struct GpuInfo
+{
+    uint32_t physicalDeviceIndex;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+
+    uint32_t computeQueueFamilyIndex;
+    uint32_t computeQueueCount;
+    uint32_t transferQueueFamilyIndex;
+    uint32_t transferQueueIndex;
+    uint32_t timestampValidBits;
+
+    uint32_t memoryTypeIndex_devicelocal;
+    uint32_t memoryTypeIndex_hostvisible;
+    VkDeviceSize device_local_heap_size;
+
+    bool support_linear_storage_image;
+
+    // bit per ImageStorageFormat usable as an optimal tiling storage image in our shaders
+    uint32_t support_storage_image_formats;
+    bool support_storage_image_extended_formats;
+
+    bool support_VK_KHR_external_memory;
+    bool support_VK_EXT_external_memory_host;
+
+    // higher is preferred, only usable devices are scored
+    int score;
+};
+
+class VkBlockAllocator;
+
+struct DescriptorSetLayoutCacheEntry
+{
+    std::vector<VkDescriptorType> descriptorTypes;
+    VkDescriptorSetLayout descriptorSetLayout;
+};
+
+struct ShaderModuleCacheEntry
+{
+    std::string spv_path;
+    VkShaderModule shaderModule;
+};
+
+struct PipelineLayoutCacheEntry
+{
+    VkDescriptorSetLayout descriptorSetLayout;
+    uint32_t push_constant_size;
+    VkPipelineLayout pipelineLayout;
+};
+
+// one logical device with its queues and caches
+// several contexts may live on one physical device, a context is driven by one thread at a time
+struct GpuContext
+{
+    GpuInfo info;
+
+    VkPhysicalDevice physicalDevice;
+    VkDevice device;
+    VkQueue queue;// compute queue
+    std::vector<VkQueue> computeQueues;// queue is computeQueues[0]
+    VkQueue transferQueue;
+    VkPipelineCache pipelineCache;
+
+    size_t pipelineCache_loaded_size;
+    double pipelineCache_create_time;// ms spent in vkCreateComputePipelines
+    int pipelineCache_create_count;
+
+    VkBlockAllocator* block_allocators[VK_MAX_MEMORY_TYPES];
+    std::vector<DescriptorSetLayoutCacheEntry> descriptor_set_layout_cache;
+    std::vector<PipelineLayoutCacheEntry> pipeline_layout_cache;
+    std::vector<ShaderModuleCacheEntry> shader_module_cache;
+
+    // measured winner per kernel, see select_blob_backend
+    std::unordered_map<std::string, BlobBackend> blob_backends;
+
+    // measured by select_channel_layout, -1 until then
+    int channel_layout;
+
+    // VK_EXT_external_memory_host, see import_host_buffer
+    bool support_external_memory_host;
+    VkDeviceSize minImportedHostPointerAlignment;
+    PFN_vkGetMemoryHostPointerPropertiesEXT vkGetMemoryHostPointerPropertiesEXT;
+
+    // vulkan 1.1 subgroups in the compute stage, see VkReduction
+    uint32_t subgroupSize;
+    bool support_subgroup_arithmetic;
+};
+
+static std::vector<VkPhysicalDevice> g_physical_devices;
+static std::vector<GpuInfo> g_gpu_infos;// indexed by physicalDeviceIndex, score -1 when unusable
+static std::vector<GpuContext*> g_gpu_contexts;// the first one is the default device
+
+// the getters below resolve through this, threads that never set it use the default device
+static thread_local GpuContext* g_current_gpu_context = 0;
+
+static void destroy_gpu_block_allocators(GpuContext* ctx);
+static void destroy_gpu_layout_cache(GpuContext* ctx);
+static void destroy_gpu_shader_module_cache(GpuContext* ctx);
 
 std::string read_file(const char* path)
 {
@@ -25,37 +233,132 @@ std::string read_file(const char* path)
     }
 
     fseek(fp, 0, SEEK_END);
-    int len = ftell(fp);
+    long len = ftell(fp);
     rewind(fp);
 
+    if (len < 0)
+    {
+        fprintf(stderr, "ftell %s failed\n", path);
+        fclose(fp);
+        return std::string();
+    }
+
     std::string data;
     data.resize(len);
 
-    fread((void*)data.data(), 1, len, fp);
+    size_t nread = fread((void*)data.data(), 1, len, fp);
 
     fclose(fp);
 
+    // a short read is as bad as a missing file
+    if (nread != (size_t)len)
+    {
+        fprintf(stderr, "fread %s failed %d of %ld\n", path, (int)nread, len);
+        return std::string();
+    }
+
     return data;
 }
 
+GpuContext* get_current_gpu_context()
+{
+    return g_current_gpu_context ? g_current_gpu_context : g_gpu_contexts[0];
+}
+
+// route the getters of the calling thread to ctx, 0 restores the default device
+void set_current_gpu_context(GpuContext* ctx)
+{
+    g_current_gpu_context = ctx;
+}
+
+int get_gpu_context_count()
+{
+    return (int)g_gpu_contexts.size();
+}
+
+GpuContext* get_gpu_context(int i)
+{
+    return g_gpu_contexts[i];
+}
+
+const GpuInfo& get_gpu_info()
+{
+    return get_current_gpu_context()->info;
+}
+
 VkDevice get_gpu_device()
 {
-    return device;
+    return get_current_gpu_context()->device;
 }
 
 uint32_t get_gpu_queueFamilyIndex()
 {
-    return queueFamilyIndex;
+    return get_current_gpu_context()->info.computeQueueFamilyIndex;
+}
+
+VkQueue get_gpu_queue()
+{
+    return get_current_gpu_context()->queue;
+}
+
+// queues of the compute family, threads that each own one can submit without locking
+int get_gpu_compute_queue_count()
+{
+    return (int)get_current_gpu_context()->computeQueues.size();
+}
+
+VkQueue get_gpu_compute_queue(int i)
+{
+    return get_current_gpu_context()->computeQueues[i];
+}
+
+// may equal the compute queue family, in which case no ownership transfer is needed
+uint32_t get_gpu_transfer_queueFamilyIndex()
+{
+    return get_current_gpu_context()->info.transferQueueFamilyIndex;
+}
+
+VkQueue get_gpu_transfer_queue()
+{
+    return get_current_gpu_context()->transferQueue;
+}
+
+VkPipelineCache get_gpu_pipeline_cache()
+{
+    return get_current_gpu_context()->pipelineCache;
 }
 
 uint32_t get_gpu_device_local_memoryTypeIndex()
 {
-    return memoryTypeIndex_devicelocal;
+    return get_current_gpu_context()->info.memoryTypeIndex_devicelocal;
 }
 
 uint32_t get_gpu_host_visible_memoryTypeIndex()
 {
-    return memoryTypeIndex_hostvisible;
+    return get_current_gpu_context()->info.memoryTypeIndex_hostvisible;
+}
+
+bool is_image_format_supported(ImageStorageFormat format)
+{
+    return get_current_gpu_context()->info.support_storage_image_formats & (1 << format);
+}
+
+// the narrowest supported texel layout for c channels, pack4 only when c is a multiple of 4
+ImageStorageFormat select_image_format(int c, bool allow_fp16)
+{
+    if (c % 4 == 0)
+    {
+        if (allow_fp16 && is_image_format_supported(IMAGE_FORMAT_FP16_PACK4))
+            return IMAGE_FORMAT_FP16_PACK4;
+
+        if (is_image_format_supported(IMAGE_FORMAT_FP32_PACK4))
+            return IMAGE_FORMAT_FP32_PACK4;
+    }
+
+    if (allow_fp16 && is_image_format_supported(IMAGE_FORMAT_FP16))
+        return IMAGE_FORMAT_FP16;
+
+    return IMAGE_FORMAT_FP32;
 }
 
 static uint32_t find_device_local_memory(VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties)
@@ -128,252 +431,469 @@ static uint32_t find_host_visible_memory(VkPhysicalDeviceMemoryProperties physic
     return -1;
 }
 
-int init_gpu_device()
+// file layout, PipelineCacheFileHeader followed by data_size bytes of vkGetPipelineCacheData
+// driverVersion is not part of the vulkan cache header, so we keep our own copy of the identity
+struct PipelineCacheFileHeader
 {
-    VkResult ret;
+    uint32_t magic;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    uint64_t data_size;
+};
 
-    VkApplicationInfo applicationInfo;
-    applicationInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    applicationInfo.pNext = 0;
-    applicationInfo.pApplicationName = "vkconv";
-    applicationInfo.applicationVersion = 0;
-    applicationInfo.pEngineName = "ncnn";
-    applicationInfo.engineVersion = 20180710;
-    applicationInfo.apiVersion = VK_MAKE_VERSION(1, 0, 0);
+static const uint32_t PIPELINE_CACHE_FILE_MAGIC = 0x4b435056;// VPCK
 
-    VkInstanceCreateInfo instanceCreateInfo;
-    instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-    instanceCreateInfo.pNext = 0;
-    instanceCreateInfo.flags = 0;
-    instanceCreateInfo.pApplicationInfo = &applicationInfo;
-    instanceCreateInfo.enabledLayerCount = 0;
-    instanceCreateInfo.ppEnabledLayerNames = 0;
-    instanceCreateInfo.enabledExtensionCount = 0;
-    instanceCreateInfo.ppEnabledExtensionNames = 0;
+static const char* get_pipeline_cache_path()
+{
+    const char* path = getenv("VKTEST_PIPELINE_CACHE");
+    return path ? path : "imagetest.pipelinecache";
+}
 
-//     VkInstance instance;
-    ret = vkCreateInstance(&instanceCreateInfo, 0, &instance);
-    if (ret != VK_SUCCESS)
+// accept data only when it was produced by the same device and driver
+static bool validate_pipeline_cache(const GpuContext* ctx, const std::string& filedata)
+{
+    if (filedata.size() < sizeof(PipelineCacheFileHeader))
+        return false;
+
+    const PipelineCacheFileHeader* header = (const PipelineCacheFileHeader*)filedata.data();
+
+    if (header->magic != PIPELINE_CACHE_FILE_MAGIC
+        || header->vendorID != ctx->info.properties.vendorID
+        || header->deviceID != ctx->info.properties.deviceID
+        || header->driverVersion != ctx->info.properties.driverVersion
+        || memcmp(header->pipelineCacheUUID, ctx->info.properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        return false;
+
+    if (header->data_size != filedata.size() - sizeof(PipelineCacheFileHeader))
+        return false;
+
+    // vulkan cache header, length version vendorID deviceID pipelineCacheUUID
+    if (header->data_size < 16 + VK_UUID_SIZE)
+        return false;
+
+    const uint32_t* vkheader = (const uint32_t*)(filedata.data() + sizeof(PipelineCacheFileHeader));
+    if (vkheader[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        || vkheader[2] != ctx->info.properties.vendorID
+        || vkheader[3] != ctx->info.properties.deviceID
+        || memcmp(vkheader + 4, ctx->info.properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        return false;
+
+    return true;
+}
+
+static int create_pipeline_cache(GpuContext* ctx)
+{
+    const char* path = get_pipeline_cache_path();
+
+    std::string filedata;
+    FILE* fp = fopen(path, "rb");
+    if (fp)
     {
-        fprintf(stderr, "vkCreateInstance failed %d\n", ret);
+        fclose(fp);
+        filedata = read_file(path);
     }
 
-    uint32_t physicalDeviceCount = 0;
-    ret = vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, 0);
+    ctx->pipelineCache_loaded_size = 0;
+
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo;
+    pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheCreateInfo.pNext = 0;
+    pipelineCacheCreateInfo.flags = 0;
+    pipelineCacheCreateInfo.initialDataSize = 0;
+    pipelineCacheCreateInfo.pInitialData = 0;
+
+    if (validate_pipeline_cache(ctx, filedata))
+    {
+        ctx->pipelineCache_loaded_size = filedata.size() - sizeof(PipelineCacheFileHeader);
+        pipelineCacheCreateInfo.initialDataSize = ctx->pipelineCache_loaded_size;
+        pipelineCacheCreateInfo.pInitialData = filedata.data() + sizeof(PipelineCacheFileHeader);
+    }
+    else if (!filedata.empty())
+    {
+        VKTEST_LOGW("pipeline cache %s does not match device or driver, ignored\n", path);
+    }
+
+    VkResult ret = vkCreatePipelineCache(ctx->device, &pipelineCacheCreateInfo, 0, &ctx->pipelineCache);
     if (ret != VK_SUCCESS)
     {
-        fprintf(stderr, "vkEnumeratePhysicalDevices failed %d\n", ret);
+        fprintf(stderr, "vkCreatePipelineCache failed %d\n", ret);
+        ctx->pipelineCache = 0;
+        return -1;
     }
 
-    fprintf(stderr, "physicalDeviceCount = %u\n", physicalDeviceCount);
+    VKTEST_LOGI("pipeline cache %s loaded %lu bytes\n", path, ctx->pipelineCache_loaded_size);
 
-    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+    return 0;
+}
 
-    ret = vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+static int save_pipeline_cache(GpuContext* ctx)
+{
+    if (!ctx->pipelineCache)
+        return 0;
+
+    size_t data_size = 0;
+    VkResult ret = vkGetPipelineCacheData(ctx->device, ctx->pipelineCache, &data_size, 0);
     if (ret != VK_SUCCESS)
     {
-        fprintf(stderr, "vkEnumeratePhysicalDevices failed %d\n", ret);
+        fprintf(stderr, "vkGetPipelineCacheData failed %d\n", ret);
+        return -1;
     }
 
-    // TODO device param
-    // TODO queue param
-    // find proper device and queue
-    uint32_t physicalDeviceIndex = -1;
-//     uint32_t queueFamilyIndex = -1;
+    std::vector<unsigned char> filedata(sizeof(PipelineCacheFileHeader) + data_size);
 
-    for (uint32_t i=0; i<physicalDeviceCount; i++)
+    ret = vkGetPipelineCacheData(ctx->device, ctx->pipelineCache, &data_size, filedata.data() + sizeof(PipelineCacheFileHeader));
+    if (ret != VK_SUCCESS)
     {
-        const VkPhysicalDevice& physicalDevice = physicalDevices[i];
+        fprintf(stderr, "vkGetPipelineCacheData failed %d\n", ret);
+        return -1;
+    }
 
-        VkPhysicalDeviceProperties physicalDeviceProperties;
-        vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
+    PipelineCacheFileHeader* header = (PipelineCacheFileHeader*)filedata.data();
+    header->magic = PIPELINE_CACHE_FILE_MAGIC;
+    header->vendorID = ctx->info.properties.vendorID;
+    header->deviceID = ctx->info.properties.deviceID;
+    header->driverVersion = ctx->info.properties.driverVersion;
+    memcpy(header->pipelineCacheUUID, ctx->info.properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header->data_size = data_size;
+
+    // write aside and rename, a crash never leaves a truncated cache behind
+    const char* path = get_pipeline_cache_path();
+    std::string tmppath = std::string(path) + ".tmp";
+
+    FILE* fp = fopen(tmppath.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", tmppath.c_str());
+        return -1;
+    }
+
+    size_t nwrite = fwrite(filedata.data(), 1, filedata.size(), fp);
+    fclose(fp);
+
+    if (nwrite != filedata.size() || rename(tmppath.c_str(), path) != 0)
+    {
+        fprintf(stderr, "write pipeline cache %s failed\n", path);
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    VKTEST_LOGI("pipeline cache %s saved %lu bytes\n", path, data_size);
+
+    return 0;
+}
+
+static const char* get_device_type_string(VkPhysicalDeviceType type)
+{
+    switch (type)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        return "cpu";
+    default:
+        return "other";
+    }
+}
+
+// one json line so ci logs can be grepped for the device a run used
+void print_gpu_info(const GpuInfo& info)
+{
+    const VkPhysicalDeviceLimits& limits = info.properties.limits;
+
+    fprintf(stderr, "{\"device\": %u, \"name\": \"%s\", \"type\": \"%s\", \"score\": %d, ", info.physicalDeviceIndex, info.properties.deviceName, get_device_type_string(info.properties.deviceType), info.score);
+    fprintf(stderr, "\"vendorID\": \"%x\", \"deviceID\": \"%x\", \"apiVersion\": \"%u.%u.%u\", \"driverVersion\": %u, ", info.properties.vendorID, info.properties.deviceID, VK_VERSION_MAJOR(info.properties.apiVersion), VK_VERSION_MINOR(info.properties.apiVersion), VK_VERSION_PATCH(info.properties.apiVersion), info.properties.driverVersion);
+    fprintf(stderr, "\"device_local_heap_mb\": %llu, \"compute_queue_family\": %u, \"compute_queue_count\": %u, \"transfer_queue_family\": %u, \"transfer_queue_index\": %u, ", (unsigned long long)(info.device_local_heap_size >> 20), info.computeQueueFamilyIndex, info.computeQueueCount, info.transferQueueFamilyIndex, info.transferQueueIndex);
+    fprintf(stderr, "\"storage_image_formats\": [");
+    for (int i=0, n=0; i<IMAGE_FORMAT_COUNT; i++)
+    {
+        if (info.support_storage_image_formats & (1 << i))
+            fprintf(stderr, "%s\"%s\"", n++ ? ", " : "", get_image_format_name((ImageStorageFormat)i));
+    }
+    fprintf(stderr, "], ");
+    fprintf(stderr, "\"timestamp_valid_bits\": %u, \"linear_storage_image\": %s, \"max_image_2d\": %u, \"max_shared_memory\": %u, \"max_invocations\": %u}\n", info.timestampValidBits, info.support_linear_storage_image ? "true" : "false", limits.maxImageDimension2D, limits.maxComputeSharedMemorySize, limits.maxComputeWorkGroupInvocations);
+}
+
+// device type first, then memory and queue capabilities
+static int score_gpu_info(const GpuInfo& info)
+{
+    int score = 0;
+
+    switch (info.properties.deviceType)
+    {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        score += 4000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        score += 3000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        score += 2000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        score += 1000;
+        break;
+    default:
+        break;
+    }
+
+    // up to 64GB of device local heap
+    score += (int)std::min(info.device_local_heap_size >> 30, (VkDeviceSize)64) * 10;
 
-        fprintf(stderr, "[%u] apiVersion = %u.%u.%u\n", i, VK_VERSION_MAJOR(physicalDeviceProperties.apiVersion), VK_VERSION_MINOR(physicalDeviceProperties.apiVersion), VK_VERSION_PATCH(physicalDeviceProperties.apiVersion));
-        fprintf(stderr, "[%u] driverVersion = %u.%u.%u\n", i, VK_VERSION_MAJOR(physicalDeviceProperties.driverVersion), VK_VERSION_MINOR(physicalDeviceProperties.driverVersion), VK_VERSION_PATCH(physicalDeviceProperties.driverVersion));
-        fprintf(stderr, "[%u] vendorID = %x\n", i, physicalDeviceProperties.vendorID);
-        fprintf(stderr, "[%u] deviceID = %x\n", i, physicalDeviceProperties.deviceID);
+    if (info.transferQueueFamilyIndex != info.computeQueueFamilyIndex)
+        score += 50;
+
+    score += info.computeQueueCount * 5;
+
+    if (info.timestampValidBits)
+        score += 5;
+
+    if (info.support_linear_storage_image)
+        score += 5;
+
+    return score;
+}
+
+// fill info for physical device i, return -1 when it cannot run our kernels
+static int probe_physical_device(uint32_t i, VkPhysicalDevice physicalDevice, GpuInfo* info)
+{
+    uint32_t queueFamilyIndex = -1;
+    uint32_t computeQueueCount = 1;
+    uint32_t transferQueueFamilyIndex = -1;
+    uint32_t transferQueueIndex = 0;
+    uint32_t memoryTypeIndex_devicelocal = -1;
+    uint32_t memoryTypeIndex_hostvisible = -1;
+
+    VkPhysicalDeviceProperties physicalDeviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
+
+    // identity first, so a snapshot of an unusable device still matches it on later starts
+    memset(info, 0, sizeof(GpuInfo));
+    info->physicalDeviceIndex = i;
+    info->properties = physicalDeviceProperties;
+
+    VKTEST_LOGD("[%u] apiVersion = %u.%u.%u\n", i, VK_VERSION_MAJOR(physicalDeviceProperties.apiVersion), VK_VERSION_MINOR(physicalDeviceProperties.apiVersion), VK_VERSION_PATCH(physicalDeviceProperties.apiVersion));
+    VKTEST_LOGD("[%u] driverVersion = %u.%u.%u\n", i, VK_VERSION_MAJOR(physicalDeviceProperties.driverVersion), VK_VERSION_MINOR(physicalDeviceProperties.driverVersion), VK_VERSION_PATCH(physicalDeviceProperties.driverVersion));
+    VKTEST_LOGD("[%u] vendorID = %x\n", i, physicalDeviceProperties.vendorID);
+    VKTEST_LOGD("[%u] deviceID = %x\n", i, physicalDeviceProperties.deviceID);
 //         fprintf(stderr, "deviceType = %u\n", physicalDeviceProperties.deviceType);
-        fprintf(stderr, "[%u] deviceName = %s\n", i, physicalDeviceProperties.deviceName);
-//         fprintf(stderr, "pipelineCacheUUID = %u\n", physicalDeviceProperties.pipelineCacheUUID);
+    VKTEST_LOGD("[%u] deviceName = %s\n", i, physicalDeviceProperties.deviceName);
+    VKTEST_LOGD("[%u] pipelineCacheUUID = ", i);
+    for (int j=0; j<VK_UUID_SIZE; j++)
+    {
+        VKTEST_LOGD("%02x", physicalDeviceProperties.pipelineCacheUUID[j]);
+    }
+    VKTEST_LOGD("\n");
 
-        if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU)
-        {
-            fprintf(stderr, "[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU\n", i);
-        }
-        if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
-        {
-            fprintf(stderr, "[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU\n", i);
-        }
-        if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU)
-        {
-            fprintf(stderr, "[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU\n", i);
-        }
-        if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU)
-        {
-            fprintf(stderr, "[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU\n", i);
-        }
+    if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU)
+    {
+        VKTEST_LOGD("[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU\n", i);
+    }
+    if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+    {
+        VKTEST_LOGD("[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU\n", i);
+    }
+    if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU)
+    {
+        VKTEST_LOGD("[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU\n", i);
+    }
+    if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU)
+    {
+        VKTEST_LOGD("[%u] deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU\n", i);
+    }
 
-        if (physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU)
-        {
-            continue;
-        }
+    // TODO check limits
+    VKTEST_LOGD("maxImageDimension1D = %u\n", physicalDeviceProperties.limits.maxImageDimension1D);
+    VKTEST_LOGD("maxImageDimension2D = %u\n", physicalDeviceProperties.limits.maxImageDimension2D);
+    VKTEST_LOGD("maxImageDimension3D = %u\n", physicalDeviceProperties.limits.maxImageDimension3D);
 
-        physicalDeviceIndex = i;
+    VKTEST_LOGD("maxComputeSharedMemorySize = %u\n", physicalDeviceProperties.limits.maxComputeSharedMemorySize);
+    VKTEST_LOGD("maxComputeWorkGroupCount = %u %u %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupCount[0], physicalDeviceProperties.limits.maxComputeWorkGroupCount[1], physicalDeviceProperties.limits.maxComputeWorkGroupCount[2]);
+    VKTEST_LOGD("maxComputeWorkGroupInvocations = %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupInvocations);
+    VKTEST_LOGD("maxComputeWorkGroupSize = %u %u %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupSize[0], physicalDeviceProperties.limits.maxComputeWorkGroupSize[1], physicalDeviceProperties.limits.maxComputeWorkGroupSize[2]);
 
-        // TODO check limits
-        fprintf(stderr, "maxImageDimension1D = %u\n", physicalDeviceProperties.limits.maxImageDimension1D);
-        fprintf(stderr, "maxImageDimension2D = %u\n", physicalDeviceProperties.limits.maxImageDimension2D);
-        fprintf(stderr, "maxImageDimension3D = %u\n", physicalDeviceProperties.limits.maxImageDimension3D);
 
-        fprintf(stderr, "maxComputeSharedMemorySize = %u\n", physicalDeviceProperties.limits.maxComputeSharedMemorySize);
-        fprintf(stderr, "maxComputeWorkGroupCount = %u %u %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupCount[0], physicalDeviceProperties.limits.maxComputeWorkGroupCount[1], physicalDeviceProperties.limits.maxComputeWorkGroupCount[2]);
-        fprintf(stderr, "maxComputeWorkGroupInvocations = %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupInvocations);
-        fprintf(stderr, "maxComputeWorkGroupSize = %u %u %u\n", physicalDeviceProperties.limits.maxComputeWorkGroupSize[0], physicalDeviceProperties.limits.maxComputeWorkGroupSize[1], physicalDeviceProperties.limits.maxComputeWorkGroupSize[2]);
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &features);
 
+    // r32f storage image is required in optimal tiling, linear tiling is a bonus
+    VkFormat format = VK_FORMAT_R32_SFLOAT;
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
 
-        // TODO check features
-        VkPhysicalDeviceFeatures features;
-        vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+    {
+        VKTEST_LOGW("no r32f storage image on device %u\n", i);
+        return -1;
+    }
 
-        // TODO check formatProperties
-        VkFormat format = VK_FORMAT_R32_SFLOAT;
-        VkFormatProperties formatProperties;
-        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+    uint32_t queueFamilyPropertiesCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, 0);
 
-        uint32_t queueFamilyPropertiesCount;
-        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, 0);
+    VKTEST_LOGD("queueFamilyPropertiesCount = %u\n", queueFamilyPropertiesCount);
 
-        fprintf(stderr, "queueFamilyPropertiesCount = %u\n", queueFamilyPropertiesCount);
+    std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertiesCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
 
-        std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyPropertiesCount);
-        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyPropertiesCount, queueFamilyProperties.data());
+    for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
+    {
+        const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
 
-        for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
+        if (queueFamilyProperty.queueFlags & VK_QUEUE_GRAPHICS_BIT)
         {
-            const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
+            VKTEST_LOGD("[%u] VK_QUEUE_GRAPHICS_BIT\n", j);
+        }
+        if (queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT)
+        {
+            VKTEST_LOGD("[%u] VK_QUEUE_COMPUTE_BIT\n", j);
+        }
+        if (queueFamilyProperty.queueFlags & VK_QUEUE_TRANSFER_BIT)
+        {
+            VKTEST_LOGD("[%u] VK_QUEUE_TRANSFER_BIT\n", j);
+        }
+        if (queueFamilyProperty.queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
+        {
+            VKTEST_LOGD("[%u] VK_QUEUE_SPARSE_BINDING_BIT\n", j);
+        }
+    }
 
-            if (queueFamilyProperty.queueFlags & VK_QUEUE_GRAPHICS_BIT)
-            {
-                fprintf(stderr, "[%u] VK_QUEUE_GRAPHICS_BIT\n", j);
-            }
-            if (queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT)
-            {
-                fprintf(stderr, "[%u] VK_QUEUE_COMPUTE_BIT\n", j);
-            }
-            if (queueFamilyProperty.queueFlags & VK_QUEUE_TRANSFER_BIT)
-            {
-                fprintf(stderr, "[%u] VK_QUEUE_TRANSFER_BIT\n", j);
-            }
-            if (queueFamilyProperty.queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)
-            {
-                fprintf(stderr, "[%u] VK_QUEUE_SPARSE_BINDING_BIT\n", j);
-            }
+    // first try, compute only queue
+    for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
+    {
+        const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
+
+        if ((queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamilyProperty.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        {
+            queueFamilyIndex = j;
+            break;
         }
+    }
 
-        // first try, compute only queue
+    if (queueFamilyIndex == (uint32_t)-1)
+    {
+        // second try, any queue with compute
         for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
         {
             const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
 
-            if ((queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamilyProperty.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+            if (queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT)
             {
                 queueFamilyIndex = j;
                 break;
             }
         }
+    }
 
-        if (queueFamilyIndex == (uint32_t)-1)
-        {
-            // second try, any queue with compute
-            for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
-            {
-                const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
+    if (queueFamilyIndex == (uint32_t)-1)
+    {
+        VKTEST_LOGW("no compute queue on device %u\n", i);
+        return -1;
+    }
 
-                if (queueFamilyProperty.queueFlags & VK_QUEUE_COMPUTE_BIT)
-                {
-                    queueFamilyIndex = j;
-                    break;
-                }
-            }
+    // up to 4 queues of the compute family
+    computeQueueCount = std::min(queueFamilyProperties[queueFamilyIndex].queueCount, 4u);
+
+    // first try, transfer only queue
+    transferQueueFamilyIndex = -1;
+    transferQueueIndex = 0;
+    for (uint32_t j=0; j<queueFamilyPropertiesCount; j++)
+    {
+        const VkQueueFamilyProperties& queueFamilyProperty = queueFamilyProperties[j];
+
+        if ((queueFamilyProperty.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamilyProperty.queueFlags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT)))
+        {
+            transferQueueFamilyIndex = j;
+            break;
         }
+    }
 
-        if (queueFamilyIndex == (uint32_t)-1)
+    if (transferQueueFamilyIndex == (uint32_t)-1)
+    {
+        // second try, the last queue of the compute family, or share the compute queue
+        transferQueueFamilyIndex = queueFamilyIndex;
+        if (computeQueueCount > 1)
         {
-            fprintf(stderr, "no compute queue on device %u\n", i);
-            continue;
+            computeQueueCount--;
+            transferQueueIndex = computeQueueCount;
         }
+    }
 
-        // TODO check memory info
-        VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &physicalDeviceMemoryProperties);
+    // TODO check memory info
+    VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &physicalDeviceMemoryProperties);
 
-        fprintf(stderr, "memoryTypeCount = %u\n", physicalDeviceMemoryProperties.memoryTypeCount);
-        for (uint32_t j=0; j<physicalDeviceMemoryProperties.memoryTypeCount; j++)
-        {
-            const VkMemoryType& memoryType = physicalDeviceMemoryProperties.memoryTypes[j];
+    VKTEST_LOGD("memoryTypeCount = %u\n", physicalDeviceMemoryProperties.memoryTypeCount);
+    for (uint32_t j=0; j<physicalDeviceMemoryProperties.memoryTypeCount; j++)
+    {
+        const VkMemoryType& memoryType = physicalDeviceMemoryProperties.memoryTypes[j];
 
-            fprintf(stderr, "[%u] %u\n", j, memoryType.heapIndex);
-            if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT\n");
-            }
-            if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT\n");
-            }
-            if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT\n");
-            }
-            if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_PROPERTY_HOST_CACHED_BIT\n");
-            }
-            if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT\n");
-            }
+        VKTEST_LOGD("[%u] %u\n", j, memoryType.heapIndex);
+        if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+        {
+            VKTEST_LOGD("    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT\n");
         }
-
-        fprintf(stderr, "memoryHeapCount = %u\n", physicalDeviceMemoryProperties.memoryHeapCount);
-        for (uint32_t j=0; j<physicalDeviceMemoryProperties.memoryHeapCount; j++)
+        if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
         {
-            const VkMemoryHeap& memoryHeap = physicalDeviceMemoryProperties.memoryHeaps[j];
-
-            fprintf(stderr, "[%u] %lu\n", j, memoryHeap.size);
-            if (memoryHeap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
-            {
-                fprintf(stderr, "    VK_MEMORY_HEAP_DEVICE_LOCAL_BIT\n");
-            }
+            VKTEST_LOGD("    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT\n");
         }
-
-        // find memory type index
-        memoryTypeIndex_devicelocal = find_device_local_memory(physicalDeviceMemoryProperties);
-        memoryTypeIndex_hostvisible = find_host_visible_memory(physicalDeviceMemoryProperties);
-        if (memoryTypeIndex_devicelocal == (uint32_t)-1 || memoryTypeIndex_hostvisible == (uint32_t)-1)
+        if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
         {
-            fprintf(stderr, "no valid memoryTypeIndex_devicelocal or memoryTypeIndex_hostvisible\n");
-            continue;
+            VKTEST_LOGD("    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT\n");
         }
+        if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)
+        {
+            VKTEST_LOGD("    VK_MEMORY_PROPERTY_HOST_CACHED_BIT\n");
+        }
+        if (memoryType.propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)
+        {
+            VKTEST_LOGD("    VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT\n");
+        }
+    }
 
-        break;
+    VKTEST_LOGD("memoryHeapCount = %u\n", physicalDeviceMemoryProperties.memoryHeapCount);
+    for (uint32_t j=0; j<physicalDeviceMemoryProperties.memoryHeapCount; j++)
+    {
+        const VkMemoryHeap& memoryHeap = physicalDeviceMemoryProperties.memoryHeaps[j];
+
+        VKTEST_LOGD("[%u] %lu\n", j, memoryHeap.size);
+        if (memoryHeap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+        {
+            VKTEST_LOGD("    VK_MEMORY_HEAP_DEVICE_LOCAL_BIT\n");
+        }
     }
 
-    fprintf(stderr, "----- select physicalDevice %u queueFamilyProperty %u \n", physicalDeviceIndex, queueFamilyIndex);
-    fprintf(stderr, "----- select memoryTypeIndex_devicelocal %u memoryTypeIndex_hostvisible %u\n", memoryTypeIndex_devicelocal, memoryTypeIndex_hostvisible);
+    // find memory type index
+    memoryTypeIndex_devicelocal = find_device_local_memory(physicalDeviceMemoryProperties);
+    memoryTypeIndex_hostvisible = find_host_visible_memory(physicalDeviceMemoryProperties);
+    if (memoryTypeIndex_devicelocal == (uint32_t)-1 || memoryTypeIndex_hostvisible == (uint32_t)-1)
+    {
+        VKTEST_LOGW("no valid memoryTypeIndex_devicelocal or memoryTypeIndex_hostvisible\n");
+        return -1;
+    }
 
-    physicalDevice = physicalDevices[physicalDeviceIndex];
+    VkDeviceSize device_local_heap_size = 0;
+    for (uint32_t j=0; j<physicalDeviceMemoryProperties.memoryHeapCount; j++)
+    {
+        const VkMemoryHeap& memoryHeap = physicalDeviceMemoryProperties.memoryHeaps[j];
 
+        if (memoryHeap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            device_local_heap_size = std::max(device_local_heap_size, memoryHeap.size);
+    }
 
     // get device extension
     uint32_t deviceExtensionPropertyCount = 0;
-    ret = vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &deviceExtensionPropertyCount, NULL);
+    VkResult ret = vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &deviceExtensionPropertyCount, NULL);
     if (ret != VK_SUCCESS)
     {
         fprintf(stderr, "vkEnumerateDeviceExtensionProperties failed %d\n", ret);
     }
 
-    fprintf(stderr, "deviceExtensionPropertyCount = %d\n", deviceExtensionPropertyCount);
+    VKTEST_LOGD("deviceExtensionPropertyCount = %d\n", deviceExtensionPropertyCount);
 
     std::vector<VkExtensionProperties> deviceExtensionProperties(deviceExtensionPropertyCount);
     ret = vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &deviceExtensionPropertyCount, deviceExtensionProperties.data());
@@ -382,352 +902,9168 @@ int init_gpu_device()
         fprintf(stderr, "vkEnumerateDeviceExtensionProperties failed %d\n", ret);
     }
 
-    for (uint32_t i=0; i<deviceExtensionPropertyCount; i++)
+    bool support_VK_KHR_external_memory = false;
+    bool support_VK_EXT_external_memory_host = false;
+    for (uint32_t j=0; j<deviceExtensionPropertyCount; j++)
+    {
+        const VkExtensionProperties exp = deviceExtensionProperties[j];
+        VKTEST_LOGD("%s = %u\n", exp.extensionName, exp.specVersion);
+
+        if (strcmp(exp.extensionName, VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME) == 0)
+            support_VK_KHR_external_memory = true;
+        if (strcmp(exp.extensionName, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0)
+            support_VK_EXT_external_memory_host = true;
+    }
+
+    info->physicalDeviceIndex = i;
+    info->properties = physicalDeviceProperties;
+    info->memoryProperties = physicalDeviceMemoryProperties;
+    info->computeQueueFamilyIndex = queueFamilyIndex;
+    info->computeQueueCount = computeQueueCount;
+    info->transferQueueFamilyIndex = transferQueueFamilyIndex;
+    info->transferQueueIndex = transferQueueIndex;
+    info->timestampValidBits = queueFamilyProperties[queueFamilyIndex].timestampValidBits;
+    info->memoryTypeIndex_devicelocal = memoryTypeIndex_devicelocal;
+    info->memoryTypeIndex_hostvisible = memoryTypeIndex_hostvisible;
+    info->device_local_heap_size = device_local_heap_size;
+    info->support_VK_KHR_external_memory = support_VK_KHR_external_memory;
+    info->support_VK_EXT_external_memory_host = support_VK_EXT_external_memory_host;
+    info->support_linear_storage_image = formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+
+    // r16f is an extended storage image format in spirv, the others are core
+    info->support_storage_image_extended_formats = features.shaderStorageImageExtendedFormats;
+    info->support_storage_image_formats = 0;
+    for (int j=0; j<IMAGE_FORMAT_COUNT; j++)
+    {
+        VkFormatProperties storageFormatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, get_image_format_vkformat((ImageStorageFormat)j), &storageFormatProperties);
+
+        if (!(storageFormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+            continue;
+
+        if (j == IMAGE_FORMAT_FP16 && !features.shaderStorageImageExtendedFormats)
+            continue;
+
+        info->support_storage_image_formats |= 1 << j;
+    }
+    info->score = score_gpu_info(*info);
+
+    VKTEST_LOGD("[%u] score = %d\n", i, info->score);
+
+    return 0;
+}
+
+// file layout, GpuInfoSnapshotFileHeader followed by device_count GpuInfo in enumeration order
+// GpuInfo is stored as is, info_size rejects a snapshot written by a different build
+struct GpuInfoSnapshotFileHeader
+{
+    uint32_t magic;
+    uint32_t info_size;
+    uint32_t device_count;
+};
+
+static const uint32_t GPU_INFO_SNAPSHOT_FILE_MAGIC = 0x50534756;// VGSP
+
+static const char* get_gpu_info_snapshot_path()
+{
+    const char* path = getenv("VKTEST_DEVICE_CACHE");
+    return path ? path : "imagetest.devices";
+}
+
+// reuse the probe results of an earlier start when every device reports the same identity and driver version
+static int load_gpu_info_snapshot(const std::vector<VkPhysicalDevice>& physicalDevices, std::vector<GpuInfo>& infos)
+{
+    const char* path = get_gpu_info_snapshot_path();
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    fclose(fp);
+
+    std::string filedata = read_file(path);
+    if (filedata.size() < sizeof(GpuInfoSnapshotFileHeader))
+        return -1;
+
+    const GpuInfoSnapshotFileHeader* header = (const GpuInfoSnapshotFileHeader*)filedata.data();
+    if (header->magic != GPU_INFO_SNAPSHOT_FILE_MAGIC
+        || header->info_size != sizeof(GpuInfo)
+        || header->device_count != physicalDevices.size()
+        || filedata.size() != sizeof(GpuInfoSnapshotFileHeader) + sizeof(GpuInfo) * header->device_count)
+    {
+        VKTEST_LOGW("device snapshot %s does not match this build or device count, ignored\n", path);
+        return -1;
+    }
+
+    const GpuInfo* snapshot = (const GpuInfo*)(filedata.data() + sizeof(GpuInfoSnapshotFileHeader));
+    for (uint32_t i=0; i<header->device_count; i++)
+    {
+        VkPhysicalDeviceProperties physicalDeviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevices[i], &physicalDeviceProperties);
+
+        const VkPhysicalDeviceProperties& properties = snapshot[i].properties;
+        if (properties.vendorID != physicalDeviceProperties.vendorID
+            || properties.deviceID != physicalDeviceProperties.deviceID
+            || properties.driverVersion != physicalDeviceProperties.driverVersion
+            || properties.apiVersion != physicalDeviceProperties.apiVersion
+            || memcmp(properties.pipelineCacheUUID, physicalDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        {
+            VKTEST_LOGW("device snapshot %s is stale for device %u, probe again\n", path, i);
+            return -1;
+        }
+    }
+
+    infos.assign(snapshot, snapshot + header->device_count);
+
+    VKTEST_LOGI("device snapshot %s loaded %u devices\n", path, header->device_count);
+
+    return 0;
+}
+
+static int save_gpu_info_snapshot(const std::vector<GpuInfo>& infos)
+{
+    std::vector<unsigned char> filedata(sizeof(GpuInfoSnapshotFileHeader) + sizeof(GpuInfo) * infos.size());
+
+    GpuInfoSnapshotFileHeader* header = (GpuInfoSnapshotFileHeader*)filedata.data();
+    header->magic = GPU_INFO_SNAPSHOT_FILE_MAGIC;
+    header->info_size = sizeof(GpuInfo);
+    header->device_count = (uint32_t)infos.size();
+
+    if (!infos.empty())
+        memcpy(filedata.data() + sizeof(GpuInfoSnapshotFileHeader), infos.data(), sizeof(GpuInfo) * infos.size());
+
+    // write aside and rename, concurrent starts never read a truncated snapshot
+    const char* path = get_gpu_info_snapshot_path();
+    std::string tmppath = std::string(path) + ".tmp";
+
+    FILE* fp = fopen(tmppath.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", tmppath.c_str());
+        return -1;
+    }
+
+    size_t nwrite = fwrite(filedata.data(), 1, filedata.size(), fp);
+    fclose(fp);
+
+    if (nwrite != filedata.size() || rename(tmppath.c_str(), path) != 0)
+    {
+        fprintf(stderr, "write device snapshot %s failed\n", path);
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    VKTEST_LOGI("device snapshot %s saved %u devices\n", path, header->device_count);
+
+    return 0;
+}
+
+// the limit lives in VkPhysicalDeviceExternalMemoryHostPropertiesEXT, without the extension or properties2 assume the page size
+static VkDeviceSize get_min_imported_host_pointer_alignment(VkPhysicalDevice physicalDevice, const GpuInfo& info)
+{
+    if (!info.support_VK_EXT_external_memory_host || !support_VK_KHR_get_physical_device_properties2)
+        return 4096;
+
+    PFN_vkGetPhysicalDeviceProperties2KHR vkGetPhysicalDeviceProperties2KHR = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR");
+    if (!vkGetPhysicalDeviceProperties2KHR)
+        return 4096;
+
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT externalMemoryHostProperties;
+    externalMemoryHostProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+    externalMemoryHostProperties.pNext = 0;
+    externalMemoryHostProperties.minImportedHostPointerAlignment = 4096;
+
+    VkPhysicalDeviceProperties2 properties2;
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &externalMemoryHostProperties;
+
+    vkGetPhysicalDeviceProperties2KHR(physicalDevice, &properties2);
+
+    return externalMemoryHostProperties.minImportedHostPointerAlignment;
+}
+
+// effective api version of a device, the instance caps what the device reports
+static uint32_t get_api_version(uint32_t device_api_version)
+{
+    const uint32_t device_version = VK_MAKE_VERSION(VK_VERSION_MAJOR(device_api_version), VK_VERSION_MINOR(device_api_version), 0);
+    return std::min(device_version, instance_api_version);
+}
+
+// VkPhysicalDeviceSubgroupProperties is vulkan 1.1 core, a 1.0 device has no subgroup operations
+static void get_subgroup_properties(VkPhysicalDevice physicalDevice, uint32_t device_api_version, uint32_t* subgroupSize, bool* support_subgroup_arithmetic)
+{
+    *subgroupSize = 0;
+    *support_subgroup_arithmetic = false;
+
+    if (get_api_version(device_api_version) < VK_MAKE_VERSION(1, 1, 0))
+        return;
+
+    PFN_vkGetPhysicalDeviceProperties2 vkGetPhysicalDeviceProperties2 = (PFN_vkGetPhysicalDeviceProperties2)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2");
+    if (!vkGetPhysicalDeviceProperties2)
+        return;
+
+    VkPhysicalDeviceSubgroupProperties subgroupProperties;
+    subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    subgroupProperties.pNext = 0;
+    subgroupProperties.subgroupSize = 0;
+    subgroupProperties.supportedStages = 0;
+    subgroupProperties.supportedOperations = 0;
+    subgroupProperties.quadOperationsInAllStages = VK_FALSE;
+
+    VkPhysicalDeviceProperties2 properties2;
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &subgroupProperties;
+
+    vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+
+    const VkSubgroupFeatureFlags required = VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT;
+
+    *subgroupSize = subgroupProperties.subgroupSize;
+    *support_subgroup_arithmetic = (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) && (subgroupProperties.supportedOperations & required) == required;
+}
+
+// create a logical device on a usable physical device, several may be created on the same one
+// the first context becomes the default device, all of them live until destroy_gpu_device
+// create every context before worker threads start using the getters
+GpuContext* create_gpu_context(uint32_t physicalDeviceIndex)
+{
+    if (physicalDeviceIndex >= g_gpu_infos.size() || g_gpu_infos[physicalDeviceIndex].score < 0)
+    {
+        fprintf(stderr, "physical device %u is not usable\n", physicalDeviceIndex);
+        return 0;
+    }
+
+    const GpuInfo& info = g_gpu_infos[physicalDeviceIndex];
+    VkPhysicalDevice physicalDevice = g_physical_devices[physicalDeviceIndex];
+
+    const uint32_t queueFamilyIndex = info.computeQueueFamilyIndex;
+    const uint32_t computeQueueCount = info.computeQueueCount;
+    const uint32_t transferQueueFamilyIndex = info.transferQueueFamilyIndex;
+    const uint32_t transferQueueIndex = info.transferQueueIndex;
+
+    VKTEST_LOGI("----- select physicalDevice %u queueFamilyProperty %u \n", physicalDeviceIndex, queueFamilyIndex);
+    VKTEST_LOGI("----- select computeQueueCount %u transferQueueFamily %u transferQueueIndex %u\n", computeQueueCount, transferQueueFamilyIndex, transferQueueIndex);
+    VKTEST_LOGI("----- select memoryTypeIndex_devicelocal %u memoryTypeIndex_hostvisible %u\n", info.memoryTypeIndex_devicelocal, info.memoryTypeIndex_hostvisible);
+
+    if (get_log_level() >= LOG_LEVEL_INFO)
+        print_gpu_info(info);
+
+    VkResult ret;
+
+    // host pointer import builds on VK_KHR_external_memory
+    const bool enable_external_memory_host = info.support_VK_KHR_external_memory && info.support_VK_EXT_external_memory_host;
+
+    std::vector<const char*> enabledExtensions;
+    if (enable_external_memory_host)
     {
-        const VkExtensionProperties exp = deviceExtensionProperties[i];
-        fprintf(stderr, "%s = %u\n", exp.extensionName, exp.specVersion);
+        enabledExtensions.push_back(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+        enabledExtensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
     }
 
-    const float queuePriorities[1] = { 1.f };// 0.f ~ 1.f
+    const float queuePriorities[4] = { 1.f, 1.f, 1.f, 1.f };// 0.f ~ 1.f
+
+    // compute queues, plus the transfer queue which is either its own family or the last compute family queue
+    VkDeviceQueueCreateInfo deviceQueueCreateInfos[2];
+    uint32_t deviceQueueCreateInfoCount = 1;
+
+    deviceQueueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    deviceQueueCreateInfos[0].pNext = 0;
+    deviceQueueCreateInfos[0].flags = 0;
+    deviceQueueCreateInfos[0].queueFamilyIndex = queueFamilyIndex;
+    deviceQueueCreateInfos[0].queueCount = computeQueueCount;
+    deviceQueueCreateInfos[0].pQueuePriorities = queuePriorities;
+
+    if (transferQueueFamilyIndex != queueFamilyIndex)
+    {
+        deviceQueueCreateInfos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        deviceQueueCreateInfos[1].pNext = 0;
+        deviceQueueCreateInfos[1].flags = 0;
+        deviceQueueCreateInfos[1].queueFamilyIndex = transferQueueFamilyIndex;
+        deviceQueueCreateInfos[1].queueCount = 1;
+        deviceQueueCreateInfos[1].pQueuePriorities = queuePriorities;
+        deviceQueueCreateInfoCount = 2;
+    }
+    else if (transferQueueIndex != 0)
+    {
+        deviceQueueCreateInfos[0].queueCount = computeQueueCount + 1;
+    }
 
-    VkDeviceQueueCreateInfo deviceQueueCreateInfo;
-    deviceQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    deviceQueueCreateInfo.pNext = 0;
-    deviceQueueCreateInfo.flags = 0;
-    deviceQueueCreateInfo.queueFamilyIndex = queueFamilyIndex;
-    deviceQueueCreateInfo.queueCount = 1;
-    deviceQueueCreateInfo.pQueuePriorities = queuePriorities;
+    VkPhysicalDeviceFeatures enabledFeatures;
+    memset(&enabledFeatures, 0, sizeof(enabledFeatures));
+    enabledFeatures.shaderStorageImageExtendedFormats = info.support_storage_image_extended_formats;
 
     VkDeviceCreateInfo deviceCreateInfo;
     deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     deviceCreateInfo.pNext = 0;
     deviceCreateInfo.flags = 0;
-    deviceCreateInfo.queueCreateInfoCount = 1;
-    deviceCreateInfo.pQueueCreateInfos = &deviceQueueCreateInfo;
+    deviceCreateInfo.queueCreateInfoCount = deviceQueueCreateInfoCount;
+    deviceCreateInfo.pQueueCreateInfos = deviceQueueCreateInfos;
     deviceCreateInfo.enabledLayerCount = 0;
     deviceCreateInfo.ppEnabledLayerNames = 0;
-    deviceCreateInfo.enabledExtensionCount = 0;
-    deviceCreateInfo.ppEnabledExtensionNames = 0;
-    deviceCreateInfo.pEnabledFeatures = 0;// VkPhysicalDeviceFeatures pointer
+    deviceCreateInfo.enabledExtensionCount = (uint32_t)enabledExtensions.size();
+    deviceCreateInfo.ppEnabledExtensionNames = enabledExtensions.empty() ? 0 : enabledExtensions.data();
+    deviceCreateInfo.pEnabledFeatures = &enabledFeatures;
 
-//     VkDevice device;
+    VkDevice device;
     ret = vkCreateDevice(physicalDevice, &deviceCreateInfo, 0, &device);
     if (ret != VK_SUCCESS)
     {
         fprintf(stderr, "vkCreateDevice failed %d\n", ret);
+        return 0;
     }
 
-    return 0;
-}
+    GpuContext* ctx = new GpuContext;
+    ctx->info = info;
+    ctx->physicalDevice = physicalDevice;
+    ctx->device = device;
+    ctx->pipelineCache = 0;
+    ctx->pipelineCache_loaded_size = 0;
+    ctx->pipelineCache_create_time = 0;
+    ctx->pipelineCache_create_count = 0;
+    ctx->channel_layout = -1;
+
+    ctx->support_external_memory_host = false;
+    ctx->minImportedHostPointerAlignment = get_min_imported_host_pointer_alignment(physicalDevice, info);
+    ctx->vkGetMemoryHostPointerPropertiesEXT = 0;
+    if (enable_external_memory_host)
+    {
+        ctx->vkGetMemoryHostPointerPropertiesEXT = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr(device, "vkGetMemoryHostPointerPropertiesEXT");
+        ctx->support_external_memory_host = ctx->vkGetMemoryHostPointerPropertiesEXT != 0;
+    }
 
-void destroy_gpu_device()
-{
-    vkDestroyDevice(device, 0);
+    VKTEST_LOGI("----- external memory host %d minImportedHostPointerAlignment %lu\n", ctx->support_external_memory_host, (unsigned long)ctx->minImportedHostPointerAlignment);
 
-    vkDestroyInstance(instance, 0);
+    get_subgroup_properties(physicalDevice, info.properties.apiVersion, &ctx->subgroupSize, &ctx->support_subgroup_arithmetic);
+
+    VKTEST_LOGI("----- subgroup size %u arithmetic %d\n", ctx->subgroupSize, ctx->support_subgroup_arithmetic);
+
+    for (uint32_t i=0; i<VK_MAX_MEMORY_TYPES; i++)
+    {
+        ctx->block_allocators[i] = 0;
+    }
+
+    ctx->computeQueues.resize(computeQueueCount);
+    for (uint32_t i=0; i<computeQueueCount; i++)
+    {
+        vkGetDeviceQueue(device, queueFamilyIndex, i, &ctx->computeQueues[i]);
+    }
+    ctx->queue = ctx->computeQueues[0];
+
+    vkGetDeviceQueue(device, transferQueueFamilyIndex, transferQueueIndex, &ctx->transferQueue);
+
+    create_pipeline_cache(ctx);
+
+    g_gpu_contexts.push_back(ctx);
+
+    return ctx;
 }
 
-VkImage create_image(VkImageType imageType, int w, int h, int c)
+int init_gpu_device()
 {
-    uint32_t queueFamilyIndex = get_gpu_queueFamilyIndex();
+    VkResult ret;
 
-    // create image
-    VkImageCreateInfo imageCreateInfo;
-    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageCreateInfo.pNext = 0;
-    imageCreateInfo.flags = 0;
-    imageCreateInfo.imageType = imageType;
-    imageCreateInfo.format = VK_FORMAT_R32_SFLOAT;
-    imageCreateInfo.extent.width = w;
-    imageCreateInfo.extent.height = h;
-    imageCreateInfo.extent.depth = c;
-    imageCreateInfo.mipLevels = 1;
-    imageCreateInfo.arrayLayers = 1;
-    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-//     imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    imageCreateInfo.tiling = VK_IMAGE_TILING_LINEAR;
-    imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
-//     imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
-    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    imageCreateInfo.queueFamilyIndexCount = 1;
-    imageCreateInfo.pQueueFamilyIndices = &queueFamilyIndex;
-    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkApplicationInfo applicationInfo;
+    applicationInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    applicationInfo.pNext = 0;
+    applicationInfo.pApplicationName = "vkconv";
+    applicationInfo.applicationVersion = 0;
+    applicationInfo.pEngineName = "ncnn";
+    applicationInfo.engineVersion = 20180710;
+    applicationInfo.apiVersion = VK_MAKE_VERSION(1, 0, 0);
 
-    VkImage image = 0;
-    VkResult ret = vkCreateImage(get_gpu_device(), &imageCreateInfo, 0, &image);
+    // a 1.0 loader rejects any other apiVersion and has no vkEnumerateInstanceVersion
+    instance_api_version = VK_MAKE_VERSION(1, 0, 0);
+    PFN_vkEnumerateInstanceVersion vkEnumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(0, "vkEnumerateInstanceVersion");
+    if (vkEnumerateInstanceVersion)
+    {
+        uint32_t loader_api_version = 0;
+        if (vkEnumerateInstanceVersion(&loader_api_version) == VK_SUCCESS && loader_api_version >= VK_MAKE_VERSION(1, 1, 0))
+        {
+            instance_api_version = VK_MAKE_VERSION(1, 1, 0);
+            applicationInfo.apiVersion = instance_api_version;
+        }
+    }
+
+    // instance extensions the device level queries build on
+    uint32_t instanceExtensionPropertyCount = 0;
+    ret = vkEnumerateInstanceExtensionProperties(NULL, &instanceExtensionPropertyCount, NULL);
     if (ret != VK_SUCCESS)
     {
-        fprintf(stderr, "vkCreateImage failed %d\n", ret);
+        fprintf(stderr, "vkEnumerateInstanceExtensionProperties failed %d\n", ret);
     }
 
-    return image;
-}
+    std::vector<VkExtensionProperties> instanceExtensionProperties(instanceExtensionPropertyCount);
+    ret = vkEnumerateInstanceExtensionProperties(NULL, &instanceExtensionPropertyCount, instanceExtensionProperties.data());
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkEnumerateInstanceExtensionProperties failed %d\n", ret);
+    }
 
-VkImageView create_imageview(VkImageViewType viewType, VkImage image)
-{
-    // create imageview
-    VkComponentMapping componentMapping;
-    componentMapping.r = VK_COMPONENT_SWIZZLE_R;
-    componentMapping.g = VK_COMPONENT_SWIZZLE_G;
-    componentMapping.b = VK_COMPONENT_SWIZZLE_B;
-    componentMapping.a = VK_COMPONENT_SWIZZLE_A;
+    support_VK_KHR_get_physical_device_properties2 = false;
+    std::vector<const char*> enabledInstanceExtensions;
+    for (uint32_t i=0; i<instanceExtensionPropertyCount; i++)
+    {
+        const VkExtensionProperties exp = instanceExtensionProperties[i];
+        if (strcmp(exp.extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0)
+        {
+            enabledInstanceExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+            support_VK_KHR_get_physical_device_properties2 = true;
+        }
+        if (strcmp(exp.extensionName, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME) == 0)
+        {
+            enabledInstanceExtensions.push_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+        }
+    }
 
-    VkImageSubresourceRange subresourceRange;
-    subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresourceRange.baseMipLevel = 0;
-    subresourceRange.levelCount = 1;
-    subresourceRange.baseArrayLayer = 0;
-    subresourceRange.layerCount = 1;
+    VkInstanceCreateInfo instanceCreateInfo;
+    instanceCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instanceCreateInfo.pNext = 0;
+    instanceCreateInfo.flags = 0;
+    instanceCreateInfo.pApplicationInfo = &applicationInfo;
+    instanceCreateInfo.enabledLayerCount = 0;
+    instanceCreateInfo.ppEnabledLayerNames = 0;
+    instanceCreateInfo.enabledExtensionCount = (uint32_t)enabledInstanceExtensions.size();
+    instanceCreateInfo.ppEnabledExtensionNames = enabledInstanceExtensions.empty() ? 0 : enabledInstanceExtensions.data();
 
-    VkImageViewCreateInfo imageViewCreateInfo;
-    imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    imageViewCreateInfo.pNext = 0;
-    imageViewCreateInfo.flags = 0;
-    imageViewCreateInfo.image = image;
-    imageViewCreateInfo.viewType = viewType;
-    imageViewCreateInfo.format = VK_FORMAT_R32_SFLOAT;
-    imageViewCreateInfo.components = componentMapping;
-    imageViewCreateInfo.subresourceRange = subresourceRange;
+//     VkInstance instance;
+    ret = vkCreateInstance(&instanceCreateInfo, 0, &instance);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateInstance failed %d\n", ret);
+        instance = 0;
+        return -1;
+    }
 
-    VkImageView imageView = 0;
-    VkResult ret = vkCreateImageView(get_gpu_device(), &imageViewCreateInfo, 0, &imageView);
+    uint32_t physicalDeviceCount = 0;
+    ret = vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, 0);
     if (ret != VK_SUCCESS)
     {
-        fprintf(stderr, "vkCreateImageView failed %d\n", ret);
+        fprintf(stderr, "vkEnumeratePhysicalDevices failed %d\n", ret);
+    }
+
+    VKTEST_LOGI("physicalDeviceCount = %u\n", physicalDeviceCount);
+
+    std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+
+    ret = vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkEnumeratePhysicalDevices failed %d\n", ret);
+    }
+
+    // probe every device, or take the snapshot of an earlier start, and keep the best scored one, cpu implementations included
+    g_physical_devices = physicalDevices;
+    g_gpu_infos.resize(physicalDeviceCount);
+
+    if (load_gpu_info_snapshot(physicalDevices, g_gpu_infos) != 0)
+    {
+        for (uint32_t i=0; i<physicalDeviceCount; i++)
+        {
+            if (probe_physical_device(i, physicalDevices[i], &g_gpu_infos[i]) != 0)
+            {
+                g_gpu_infos[i].physicalDeviceIndex = i;
+                g_gpu_infos[i].score = -1;
+            }
+        }
+
+        save_gpu_info_snapshot(g_gpu_infos);
+    }
+
+    int selected = -1;
+    for (uint32_t i=0; i<physicalDeviceCount; i++)
+    {
+        if (g_gpu_infos[i].score < 0)
+            continue;
+
+        if (selected == -1 || g_gpu_infos[i].score > g_gpu_infos[selected].score)
+            selected = i;
+    }
+
+    // VKTEST_DEVICE picks a device by index or by a substring of its name
+    const char* device_override = getenv("VKTEST_DEVICE");
+    if (device_override && device_override[0])
+    {
+        int overridden = -1;
+        for (uint32_t i=0; i<physicalDeviceCount; i++)
+        {
+            if (g_gpu_infos[i].score < 0)
+                continue;
+
+            char index[16];
+            sprintf(index, "%u", i);
+            if (strcmp(device_override, index) == 0 || strstr(g_gpu_infos[i].properties.deviceName, device_override))
+            {
+                overridden = i;
+                break;
+            }
+        }
+
+        if (overridden == -1)
+        {
+            fprintf(stderr, "VKTEST_DEVICE=%s matches no usable device\n", device_override);
+        }
+        else
+        {
+            selected = overridden;
+        }
+    }
+
+    if (selected == -1)
+    {
+        fprintf(stderr, "no usable vulkan device\n");
+        vkDestroyInstance(instance, 0);
+        instance = 0;
+        return -1;
+    }
+
+    if (!create_gpu_context(selected))
+    {
+        vkDestroyInstance(instance, 0);
+        instance = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_gpu_context(GpuContext* ctx, bool save_cache)
+{
+    // allocators free their chunks through the getters
+    GpuContext* current = g_current_gpu_context;
+    set_current_gpu_context(ctx);
+
+    destroy_gpu_block_allocators(ctx);
+
+    destroy_gpu_layout_cache(ctx);
+
+    destroy_gpu_shader_module_cache(ctx);
+
+    set_current_gpu_context(current);
+
+    VKTEST_LOGI("pipeline cache %s, %d pipelines created in %.3f ms\n", ctx->pipelineCache_loaded_size ? "warm" : "cold", ctx->pipelineCache_create_count, ctx->pipelineCache_create_time);
+
+    if (save_cache)
+        save_pipeline_cache(ctx);
+
+    vkDestroyPipelineCache(ctx->device, ctx->pipelineCache, 0);
+
+    vkDestroyDevice(ctx->device, 0);
+
+    delete ctx;
+}
+
+void destroy_gpu_device()
+{
+    if (!instance)
+        return;
+
+    // only the default device writes the pipeline cache file, the others would clobber it with their own
+    for (size_t i=g_gpu_contexts.size(); i>0; i--)
+    {
+        destroy_gpu_context(g_gpu_contexts[i-1], i == 1);
+    }
+    g_gpu_contexts.clear();
+
+    g_gpu_infos.clear();
+    g_physical_devices.clear();
+
+    vkDestroyInstance(instance, 0);
+    instance = 0;
+}
+
+VkImage create_image(VkImageType imageType, int w, int h, int c, VkFormat format, VkImageTiling tiling = VK_IMAGE_TILING_LINEAR)
+{
+    uint32_t queueFamilyIndex = get_gpu_queueFamilyIndex();
+
+    // create image
+    VkImageCreateInfo imageCreateInfo;
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.pNext = 0;
+    imageCreateInfo.flags = 0;
+    imageCreateInfo.imageType = imageType;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent.width = w;
+    imageCreateInfo.extent.height = h;
+    // channels go along the depth of a 3d image and across the array layers of a 2d one
+    imageCreateInfo.extent.depth = imageType == VK_IMAGE_TYPE_3D ? c : 1;
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = imageType == VK_IMAGE_TYPE_3D ? 1 : c;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = tiling;
+    if (tiling == VK_IMAGE_TILING_OPTIMAL)
+    {
+        // optimal tiling is opaque to host, data moves through staging buffer copies
+        imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+    }
+    else
+    {
+        imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    }
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.queueFamilyIndexCount = 1;
+    imageCreateInfo.pQueueFamilyIndices = &queueFamilyIndex;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImage image = 0;
+    VkResult ret = vkCreateImage(get_gpu_device(), &imageCreateInfo, 0, &image);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateImage failed %d\n", ret);
+    }
+
+    return image;
+}
+
+VkImageView create_imageview(VkImageViewType viewType, VkImage image, VkFormat format)
+{
+    // create imageview
+    VkComponentMapping componentMapping;
+    componentMapping.r = VK_COMPONENT_SWIZZLE_R;
+    componentMapping.g = VK_COMPONENT_SWIZZLE_G;
+    componentMapping.b = VK_COMPONENT_SWIZZLE_B;
+    componentMapping.a = VK_COMPONENT_SWIZZLE_A;
+
+    VkImageSubresourceRange subresourceRange;
+    subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresourceRange.baseMipLevel = 0;
+    subresourceRange.levelCount = 1;
+    subresourceRange.baseArrayLayer = 0;
+    subresourceRange.layerCount = viewType == VK_IMAGE_VIEW_TYPE_2D_ARRAY ? VK_REMAINING_ARRAY_LAYERS : 1;
+
+    VkImageViewCreateInfo imageViewCreateInfo;
+    imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    imageViewCreateInfo.pNext = 0;
+    imageViewCreateInfo.flags = 0;
+    imageViewCreateInfo.image = image;
+    imageViewCreateInfo.viewType = viewType;
+    imageViewCreateInfo.format = format;
+    imageViewCreateInfo.components = componentMapping;
+    imageViewCreateInfo.subresourceRange = subresourceRange;
+
+    VkImageView imageView = 0;
+    VkResult ret = vkCreateImageView(get_gpu_device(), &imageViewCreateInfo, 0, &imageView);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateImageView failed %d\n", ret);
+    }
+
+    return imageView;
+}
+
+VkBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage)
+{
+    uint32_t queueFamilyIndex = get_gpu_queueFamilyIndex();
+
+    VkBufferCreateInfo bufferCreateInfo;
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.pNext = 0;
+    bufferCreateInfo.flags = 0;
+    bufferCreateInfo.size = size;
+    bufferCreateInfo.usage = usage;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    bufferCreateInfo.queueFamilyIndexCount = 1;
+    bufferCreateInfo.pQueueFamilyIndices = &queueFamilyIndex;
+
+    VkBuffer buffer = 0;
+    VkResult ret = vkCreateBuffer(get_gpu_device(), &bufferCreateInfo, 0, &buffer);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateBuffer failed %d\n", ret);
+    }
+
+    return buffer;
+}
+
+VkDeviceMemory fastMalloc(size_t size, uint32_t memoryTypeIndex)
+{
+    VKTEST_LOGD("fastMalloc %lu on %u\n", size, memoryTypeIndex);
+    // new
+    VkMemoryAllocateInfo memoryAllocateInfo;
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.pNext = 0;
+    memoryAllocateInfo.allocationSize = size;
+    memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory ptr = 0;
+    VkResult ret = vkAllocateMemory(get_gpu_device(), &memoryAllocateInfo, 0, &ptr);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkAllocateMemory failed %d\n", ret);
+    }
+
+    return ptr;
+}
+
+void fastFree(VkDeviceMemory memory)
+{
+    vkFreeMemory(get_gpu_device(), memory, 0);
+}
+
+static inline VkDeviceSize alignSize(VkDeviceSize sz, VkDeviceSize n)
+{
+    return (sz + n - 1) / n * n;
+}
+
+static bool is_host_coherent(uint32_t memoryTypeIndex)
+{
+    return get_gpu_info().memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+static bool is_host_visible(uint32_t memoryTypeIndex)
+{
+    return get_gpu_info().memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+// a sub-range of a device memory chunk, bind with vkBindImageMemory(memory, offset)
+struct VkMemoryBlock
+{
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+    void* mapped_ptr;// persistently mapped address of offset, 0 if not host visible
+};
+
+// make host writes visible to device, no-op on host coherent memory
+void flush_memory_block(const VkMemoryBlock& block)
+{
+    if (is_host_coherent(block.memoryTypeIndex) || block.size == 0)
+        return;
+
+    const VkDeviceSize atom = get_gpu_info().properties.limits.nonCoherentAtomSize;
+
+    VkMappedMemoryRange mappedMemoryRange;
+    mappedMemoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    mappedMemoryRange.pNext = 0;
+    mappedMemoryRange.memory = block.memory;
+    mappedMemoryRange.offset = block.offset / atom * atom;
+    mappedMemoryRange.size = alignSize(block.offset + block.size - mappedMemoryRange.offset, atom);
+
+    VkResult ret = vkFlushMappedMemoryRanges(get_gpu_device(), 1, &mappedMemoryRange);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkFlushMappedMemoryRanges failed %d\n", ret);
+    }
+}
+
+// make device writes visible to host, no-op on host coherent memory
+void invalidate_memory_block(const VkMemoryBlock& block)
+{
+    if (is_host_coherent(block.memoryTypeIndex) || block.size == 0)
+        return;
+
+    const VkDeviceSize atom = get_gpu_info().properties.limits.nonCoherentAtomSize;
+
+    VkMappedMemoryRange mappedMemoryRange;
+    mappedMemoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    mappedMemoryRange.pNext = 0;
+    mappedMemoryRange.memory = block.memory;
+    mappedMemoryRange.offset = block.offset / atom * atom;
+    mappedMemoryRange.size = alignSize(block.offset + block.size - mappedMemoryRange.offset, atom);
+
+    VkResult ret = vkInvalidateMappedMemoryRanges(get_gpu_device(), 1, &mappedMemoryRange);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkInvalidateMappedMemoryRanges failed %d\n", ret);
+    }
+}
+
+struct VkAllocatorStatistics
+{
+    uint32_t chunk_count;
+    uint32_t allocation_count;
+    VkDeviceSize allocated_bytes;// sum of chunk size
+    VkDeviceSize live_bytes;// sum of block size handed out
+    VkDeviceSize free_bytes;
+    VkDeviceSize largest_free_bytes;
+    float fragmentation;// 1 - largest_free_bytes / free_bytes
+};
+
+// block-based sub-allocator for one memory type
+// linear resources (buffers, linear tiling images) and optimal tiling images never share a chunk,
+// so neighbouring blocks can not violate bufferImageGranularity
+// host visible chunks stay mapped for their whole lifetime
+class VkBlockAllocator
+{
+public:
+    VkBlockAllocator(uint32_t memoryTypeIndex, VkDeviceSize chunk_size = 16 * 1024 * 1024);
+    ~VkBlockAllocator();
+
+    int fastMalloc(const VkMemoryRequirements& memoryRequirements, bool linear, VkMemoryBlock* block);
+    void fastFree(const VkMemoryBlock& block);
+
+    // release empty chunks
+    void trim();
+
+    // release all chunks
+    void clear();
+
+    VkAllocatorStatistics statistics() const;
+    void print_statistics() const;
+
+private:
+    struct Chunk
+    {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        void* mapped_ptr;
+        bool linear;
+        bool dedicated;
+        uint32_t live_count;
+        VkDeviceSize live_bytes;
+        // free spaces sorted by offset, <offset, size>
+        std::list< std::pair<VkDeviceSize, VkDeviceSize> > free_spaces;
+    };
+
+    Chunk* new_chunk(VkDeviceSize size, bool linear, bool dedicated);
+    void delete_chunk(Chunk* chunk);
+    static bool chunk_malloc(Chunk* chunk, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset);
+
+    uint32_t memoryTypeIndex;
+    VkDeviceSize chunk_size;
+    std::vector<Chunk*> chunks;
+};
+
+VkBlockAllocator::VkBlockAllocator(uint32_t _memoryTypeIndex, VkDeviceSize _chunk_size)
+    : memoryTypeIndex(_memoryTypeIndex), chunk_size(_chunk_size)
+{
+}
+
+VkBlockAllocator::~VkBlockAllocator()
+{
+    clear();
+}
+
+VkBlockAllocator::Chunk* VkBlockAllocator::new_chunk(VkDeviceSize size, bool linear, bool dedicated)
+{
+    if (is_host_visible(memoryTypeIndex) && !is_host_coherent(memoryTypeIndex))
+    {
+        // whole atoms for flush and invalidate
+        size = alignSize(size, get_gpu_info().properties.limits.nonCoherentAtomSize);
+    }
+
+    VkDeviceMemory memory = ::fastMalloc(size, memoryTypeIndex);
+    if (!memory)
+        return 0;
+
+    void* mapped_ptr = 0;
+    if (is_host_visible(memoryTypeIndex))
+    {
+        VkResult ret = vkMapMemory(get_gpu_device(), memory, 0, VK_WHOLE_SIZE, 0, &mapped_ptr);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkMapMemory failed %d\n", ret);
+            ::fastFree(memory);
+            return 0;
+        }
+    }
+
+    Chunk* chunk = new Chunk;
+    chunk->memory = memory;
+    chunk->size = size;
+    chunk->mapped_ptr = mapped_ptr;
+    chunk->linear = linear;
+    chunk->dedicated = dedicated;
+    chunk->live_count = 0;
+    chunk->live_bytes = 0;
+    chunk->free_spaces.push_back(std::make_pair((VkDeviceSize)0, size));
+
+    chunks.push_back(chunk);
+
+    return chunk;
+}
+
+void VkBlockAllocator::delete_chunk(Chunk* chunk)
+{
+    if (chunk->mapped_ptr)
+    {
+        vkUnmapMemory(get_gpu_device(), chunk->memory);
+    }
+
+    ::fastFree(chunk->memory);
+    delete chunk;
+}
+
+bool VkBlockAllocator::chunk_malloc(Chunk* chunk, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset)
+{
+    // first fit
+    std::list< std::pair<VkDeviceSize, VkDeviceSize> >::iterator it = chunk->free_spaces.begin();
+    for (; it != chunk->free_spaces.end(); it++)
+    {
+        VkDeviceSize free_offset = it->first;
+        VkDeviceSize free_size = it->second;
+
+        VkDeviceSize aligned_offset = alignSize(free_offset, alignment);
+        VkDeviceSize padding = aligned_offset - free_offset;
+        if (padding + size > free_size)
+            continue;
+
+        VkDeviceSize remain = free_size - padding - size;
+
+        if (padding == 0)
+        {
+            if (remain == 0)
+            {
+                chunk->free_spaces.erase(it);
+            }
+            else
+            {
+                it->first = aligned_offset + size;
+                it->second = remain;
+            }
+        }
+        else
+        {
+            // padding stays free
+            it->second = padding;
+            if (remain != 0)
+            {
+                std::list< std::pair<VkDeviceSize, VkDeviceSize> >::iterator next = it;
+                next++;
+                chunk->free_spaces.insert(next, std::make_pair(aligned_offset + size, remain));
+            }
+        }
+
+        *offset = aligned_offset;
+        return true;
+    }
+
+    return false;
+}
+
+int VkBlockAllocator::fastMalloc(const VkMemoryRequirements& memoryRequirements, bool linear, VkMemoryBlock* block)
+{
+    if (!(memoryRequirements.memoryTypeBits & (1u << memoryTypeIndex)))
+    {
+        fprintf(stderr, "memoryTypeIndex %u not in memoryTypeBits %x\n", memoryTypeIndex, memoryRequirements.memoryTypeBits);
+        return -1;
+    }
+
+    const VkDeviceSize alignment = memoryRequirements.alignment ? memoryRequirements.alignment : 1;
+    const VkDeviceSize size = alignSize(memoryRequirements.size, alignment);
+
+    Chunk* chunk = 0;
+    VkDeviceSize offset = 0;
+
+    if (size > chunk_size)
+    {
+        // too large, give it a dedicated chunk
+        chunk = new_chunk(size, linear, true);
+        if (!chunk)
+            return -1;
+
+        chunk_malloc(chunk, size, alignment, &offset);
+    }
+    else
+    {
+        for (size_t i=0; i<chunks.size(); i++)
+        {
+            Chunk* c = chunks[i];
+            if (c->linear != linear || c->dedicated)
+                continue;
+
+            if (chunk_malloc(c, size, alignment, &offset))
+            {
+                chunk = c;
+                break;
+            }
+        }
+
+        if (!chunk)
+        {
+            chunk = new_chunk(chunk_size, linear, false);
+            if (!chunk)
+                return -1;
+
+            chunk_malloc(chunk, size, alignment, &offset);
+        }
+    }
+
+    chunk->live_count++;
+    chunk->live_bytes += size;
+
+    block->memory = chunk->memory;
+    block->offset = offset;
+    block->size = size;
+    block->memoryTypeIndex = memoryTypeIndex;
+    block->mapped_ptr = chunk->mapped_ptr ? (unsigned char*)chunk->mapped_ptr + offset : 0;
+
+    return 0;
+}
+
+void VkBlockAllocator::fastFree(const VkMemoryBlock& block)
+{
+    for (size_t i=0; i<chunks.size(); i++)
+    {
+        Chunk* chunk = chunks[i];
+        if (chunk->memory != block.memory)
+            continue;
+
+        chunk->live_count--;
+        chunk->live_bytes -= block.size;
+
+        if (chunk->dedicated)
+        {
+            delete_chunk(chunk);
+            chunks.erase(chunks.begin() + i);
+            return;
+        }
+
+        // insert sorted and merge with neighbours
+        std::list< std::pair<VkDeviceSize, VkDeviceSize> >::iterator it = chunk->free_spaces.begin();
+        while (it != chunk->free_spaces.end() && it->first < block.offset)
+            it++;
+
+        it = chunk->free_spaces.insert(it, std::make_pair(block.offset, block.size));
+
+        std::list< std::pair<VkDeviceSize, VkDeviceSize> >::iterator next = it;
+        next++;
+        if (next != chunk->free_spaces.end() && it->first + it->second == next->first)
+        {
+            it->second += next->second;
+            chunk->free_spaces.erase(next);
+        }
+
+        if (it != chunk->free_spaces.begin())
+        {
+            std::list< std::pair<VkDeviceSize, VkDeviceSize> >::iterator prev = it;
+            prev--;
+            if (prev->first + prev->second == it->first)
+            {
+                prev->second += it->second;
+                chunk->free_spaces.erase(it);
+            }
+        }
+
+        return;
+    }
+
+    fprintf(stderr, "VkBlockAllocator::fastFree unknown memory %p\n", (void*)block.memory);
+}
+
+void VkBlockAllocator::trim()
+{
+    for (size_t i=0; i<chunks.size(); )
+    {
+        Chunk* chunk = chunks[i];
+        if (chunk->live_count == 0)
+        {
+            delete_chunk(chunk);
+            chunks.erase(chunks.begin() + i);
+            continue;
+        }
+
+        i++;
+    }
+}
+
+void VkBlockAllocator::clear()
+{
+    for (size_t i=0; i<chunks.size(); i++)
+    {
+        Chunk* chunk = chunks[i];
+        if (chunk->live_count != 0)
+        {
+            fprintf(stderr, "VkBlockAllocator chunk %p still has %u live blocks\n", (void*)chunk->memory, chunk->live_count);
+        }
+
+        delete_chunk(chunk);
+    }
+
+    chunks.clear();
+}
+
+VkAllocatorStatistics VkBlockAllocator::statistics() const
+{
+    VkAllocatorStatistics stat;
+    stat.chunk_count = chunks.size();
+    stat.allocation_count = 0;
+    stat.allocated_bytes = 0;
+    stat.live_bytes = 0;
+    stat.free_bytes = 0;
+    stat.largest_free_bytes = 0;
+
+    for (size_t i=0; i<chunks.size(); i++)
+    {
+        const Chunk* chunk = chunks[i];
+
+        stat.allocation_count += chunk->live_count;
+        stat.allocated_bytes += chunk->size;
+        stat.live_bytes += chunk->live_bytes;
+
+        std::list< std::pair<VkDeviceSize, VkDeviceSize> >::const_iterator it = chunk->free_spaces.begin();
+        for (; it != chunk->free_spaces.end(); it++)
+        {
+            stat.free_bytes += it->second;
+            if (it->second > stat.largest_free_bytes)
+                stat.largest_free_bytes = it->second;
+        }
+    }
+
+    stat.fragmentation = stat.free_bytes == 0 ? 0.f : 1.f - (float)stat.largest_free_bytes / stat.free_bytes;
+
+    return stat;
+}
+
+void VkBlockAllocator::print_statistics() const
+{
+    VkAllocatorStatistics stat = statistics();
+
+    fprintf(stderr, "VkBlockAllocator memoryTypeIndex %u\n", memoryTypeIndex);
+    fprintf(stderr, "    chunk_count = %u\n", stat.chunk_count);
+    fprintf(stderr, "    allocation_count = %u\n", stat.allocation_count);
+    fprintf(stderr, "    allocated_bytes = %lu\n", stat.allocated_bytes);
+    fprintf(stderr, "    live_bytes = %lu\n", stat.live_bytes);
+    fprintf(stderr, "    free_bytes = %lu\n", stat.free_bytes);
+    fprintf(stderr, "    largest_free_bytes = %lu\n", stat.largest_free_bytes);
+    fprintf(stderr, "    fragmentation = %.3f\n", stat.fragmentation);
+}
+
+VkBlockAllocator* get_gpu_block_allocator(uint32_t memoryTypeIndex)
+{
+    if (memoryTypeIndex >= VK_MAX_MEMORY_TYPES)
+        return 0;
+
+    GpuContext* ctx = get_current_gpu_context();
+    if (!ctx->block_allocators[memoryTypeIndex])
+    {
+        ctx->block_allocators[memoryTypeIndex] = new VkBlockAllocator(memoryTypeIndex);
+    }
+
+    return ctx->block_allocators[memoryTypeIndex];
+}
+
+static void destroy_gpu_block_allocators(GpuContext* ctx)
+{
+    for (uint32_t i=0; i<VK_MAX_MEMORY_TYPES; i++)
+    {
+        delete ctx->block_allocators[i];
+        ctx->block_allocators[i] = 0;
+    }
+}
+
+static void record_buffer_barrier(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    VkBufferMemoryBarrier bufferBarrier;
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.pNext = 0;
+    bufferBarrier.srcAccessMask = srcAccessMask;
+    bufferBarrier.dstAccessMask = dstAccessMask;
+    bufferBarrier.srcQueueFamilyIndex = srcQueueFamilyIndex;
+    bufferBarrier.dstQueueFamilyIndex = dstQueueFamilyIndex;
+    bufferBarrier.buffer = buffer;
+    bufferBarrier.offset = offset;
+    bufferBarrier.size = size;
+
+    vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, 0, 1, &bufferBarrier, 0, 0);
+}
+
+void record_buffer_barrier(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask)
+{
+    record_buffer_barrier(commandBuffer, buffer, offset, size, srcAccessMask, dstAccessMask, srcStageMask, dstStageMask, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+}
+
+static void record_image_barrier(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    VkImageMemoryBarrier imageBarrier;
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.pNext = 0;
+    imageBarrier.srcAccessMask = srcAccessMask;
+    imageBarrier.dstAccessMask = dstAccessMask;
+    imageBarrier.oldLayout = oldLayout;
+    imageBarrier.newLayout = newLayout;
+    imageBarrier.srcQueueFamilyIndex = srcQueueFamilyIndex;
+    imageBarrier.dstQueueFamilyIndex = dstQueueFamilyIndex;
+    imageBarrier.image = image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.baseMipLevel = 0;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.baseArrayLayer = 0;
+    imageBarrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+    vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, 0, 0, 0, 1, &imageBarrier);
+}
+
+void record_image_barrier(VkCommandBuffer commandBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask)
+{
+    record_image_barrier(commandBuffer, image, oldLayout, newLayout, srcAccessMask, dstAccessMask, srcStageMask, dstStageMask, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+}
+
+// queue family ownership transfer, the release is recorded on the source queue and the matching acquire
+// on the destination queue, a semaphore between the two submits orders them
+// nothing is recorded within one family, the semaphore alone is enough there
+void record_buffer_release(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccessMask, VkPipelineStageFlags srcStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if (srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    record_buffer_barrier(commandBuffer, buffer, offset, size, srcAccessMask, 0, srcStageMask, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, srcQueueFamilyIndex, dstQueueFamilyIndex);
+}
+
+void record_buffer_acquire(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags dstAccessMask, VkPipelineStageFlags dstStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if (srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    record_buffer_barrier(commandBuffer, buffer, offset, size, 0, dstAccessMask, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStageMask, srcQueueFamilyIndex, dstQueueFamilyIndex);
+}
+
+// images stay in VK_IMAGE_LAYOUT_GENERAL across the transfer
+void record_image_release(VkCommandBuffer commandBuffer, VkImage image, VkAccessFlags srcAccessMask, VkPipelineStageFlags srcStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if (srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    record_image_barrier(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, srcAccessMask, 0, srcStageMask, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, srcQueueFamilyIndex, dstQueueFamilyIndex);
+}
+
+void record_image_acquire(VkCommandBuffer commandBuffer, VkImage image, VkAccessFlags dstAccessMask, VkPipelineStageFlags dstStageMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if (srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    record_image_barrier(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, 0, dstAccessMask, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStageMask, srcQueueFamilyIndex, dstQueueFamilyIndex);
+}
+
+// frame slot and submit serial of one end_frame, a serial mismatch means the frame already retired
+struct VkSubmitHandle
+{
+    int frame;
+    uint64_t serial;
+};
+
+// host visible staging buffer split into frame_count regions
+// uploads and downloads of a frame go through its region and are recorded into its command buffer,
+// a region is reused only after the fence of its previous submit signals
+// a transfer ring submits to the transfer queue, when that is another family its uploads release
+// the destination to the compute family and its downloads acquire the source from it
+class VkStagingRing
+{
+public:
+    VkStagingRing();
+    ~VkStagingRing();
+
+    // compute_queue picks one of the compute queues of the context, ignored for a transfer ring
+    int create(VkDeviceSize frame_size, int frame_count, bool transfer = false, int compute_queue = 0);
+    void destroy();
+
+    // wait for the slot to retire, finish its pending downloads and start recording
+    int begin_frame();
+
+    // submit the recorded frame with its fence, does not wait
+    int end_frame(VkSubmitHandle* handle = 0);
+
+    // same, the submit waits waitSemaphore at waitStage and signals signalSemaphore, either may be null
+    int end_frame(VkSubmitHandle* handle, VkSemaphore waitSemaphore, VkPipelineStageFlags waitStage, VkSemaphore signalSemaphore);
+
+    // poll without blocking, a completed frame finishes its pending downloads
+    bool is_complete(const VkSubmitHandle& handle);
+
+    // block until the frame of handle retires
+    int wait(const VkSubmitHandle& handle);
+
+    // wait for all frames in flight and finish their pending downloads
+    int wait_idle();
+
+    // callers index their per-frame resources with current_frame
+    int frame_count() const { return (int)frames.size(); }
+    int current_frame() const { return frame_index; }
+    VkCommandBuffer command_buffer() const { return frames[frame_index].commandBuffer; }
+
+    // reserve staging space in the current frame
+    int alloc(VkDeviceSize size, VkDeviceSize* offset, void** ptr);
+
+    // images are expected in VK_IMAGE_LAYOUT_GENERAL and are left in it
+    // a transfer ring of another family discards the previous image contents, the upload covers the whole image
+    // d is the depth of a 3d image, layers the array layers of a 2d one, host data is dense in both
+    int upload(const void* src, VkDeviceSize size, VkBuffer dst, VkDeviceSize dst_offset);
+    int upload(const void* src, VkImage dst, VkImageLayout oldLayout, int w, int h, int d, size_t elemsize, int layers = 1);
+
+    // dst is written when the frame retires
+    int download(VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size, void* dst);
+    int download(VkImage src, int w, int h, int d, size_t elemsize, void* dst, int layers = 1);
+
+public:
+    VkBuffer buffer;
+    VkQueue queue;
+    uint32_t queueFamilyIndex;
+
+private:
+    struct PendingDownload
+    {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        void* dst;
+    };
+
+    struct Frame
+    {
+        VkCommandBuffer commandBuffer;
+        VkFence fence;
+        bool submitted;
+        uint64_t serial;
+        VkDeviceSize cursor;
+        std::vector<PendingDownload> downloads;
+    };
+
+    int retire(Frame& frame);
+
+    VkMemoryBlock memoryBlock;
+    VkCommandPool commandPool;
+    VkDeviceSize frame_size;
+    int frame_index;
+    uint64_t submit_serial;
+    std::vector<Frame> frames;
+};
+
+VkStagingRing::VkStagingRing()
+{
+    buffer = 0;
+    queue = 0;
+    queueFamilyIndex = -1;
+    memoryBlock.memory = 0;
+    commandPool = 0;
+    frame_size = 0;
+    frame_index = 0;
+    submit_serial = 0;
+}
+
+VkStagingRing::~VkStagingRing()
+{
+    destroy();
+}
+
+int VkStagingRing::create(VkDeviceSize _frame_size, int frame_count, bool transfer, int compute_queue)
+{
+    VkDevice device = get_gpu_device();
+
+    queue = transfer ? get_gpu_transfer_queue() : get_gpu_compute_queue(compute_queue);
+    queueFamilyIndex = transfer ? get_gpu_transfer_queueFamilyIndex() : get_gpu_queueFamilyIndex();
+
+    frame_size = alignSize(_frame_size, 256);
+    frame_index = 0;
+
+    buffer = create_buffer(frame_size * frame_count, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    if (!buffer)
+        return -1;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
+
+    if (get_gpu_block_allocator(get_gpu_host_visible_memoryTypeIndex())->fastMalloc(memoryRequirements, true, &memoryBlock) != 0)
+        return -1;
+
+    VkResult ret = vkBindBufferMemory(device, buffer, memoryBlock.memory, memoryBlock.offset);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBindBufferMemory failed %d\n", ret);
+        return -1;
+    }
+
+    VkCommandPoolCreateInfo commandPoolCreateInfo;
+    commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    commandPoolCreateInfo.pNext = 0;
+    commandPoolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    commandPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
+
+    ret = vkCreateCommandPool(device, &commandPoolCreateInfo, 0, &commandPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateCommandPool failed %d\n", ret);
+        return -1;
+    }
+
+    frames.resize(frame_count);
+    for (int i=0; i<frame_count; i++)
+    {
+        Frame& frame = frames[i];
+        frame.commandBuffer = 0;
+        frame.fence = 0;
+        frame.submitted = false;
+        frame.serial = 0;
+        frame.cursor = 0;
+
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo;
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.pNext = 0;
+        commandBufferAllocateInfo.commandPool = commandPool;
+        commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferAllocateInfo.commandBufferCount = 1;
+
+        ret = vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, &frame.commandBuffer);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkAllocateCommandBuffers failed %d\n", ret);
+            return -1;
+        }
+
+        VkFenceCreateInfo fenceCreateInfo;
+        fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceCreateInfo.pNext = 0;
+        fenceCreateInfo.flags = 0;
+
+        ret = vkCreateFence(device, &fenceCreateInfo, 0, &frame.fence);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkCreateFence failed %d\n", ret);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void VkStagingRing::destroy()
+{
+    VkDevice device = get_gpu_device();
+
+    wait_idle();
+
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        vkDestroyFence(device, frames[i].fence, 0);
+    }
+    frames.clear();
+
+    if (commandPool)
+    {
+        vkDestroyCommandPool(device, commandPool, 0);
+        commandPool = 0;
+    }
+
+    if (buffer)
+    {
+        vkDestroyBuffer(device, buffer, 0);
+        buffer = 0;
+    }
+
+    if (memoryBlock.memory)
+    {
+        get_gpu_block_allocator(memoryBlock.memoryTypeIndex)->fastFree(memoryBlock);
+        memoryBlock.memory = 0;
+    }
+}
+
+int VkStagingRing::retire(Frame& frame)
+{
+    if (!frame.submitted)
+        return 0;
+
+    VkResult ret = vkWaitForFences(get_gpu_device(), 1, &frame.fence, VK_TRUE, (uint64_t)-1);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkWaitForFences failed %d\n", ret);
+        return -1;
+    }
+
+    vkResetFences(get_gpu_device(), 1, &frame.fence);
+
+    frame.submitted = false;
+
+    if (frame.downloads.empty())
+        return 0;
+
+    const VkDeviceSize base = (&frame - &frames[0]) * frame_size;
+
+    VkMemoryBlock region = memoryBlock;
+    region.offset = memoryBlock.offset + base;
+    region.size = frame.cursor;
+    invalidate_memory_block(region);
+
+    for (size_t i=0; i<frame.downloads.size(); i++)
+    {
+        const PendingDownload& download = frame.downloads[i];
+        memcpy(download.dst, (const unsigned char*)memoryBlock.mapped_ptr + base + download.offset, download.size);
+    }
+
+    frame.downloads.clear();
+
+    return 0;
+}
+
+int VkStagingRing::begin_frame()
+{
+    Frame& frame = frames[frame_index];
+
+    int ret = retire(frame);
+    if (ret != 0)
+        return ret;
+
+    frame.cursor = 0;
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo;
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = 0;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    commandBufferBeginInfo.pInheritanceInfo = 0;
+
+    VkResult vkret = vkBeginCommandBuffer(frame.commandBuffer, &commandBufferBeginInfo);
+    if (vkret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBeginCommandBuffer failed %d\n", vkret);
+        return -1;
+    }
+
+    return 0;
+}
+
+int VkStagingRing::end_frame(VkSubmitHandle* handle)
+{
+    return end_frame(handle, 0, 0, 0);
+}
+
+int VkStagingRing::end_frame(VkSubmitHandle* handle, VkSemaphore waitSemaphore, VkPipelineStageFlags waitStage, VkSemaphore signalSemaphore)
+{
+    Frame& frame = frames[frame_index];
+
+    if (!frame.downloads.empty())
+    {
+        // staging writes visible to host after the fence
+        VkMemoryBarrier memoryBarrier;
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.pNext = 0;
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+
+        vkCmdPipelineBarrier(frame.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+    }
+
+    VkResult ret = vkEndCommandBuffer(frame.commandBuffer);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkEndCommandBuffer failed %d\n", ret);
+        return -1;
+    }
+
+    VkMemoryBlock region = memoryBlock;
+    region.offset = memoryBlock.offset + frame_index * frame_size;
+    region.size = frame.cursor;
+    flush_memory_block(region);
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = 0;
+    submitInfo.waitSemaphoreCount = waitSemaphore ? 1 : 0;
+    submitInfo.pWaitSemaphores = &waitSemaphore;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &frame.commandBuffer;
+    submitInfo.signalSemaphoreCount = signalSemaphore ? 1 : 0;
+    submitInfo.pSignalSemaphores = &signalSemaphore;
+
+    ret = vkQueueSubmit(queue, 1, &submitInfo, frame.fence);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkQueueSubmit failed %d\n", ret);
+        return -1;
+    }
+
+    frame.submitted = true;
+    frame.serial = ++submit_serial;
+
+    if (handle)
+    {
+        handle->frame = frame_index;
+        handle->serial = frame.serial;
+    }
+
+    frame_index = (frame_index + 1) % frames.size();
+
+    return 0;
+}
+
+bool VkStagingRing::is_complete(const VkSubmitHandle& handle)
+{
+    Frame& frame = frames[handle.frame];
+
+    // retired already, maybe reused by a later submit
+    if (!frame.submitted || frame.serial != handle.serial)
+        return true;
+
+    if (vkGetFenceStatus(get_gpu_device(), frame.fence) != VK_SUCCESS)
+        return false;
+
+    retire(frame);
+
+    return true;
+}
+
+int VkStagingRing::wait(const VkSubmitHandle& handle)
+{
+    Frame& frame = frames[handle.frame];
+
+    if (!frame.submitted || frame.serial != handle.serial)
+        return 0;
+
+    return retire(frame);
+}
+
+int VkStagingRing::wait_idle()
+{
+    int ret = 0;
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        if (retire(frames[i]) != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int VkStagingRing::alloc(VkDeviceSize size, VkDeviceSize* offset, void** ptr)
+{
+    Frame& frame = frames[frame_index];
+
+    VkDeviceSize alignment = 16;
+    if (get_gpu_info().properties.limits.optimalBufferCopyOffsetAlignment > alignment)
+        alignment = get_gpu_info().properties.limits.optimalBufferCopyOffsetAlignment;
+
+    VkDeviceSize aligned_cursor = alignSize(frame.cursor, alignment);
+    if (aligned_cursor + size > frame_size)
+    {
+        fprintf(stderr, "staging ring frame %d full, %lu + %lu > %lu\n", frame_index, aligned_cursor, size, frame_size);
+        return -1;
+    }
+
+    frame.cursor = aligned_cursor + size;
+
+    *offset = frame_index * frame_size + aligned_cursor;
+    if (ptr)
+        *ptr = (unsigned char*)memoryBlock.mapped_ptr + *offset;
+
+    return 0;
+}
+
+int VkStagingRing::upload(const void* src, VkDeviceSize size, VkBuffer dst, VkDeviceSize dst_offset)
+{
+    VkDeviceSize offset;
+    void* ptr;
+    if (alloc(size, &offset, &ptr) != 0)
+        return -1;
+
+    memcpy(ptr, src, size);
+
+    VkCommandBuffer commandBuffer = command_buffer();
+
+    if (queueFamilyIndex != get_gpu_queueFamilyIndex())
+    {
+        // compute stages do not exist here, hand the written range over to the compute family
+        VkBufferCopy region;
+        region.srcOffset = offset;
+        region.dstOffset = dst_offset;
+        region.size = size;
+
+        vkCmdCopyBuffer(commandBuffer, buffer, dst, 1, &region);
+
+        record_buffer_release(commandBuffer, dst, dst_offset, size, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, queueFamilyIndex, get_gpu_queueFamilyIndex());
+
+        return 0;
+    }
+
+    record_buffer_barrier(commandBuffer, dst, dst_offset, size,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+    VkBufferCopy region;
+    region.srcOffset = offset;
+    region.dstOffset = dst_offset;
+    region.size = size;
+
+    vkCmdCopyBuffer(commandBuffer, buffer, dst, 1, &region);
+
+    record_buffer_barrier(commandBuffer, dst, dst_offset, size,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    return 0;
+}
+
+int VkStagingRing::upload(const void* src, VkImage dst, VkImageLayout oldLayout, int w, int h, int d, size_t elemsize, int layers)
+{
+    const VkDeviceSize size = (VkDeviceSize)w * h * d * layers * elemsize;
+
+    VkDeviceSize offset;
+    void* ptr;
+    if (alloc(size, &offset, &ptr) != 0)
+        return -1;
+
+    memcpy(ptr, src, size);
+
+    VkCommandBuffer commandBuffer = command_buffer();
+
+    const bool foreign = queueFamilyIndex != get_gpu_queueFamilyIndex();
+
+    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED || foreign)
+    {
+        record_image_barrier(commandBuffer, dst, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+            0, VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }
+    else
+    {
+        record_image_barrier(commandBuffer, dst, oldLayout, VK_IMAGE_LAYOUT_GENERAL,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }
+
+    VkBufferImageCopy region;
+    region.bufferOffset = offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = layers;
+    region.imageOffset.x = 0;
+    region.imageOffset.y = 0;
+    region.imageOffset.z = 0;
+    region.imageExtent.width = w;
+    region.imageExtent.height = h;
+    region.imageExtent.depth = d;
+
+    vkCmdCopyBufferToImage(commandBuffer, buffer, dst, VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+
+    if (foreign)
+    {
+        record_image_release(commandBuffer, dst, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, queueFamilyIndex, get_gpu_queueFamilyIndex());
+        return 0;
+    }
+
+    record_image_barrier(commandBuffer, dst, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    return 0;
+}
+
+int VkStagingRing::download(VkBuffer src, VkDeviceSize src_offset, VkDeviceSize size, void* dst)
+{
+    VkDeviceSize offset;
+    if (alloc(size, &offset, 0) != 0)
+        return -1;
+
+    VkCommandBuffer commandBuffer = command_buffer();
+
+    if (queueFamilyIndex != get_gpu_queueFamilyIndex())
+    {
+        // the compute side released src after writing it
+        record_buffer_acquire(commandBuffer, src, src_offset, size, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, get_gpu_queueFamilyIndex(), queueFamilyIndex);
+    }
+    else
+    {
+        record_buffer_barrier(commandBuffer, src, src_offset, size,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }
+
+    VkBufferCopy region;
+    region.srcOffset = src_offset;
+    region.dstOffset = offset;
+    region.size = size;
+
+    vkCmdCopyBuffer(commandBuffer, src, buffer, 1, &region);
+
+    PendingDownload download;
+    download.offset = offset - frame_index * frame_size;
+    download.size = size;
+    download.dst = dst;
+    frames[frame_index].downloads.push_back(download);
+
+    return 0;
+}
+
+int VkStagingRing::download(VkImage src, int w, int h, int d, size_t elemsize, void* dst, int layers)
+{
+    const VkDeviceSize size = (VkDeviceSize)w * h * d * layers * elemsize;
+
+    VkDeviceSize offset;
+    if (alloc(size, &offset, 0) != 0)
+        return -1;
+
+    VkCommandBuffer commandBuffer = command_buffer();
+
+    if (queueFamilyIndex != get_gpu_queueFamilyIndex())
+    {
+        // the compute side released src after writing it
+        record_image_acquire(commandBuffer, src, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, get_gpu_queueFamilyIndex(), queueFamilyIndex);
+    }
+    else
+    {
+        record_image_barrier(commandBuffer, src, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    }
+
+    VkBufferImageCopy region;
+    region.bufferOffset = offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = layers;
+    region.imageOffset.x = 0;
+    region.imageOffset.y = 0;
+    region.imageOffset.z = 0;
+    region.imageExtent.width = w;
+    region.imageExtent.height = h;
+    region.imageExtent.depth = d;
+
+    vkCmdCopyImageToBuffer(commandBuffer, src, VK_IMAGE_LAYOUT_GENERAL, buffer, 1, &region);
+
+    PendingDownload download;
+    download.offset = offset - frame_index * frame_size;
+    download.size = size;
+    download.dst = dst;
+    frames[frame_index].downloads.push_back(download);
+
+    return 0;
+}
+
+// read-only mapping of a whole file, pages are read in on first touch
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    int create(const char* path);
+    void destroy();
+
+    const void* data() const { return ptr; }
+    size_t size() const { return length; }
+
+    // start reading the range ahead of its first touch
+    void prefetch(size_t offset, size_t size);
+
+    // drop the range from the mapping, a later touch reads it again
+    void release(size_t offset, size_t size);
+
+private:
+    void* ptr;
+    size_t length;
+};
+
+MappedFile::MappedFile()
+{
+    ptr = 0;
+    length = 0;
+}
+
+MappedFile::~MappedFile()
+{
+    destroy();
+}
+
+int MappedFile::create(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "fstat %s failed\n", path);
+        close(fd);
+        return -1;
+    }
+
+    length = (size_t)st.st_size;
+
+    // an empty file has nothing to map
+    if (length > 0)
+    {
+        ptr = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            fprintf(stderr, "mmap %s failed\n", path);
+            ptr = 0;
+            length = 0;
+            close(fd);
+            return -1;
+        }
+
+        madvise(ptr, length, MADV_SEQUENTIAL);
+    }
+
+    // the mapping keeps the file
+    close(fd);
+
+    return 0;
+}
+
+void MappedFile::destroy()
+{
+    if (ptr)
+        munmap(ptr, length);
+
+    ptr = 0;
+    length = 0;
+}
+
+void MappedFile::prefetch(size_t offset, size_t size)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t begin = offset / page_size * page_size;
+    madvise((unsigned char*)ptr + begin, offset + size - begin, MADV_WILLNEED);
+}
+
+void MappedFile::release(size_t offset, size_t size)
+{
+    // whole pages inside the range only, the neighbours may still be in use
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t begin = alignSize(offset, page_size);
+    const size_t end = offset + size == length ? length : (offset + size) / page_size * page_size;
+    if (end > begin)
+        madvise((unsigned char*)ptr + begin, end - begin, MADV_DONTNEED);
+}
+
+// copy the whole file into dst at dst_offset without a host copy of it, one chunk_size piece per ring frame
+// the ring frames must hold chunk_size, with two or more the host reads chunk n+1 while the gpu copies chunk n
+// consumed pages leave the mapping, host memory stays near frame_count chunks of staging
+// the last frames may still be in flight, wait on the ring before using dst
+int stream_file_to_buffer(VkStagingRing& ring, const char* path, VkBuffer dst, VkDeviceSize dst_offset, size_t chunk_size, size_t* loaded_size)
+{
+    MappedFile file;
+    if (file.create(path) != 0)
+        return -1;
+
+    const unsigned char* data = (const unsigned char*)file.data();
+    const size_t size = file.size();
+
+    file.prefetch(0, std::min(chunk_size, size));
+
+    for (size_t pos=0; pos<size; pos+=chunk_size)
+    {
+        const size_t n = std::min(chunk_size, size - pos);
+
+        if (pos + n < size)
+            file.prefetch(pos + n, std::min(chunk_size, size - pos - n));
+
+        if (ring.begin_frame() != 0)
+            return -1;
+
+        int ret = ring.upload(data + pos, n, dst, dst_offset + pos);
+
+        // the pages stay mapped unless the chunk went out
+        if (ring.end_frame() != 0)
+            return -1;
+
+        if (ret != 0)
+        {
+            fprintf(stderr, "stream %s failed at %lu\n", path, (unsigned long)pos);
+            return -1;
+        }
+
+        file.release(pos, n);
+    }
+
+    if (loaded_size)
+        *loaded_size = size;
+
+    return 0;
+}
+
+// gpu timestamps, query 2*i and 2*i+1 bracket measured region i
+class VkTimestampQueryPool
+{
+public:
+    VkTimestampQueryPool();
+    ~VkTimestampQueryPool();
+
+    int create(uint32_t region_count);
+    void destroy();
+
+    // record at the start of the command buffer, before any write
+    void reset(VkCommandBuffer commandBuffer);
+
+    void begin_region(VkCommandBuffer commandBuffer, uint32_t region);
+    void end_region(VkCommandBuffer commandBuffer, uint32_t region);
+
+    // wait for the results and convert to ms with timestampPeriod
+    int get_elapsed(std::vector<double>& elapsed);
+
+public:
+    VkQueryPool queryPool;
+    uint32_t query_count;
+};
+
+VkTimestampQueryPool::VkTimestampQueryPool()
+{
+    queryPool = 0;
+    query_count = 0;
+}
+
+VkTimestampQueryPool::~VkTimestampQueryPool()
+{
+    destroy();
+}
+
+int VkTimestampQueryPool::create(uint32_t region_count)
+{
+    if (get_gpu_info().timestampValidBits == 0)
+    {
+        fprintf(stderr, "timestamp query not supported on queue family %u\n", get_gpu_queueFamilyIndex());
+        return -1;
+    }
+
+    query_count = region_count * 2;
+
+    VkQueryPoolCreateInfo queryPoolCreateInfo;
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.pNext = 0;
+    queryPoolCreateInfo.flags = 0;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = query_count;
+    queryPoolCreateInfo.pipelineStatistics = 0;
+
+    VkResult ret = vkCreateQueryPool(get_gpu_device(), &queryPoolCreateInfo, 0, &queryPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateQueryPool failed %d\n", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+void VkTimestampQueryPool::destroy()
+{
+    if (!queryPool)
+        return;
+
+    vkDestroyQueryPool(get_gpu_device(), queryPool, 0);
+    queryPool = 0;
+    query_count = 0;
+}
+
+void VkTimestampQueryPool::reset(VkCommandBuffer commandBuffer)
+{
+    vkCmdResetQueryPool(commandBuffer, queryPool, 0, query_count);
+}
+
+void VkTimestampQueryPool::begin_region(VkCommandBuffer commandBuffer, uint32_t region)
+{
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, region * 2);
+}
+
+void VkTimestampQueryPool::end_region(VkCommandBuffer commandBuffer, uint32_t region)
+{
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, region * 2 + 1);
+}
+
+int VkTimestampQueryPool::get_elapsed(std::vector<double>& elapsed)
+{
+    std::vector<uint64_t> timestamps(query_count);
+
+    VkResult ret = vkGetQueryPoolResults(get_gpu_device(), queryPool, 0, query_count, query_count * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkGetQueryPoolResults failed %d\n", ret);
+        return -1;
+    }
+
+    // only the low timestampValidBits are meaningful, the difference survives one wrap around
+    const uint64_t mask = get_gpu_info().timestampValidBits >= 64 ? (uint64_t)-1 : ((uint64_t)1 << get_gpu_info().timestampValidBits) - 1;
+    const double period = get_gpu_info().properties.limits.timestampPeriod;
+
+    elapsed.resize(query_count / 2);
+    for (uint32_t i=0; i<query_count / 2; i++)
+    {
+        uint64_t ticks = (timestamps[i * 2 + 1] - timestamps[i * 2]) & mask;
+        elapsed[i] = ticks * period / 1000000.0;
+    }
+
+    return 0;
+}
+
+double get_current_time()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(now.time_since_epoch()).count();
+}
+
+#if VKTEST_EMBED_SPIRV
+// spirv compiled into the binary, each header is the hex text glslangValidator writes with -x
+// ./gen_spirv.sh hex generates all of them from the variants listed in the .comp sources
+static constexpr uint32_t imagetest_comp_spv_data[] = {
+#include "imagetest.comp.spv.hex.h"
+};
+static constexpr uint32_t imagetest_buffer_comp_spv_data[] = {
+#include "imagetest_buffer.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_comp_spv_data[] = {
+#include "imagescale.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_fp16_comp_spv_data[] = {
+#include "imagescale_fp16.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_fp32_pack4_comp_spv_data[] = {
+#include "imagescale_fp32_pack4.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_fp16_pack4_comp_spv_data[] = {
+#include "imagescale_fp16_pack4.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_buffer_comp_spv_data[] = {
+#include "imagescale_buffer.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_3d_comp_spv_data[] = {
+#include "imagescale_3d.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_array_comp_spv_data[] = {
+#include "imagescale_array.comp.spv.hex.h"
+};
+static constexpr uint32_t imagescale_parameter_comp_spv_data[] = {
+#include "imagescale_parameter.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp32_to_fp16_comp_spv_data[] = {
+#include "imageconvert_fp32_to_fp16.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp32_to_fp32_pack4_comp_spv_data[] = {
+#include "imageconvert_fp32_to_fp32_pack4.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp32_to_fp16_pack4_comp_spv_data[] = {
+#include "imageconvert_fp32_to_fp16_pack4.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp16_to_fp32_comp_spv_data[] = {
+#include "imageconvert_fp16_to_fp32.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp32_pack4_to_fp32_comp_spv_data[] = {
+#include "imageconvert_fp32_pack4_to_fp32.comp.spv.hex.h"
+};
+static constexpr uint32_t imageconvert_fp16_pack4_to_fp32_comp_spv_data[] = {
+#include "imageconvert_fp16_pack4_to_fp32.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_image_comp_spv_data[] = {
+#include "reduce_sum_image.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_buffer_comp_spv_data[] = {
+#include "reduce_sum_buffer.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_partial_comp_spv_data[] = {
+#include "reduce_sum_partial.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_image_comp_spv_data[] = {
+#include "reduce_max_image.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_buffer_comp_spv_data[] = {
+#include "reduce_max_buffer.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_partial_comp_spv_data[] = {
+#include "reduce_max_partial.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_image_comp_spv_data[] = {
+#include "reduce_argmax_image.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_buffer_comp_spv_data[] = {
+#include "reduce_argmax_buffer.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_partial_comp_spv_data[] = {
+#include "reduce_argmax_partial.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_image_subgroup_comp_spv_data[] = {
+#include "reduce_sum_image_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_buffer_subgroup_comp_spv_data[] = {
+#include "reduce_sum_buffer_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_sum_partial_subgroup_comp_spv_data[] = {
+#include "reduce_sum_partial_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_image_subgroup_comp_spv_data[] = {
+#include "reduce_max_image_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_buffer_subgroup_comp_spv_data[] = {
+#include "reduce_max_buffer_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_max_partial_subgroup_comp_spv_data[] = {
+#include "reduce_max_partial_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_image_subgroup_comp_spv_data[] = {
+#include "reduce_argmax_image_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_buffer_subgroup_comp_spv_data[] = {
+#include "reduce_argmax_buffer_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t reduce_argmax_partial_subgroup_comp_spv_data[] = {
+#include "reduce_argmax_partial_subgroup.comp.spv.hex.h"
+};
+static constexpr uint32_t gemm_comp_spv_data[] = {
+#include "gemm.comp.spv.hex.h"
+};
+static constexpr uint32_t gemm_buffer_comp_spv_data[] = {
+#include "gemm_buffer.comp.spv.hex.h"
+};
+#endif // VKTEST_EMBED_SPIRV
+
+struct EmbeddedSpirv
+{
+    const char* spv_path;
+    const uint32_t* code;
+    size_t size;// in bytes
+};
+
+#if VKTEST_EMBED_SPIRV
+#define VKTEST_EMBEDDED_SPIRV(spv_path, data) { spv_path, data, sizeof(data) }
+static const EmbeddedSpirv g_embedded_spirvs[] =
+{
+    VKTEST_EMBEDDED_SPIRV("imagetest.comp.spv", imagetest_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagetest_buffer.comp.spv", imagetest_buffer_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale.comp.spv", imagescale_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_fp16.comp.spv", imagescale_fp16_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_fp32_pack4.comp.spv", imagescale_fp32_pack4_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_fp16_pack4.comp.spv", imagescale_fp16_pack4_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_buffer.comp.spv", imagescale_buffer_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_3d.comp.spv", imagescale_3d_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_array.comp.spv", imagescale_array_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imagescale_parameter.comp.spv", imagescale_parameter_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp32_to_fp16.comp.spv", imageconvert_fp32_to_fp16_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp32_to_fp32_pack4.comp.spv", imageconvert_fp32_to_fp32_pack4_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp32_to_fp16_pack4.comp.spv", imageconvert_fp32_to_fp16_pack4_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp16_to_fp32.comp.spv", imageconvert_fp16_to_fp32_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp32_pack4_to_fp32.comp.spv", imageconvert_fp32_pack4_to_fp32_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("imageconvert_fp16_pack4_to_fp32.comp.spv", imageconvert_fp16_pack4_to_fp32_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_image.comp.spv", reduce_sum_image_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_buffer.comp.spv", reduce_sum_buffer_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_partial.comp.spv", reduce_sum_partial_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_image.comp.spv", reduce_max_image_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_buffer.comp.spv", reduce_max_buffer_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_partial.comp.spv", reduce_max_partial_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_image.comp.spv", reduce_argmax_image_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_buffer.comp.spv", reduce_argmax_buffer_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_partial.comp.spv", reduce_argmax_partial_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_image_subgroup.comp.spv", reduce_sum_image_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_buffer_subgroup.comp.spv", reduce_sum_buffer_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_sum_partial_subgroup.comp.spv", reduce_sum_partial_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_image_subgroup.comp.spv", reduce_max_image_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_buffer_subgroup.comp.spv", reduce_max_buffer_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_max_partial_subgroup.comp.spv", reduce_max_partial_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_image_subgroup.comp.spv", reduce_argmax_image_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_buffer_subgroup.comp.spv", reduce_argmax_buffer_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("reduce_argmax_partial_subgroup.comp.spv", reduce_argmax_partial_subgroup_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("gemm.comp.spv", gemm_comp_spv_data),
+    VKTEST_EMBEDDED_SPIRV("gemm_buffer.comp.spv", gemm_buffer_comp_spv_data),
+};
+#undef VKTEST_EMBEDDED_SPIRV
+#endif // VKTEST_EMBED_SPIRV
+
+// registry lookup by the .spv name, 0 when the shader is not compiled in
+const EmbeddedSpirv* find_embedded_spirv(const char* spv_path)
+{
+#if VKTEST_EMBED_SPIRV
+    const int count = sizeof(g_embedded_spirvs) / sizeof(g_embedded_spirvs[0]);
+    for (int i=0; i<count; i++)
+    {
+        if (strcmp(g_embedded_spirvs[i].spv_path, spv_path) == 0)
+            return &g_embedded_spirvs[i];
+    }
+#else
+    (void)spv_path;
+#endif // VKTEST_EMBED_SPIRV
+
+    return 0;
+}
+
+static VkShaderModule create_shader_module(const uint32_t* code, size_t size, const char* spv_path)
+{
+    // shader module
+    VkShaderModuleCreateInfo shaderModuleCreateInfo;
+    shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderModuleCreateInfo.pNext = 0;
+    shaderModuleCreateInfo.flags = 0;
+    shaderModuleCreateInfo.codeSize = size;
+    shaderModuleCreateInfo.pCode = code;
+
+    VkShaderModule shaderModule = 0;
+    VkResult ret = vkCreateShaderModule(get_gpu_device(), &shaderModuleCreateInfo, 0, &shaderModule);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateShaderModule %s failed %d\n", spv_path, ret);
+        return 0;
+    }
+
+    return shaderModule;
+}
+
+// the embedded spirv wins, the .spv file next to the binary is the fallback
+VkShaderModule create_shader_module(const char* spv_path)
+{
+    const EmbeddedSpirv* embedded = find_embedded_spirv(spv_path);
+    if (embedded)
+        return create_shader_module(embedded->code, embedded->size, spv_path);
+
+    std::string spv = read_file(spv_path);
+
+    // spirv is a stream of 32-bit words starting with the magic number
+    if (spv.size() < 20 || spv.size() % 4 != 0 || *(const uint32_t*)spv.data() != 0x07230203)
+    {
+        fprintf(stderr, "invalid spirv %s size %d\n", spv_path, (int)spv.size());
+        return 0;
+    }
+
+    return create_shader_module((const uint32_t*)spv.data(), spv.size(), spv_path);
+}
+
+// created on first use and shared by every pipeline of the context, they live until destroy_gpu_device
+VkShaderModule get_shader_module(const char* spv_path)
+{
+    std::vector<ShaderModuleCacheEntry>& shader_module_cache = get_current_gpu_context()->shader_module_cache;
+
+    for (size_t i=0; i<shader_module_cache.size(); i++)
+    {
+        const ShaderModuleCacheEntry& entry = shader_module_cache[i];
+        if (entry.spv_path == spv_path)
+            return entry.shaderModule;
+    }
+
+    VkShaderModule shaderModule = create_shader_module(spv_path);
+    if (!shaderModule)
+        return 0;
+
+    ShaderModuleCacheEntry entry;
+    entry.spv_path = spv_path;
+    entry.shaderModule = shaderModule;
+    shader_module_cache.push_back(entry);
+
+    return shaderModule;
+}
+
+static void destroy_gpu_shader_module_cache(GpuContext* ctx)
+{
+    for (size_t i=0; i<ctx->shader_module_cache.size(); i++)
+    {
+        vkDestroyShaderModule(ctx->device, ctx->shader_module_cache[i].shaderModule, 0);
+    }
+    ctx->shader_module_cache.clear();
+}
+
+// spirv variants compiled at runtime from the .comp sources
+// with VKTEST_GLSLANG the compiler is glslang linked in, otherwise glslangValidator from PATH
+// every variant lands in a file named by the hash of source, defines and target environment
+// the file doubles as the spv_path of create_compute_pipeline, later runs find it on disk
+static const char* get_spirv_cache_prefix()
+{
+    const char* prefix = getenv("VKTEST_SPIRV_CACHE");
+    return prefix ? prefix : "imagetest.spv.";
+}
+
+// spirv 1.3 needs vulkan 1.1, older devices get spirv 1.0
+static const char* get_spirv_target_env(uint32_t apiVersion)
+{
+    return get_api_version(apiVersion) >= VK_MAKE_VERSION(1, 1, 0) ? "vulkan1.1" : "vulkan1.0";
+}
+
+// 64-bit fnv-1a
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i=0; i<size; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static std::string get_spirv_variant_path(const std::string& source, const std::vector<std::string>& defines, const char* target_env)
+{
+#if VKTEST_GLSLANG
+    const char* compiler = "glslang";
+#else
+    const char* compiler = "glslangValidator";
+#endif
+
+    // the terminating zeros keep "AB" "C" apart from "A" "BC"
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hash_bytes(hash, compiler, strlen(compiler) + 1);
+    hash = hash_bytes(hash, target_env, strlen(target_env) + 1);
+    for (size_t i=0; i<defines.size(); i++)
+    {
+        hash = hash_bytes(hash, defines[i].c_str(), defines[i].size() + 1);
+    }
+    hash = hash_bytes(hash, source.data(), source.size());
+
+    char name[32];
+    sprintf(name, "%016llx.spv", (unsigned long long)hash);
+    return std::string(get_spirv_cache_prefix()) + name;
+}
+
+#if VKTEST_GLSLANG
+// defines are NAME or NAME=VALUE as for glslangValidator -D
+static int compile_spirv(const char* comp_path, const std::string& source, const std::vector<std::string>& defines, const char* target_env, std::vector<uint32_t>& spirv)
+{
+    std::string preamble;
+    for (size_t i=0; i<defines.size(); i++)
+    {
+        std::string define = defines[i];
+        size_t eq = define.find('=');
+        if (eq != std::string::npos)
+            define[eq] = ' ';
+
+        preamble += "#define " + define + "\n";
+    }
+
+    const bool vulkan1_1 = strcmp(target_env, "vulkan1.1") == 0;
+
+    const char* source_data = source.c_str();
+
+    glslang::TShader shader(EShLangCompute);
+    shader.setStrings(&source_data, 1);
+    shader.setPreamble(preamble.c_str());
+    shader.setEnvInput(glslang::EShSourceGlsl, EShLangCompute, glslang::EShClientVulkan, 100);
+    shader.setEnvClient(glslang::EShClientVulkan, vulkan1_1 ? glslang::EShTargetVulkan_1_1 : glslang::EShTargetVulkan_1_0);
+    shader.setEnvTarget(glslang::EShTargetSpv, vulkan1_1 ? glslang::EShTargetSpv_1_3 : glslang::EShTargetSpv_1_0);
+
+    if (!shader.parse(GetDefaultResources(), 100, false, EShMsgDefault))
+    {
+        fprintf(stderr, "glslang compile %s failed\n%s\n", comp_path, shader.getInfoLog());
+        return -1;
+    }
+
+    glslang::TProgram program;
+    program.addShader(&shader);
+
+    if (!program.link(EShMsgDefault))
+    {
+        fprintf(stderr, "glslang link %s failed\n%s\n", comp_path, program.getInfoLog());
+        return -1;
+    }
+
+    std::vector<unsigned int> words;
+    glslang::GlslangToSpv(*program.getIntermediate(EShLangCompute), words);
+
+    spirv.assign(words.begin(), words.end());
+
+    return 0;
+}
+#else
+static int compile_spirv(const char* comp_path, const std::string& /*source*/, const std::vector<std::string>& defines, const char* target_env, std::vector<uint32_t>& spirv)
+{
+    // the output goes aside, the caller writes the cache file, mkstemp keeps processes sharing the cache apart
+    std::string tmppath = std::string(get_spirv_cache_prefix()) + "tmp.XXXXXX";
+    int tmpfd = mkstemp(&tmppath[0]);
+    if (tmpfd == -1)
+    {
+        fprintf(stderr, "mkstemp %s failed\n", tmppath.c_str());
+        return -1;
+    }
+    close(tmpfd);
+
+    // an argument vector, defines and paths reach the compiler as is without a shell
+    std::vector<std::string> args;
+    args.push_back("glslangValidator");
+    args.push_back("-V");
+    args.push_back("--target-env");
+    args.push_back(target_env);
+    for (size_t i=0; i<defines.size(); i++)
+    {
+        args.push_back("-D" + defines[i]);
+    }
+    args.push_back(comp_path);
+    args.push_back("-o");
+    args.push_back(tmppath);
+
+    std::vector<char*> argv;
+    for (size_t i=0; i<args.size(); i++)
+    {
+        argv.push_back(&args[i][0]);
+    }
+    argv.push_back(0);
+
+    // stdout and stderr of the compiler go to one pipe
+    int pipefd[2];
+    if (pipe(pipefd) != 0)
+    {
+        fprintf(stderr, "pipe failed\n");
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawn_file_actions_addclose(&file_actions, pipefd[0]);
+    posix_spawn_file_actions_adddup2(&file_actions, pipefd[1], 1);
+    posix_spawn_file_actions_adddup2(&file_actions, pipefd[1], 2);
+    posix_spawn_file_actions_addclose(&file_actions, pipefd[1]);
+
+    pid_t pid;
+    int ret = posix_spawnp(&pid, argv[0], &file_actions, 0, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&file_actions);
+    close(pipefd[1]);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "posix_spawnp glslangValidator failed %d\n", ret);
+        close(pipefd[0]);
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    std::string log;
+    char buf[256];
+    ssize_t nread;
+    while ((nread = read(pipefd[0], buf, sizeof(buf))) > 0)
+    {
+        log.append(buf, nread);
+    }
+    close(pipefd[0]);
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "glslangValidator %s failed %d\n%s", comp_path, status, log.c_str());
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    std::string data = read_file(tmppath.c_str());
+    remove(tmppath.c_str());
+
+    if (data.empty() || data.size() % 4 != 0)
+        return -1;
+
+    spirv.resize(data.size() / 4);
+    memcpy(spirv.data(), data.data(), data.size());
+
+    return 0;
+}
+#endif // VKTEST_GLSLANG
+
+// compiles requested variants on its own threads, the requesting thread never waits for the compiler
+// a variant already in the on-disk cache is ready on request
+class VkSpirvCompiler
+{
+public:
+    VkSpirvCompiler();
+    ~VkSpirvCompiler();
+
+    int create(int num_threads = 1);
+    void destroy();
+
+    // variant of comp_path for the current device, returns the spv_path it will have, empty on a missing source
+    std::string request(const char* comp_path, const std::vector<std::string>& defines);
+
+    // 1 ready, 0 queued or compiling, -1 failed
+    int query(const std::string& spv_path);
+
+    // blocks until the variant is ready or failed, 0 when ready
+    int wait(const std::string& spv_path);
+
+private:
+    struct Job
+    {
+        std::string comp_path;
+        std::string source;
+        std::vector<std::string> defines;
+        std::string target_env;
+        std::string spv_path;
+    };
+
+    void worker();
+    int compile(const Job& job);
+    int get_state(const std::string& spv_path) const;
+
+private:
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable job_condition;
+    std::condition_variable done_condition;
+
+    std::deque<Job> jobs;
+    std::unordered_map<std::string, int> states;// by spv_path
+    bool quit;
+};
+
+VkSpirvCompiler::VkSpirvCompiler()
+{
+    quit = false;
+}
+
+VkSpirvCompiler::~VkSpirvCompiler()
+{
+    destroy();
+}
+
+int VkSpirvCompiler::create(int num_threads)
+{
+#if VKTEST_GLSLANG
+    glslang::InitializeProcess();
+#endif
+
+    quit = false;
+    for (int i=0; i<std::max(num_threads, 1); i++)
+    {
+        threads.push_back(std::thread(&VkSpirvCompiler::worker, this));
+    }
+
+    return 0;
+}
+
+void VkSpirvCompiler::destroy()
+{
+    if (threads.empty())
+        return;
+
+    // queued variants fail, the ones compiling finish
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+        for (size_t i=0; i<jobs.size(); i++)
+        {
+            states[jobs[i].spv_path] = -1;
+        }
+        jobs.clear();
+    }
+    job_condition.notify_all();
+    done_condition.notify_all();
+
+    for (size_t i=0; i<threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    threads.clear();
+
+#if VKTEST_GLSLANG
+    glslang::FinalizeProcess();
+#endif
+}
+
+std::string VkSpirvCompiler::request(const char* comp_path, const std::vector<std::string>& defines)
+{
+    Job job;
+    job.comp_path = comp_path;
+    job.source = read_file(comp_path);
+    job.defines = defines;
+    job.target_env = get_spirv_target_env(get_current_gpu_context()->info.properties.apiVersion);
+
+    if (job.source.empty())
+        return std::string();
+
+    job.spv_path = get_spirv_variant_path(job.source, job.defines, job.target_env.c_str());
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (states.find(job.spv_path) != states.end())
+        return job.spv_path;
+
+    FILE* fp = fopen(job.spv_path.c_str(), "rb");
+    if (fp)
+    {
+        fclose(fp);
+        states[job.spv_path] = 1;
+        return job.spv_path;
+    }
+
+    states[job.spv_path] = 0;
+    jobs.push_back(job);
+    job_condition.notify_one();
+
+    return job.spv_path;
+}
+
+int VkSpirvCompiler::query(const std::string& spv_path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return get_state(spv_path);
+}
+
+// lock held, -1 for a variant never requested
+int VkSpirvCompiler::get_state(const std::string& spv_path) const
+{
+    std::unordered_map<std::string, int>::const_iterator it = states.find(spv_path);
+    return it == states.end() ? -1 : it->second;
+}
+
+int VkSpirvCompiler::wait(const std::string& spv_path)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    // look up again after every wakeup, a request while unlocked may rehash states
+    done_condition.wait(guard, [&]() { return get_state(spv_path) != 0; });
+
+    return get_state(spv_path) == 1 ? 0 : -1;
+}
+
+int VkSpirvCompiler::compile(const Job& job)
+{
+    double t0 = get_current_time();
+
+    std::vector<uint32_t> spirv;
+    if (compile_spirv(job.comp_path.c_str(), job.source, job.defines, job.target_env.c_str(), spirv) != 0)
+        return -1;
+
+    // write aside and rename, a reader never sees a partial variant
+    const std::string tmppath = job.spv_path + ".tmp";
+
+    FILE* fp = fopen(tmppath.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", tmppath.c_str());
+        return -1;
+    }
+
+    size_t nwrite = fwrite(spirv.data(), sizeof(uint32_t), spirv.size(), fp);
+    fclose(fp);
+
+    if (nwrite != spirv.size() || rename(tmppath.c_str(), job.spv_path.c_str()) != 0)
+    {
+        fprintf(stderr, "write spirv variant %s failed\n", job.spv_path.c_str());
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    double t1 = get_current_time();
+
+    VKTEST_LOGI("compile %s %s %d defines %.3f ms\n", job.comp_path.c_str(), job.spv_path.c_str(), (int)job.defines.size(), t1 - t0);
+
+    return 0;
+}
+
+void VkSpirvCompiler::worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        job_condition.wait(guard, [this]() { return quit || !jobs.empty(); });
+        if (quit)
+            return;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        guard.unlock();
+
+        int ret = compile(job);
+
+        guard.lock();
+        states[job.spv_path] = ret == 0 ? 1 : -1;
+        done_condition.notify_all();
+    }
+}
+
+// set layouts keyed by their binding types, pipeline layouts keyed by their set layout and push constant size
+// pipelines with the same signature share them, they live until destroy_gpu_device
+VkDescriptorSetLayout get_descriptor_set_layout(const VkDescriptorType* descriptorTypes, int binding_count)
+{
+    std::vector<DescriptorSetLayoutCacheEntry>& descriptor_set_layout_cache = get_current_gpu_context()->descriptor_set_layout_cache;
+
+    for (size_t i=0; i<descriptor_set_layout_cache.size(); i++)
+    {
+        const DescriptorSetLayoutCacheEntry& entry = descriptor_set_layout_cache[i];
+        if ((int)entry.descriptorTypes.size() == binding_count && std::equal(descriptorTypes, descriptorTypes + binding_count, entry.descriptorTypes.begin()))
+            return entry.descriptorSetLayout;
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> descriptorSetLayoutBindings(binding_count);
+    for (int i=0; i<binding_count; i++)
+    {
+        descriptorSetLayoutBindings[i].binding = i;
+        descriptorSetLayoutBindings[i].descriptorType = descriptorTypes[i];
+        descriptorSetLayoutBindings[i].descriptorCount = 1;
+        descriptorSetLayoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        descriptorSetLayoutBindings[i].pImmutableSamplers = 0;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
+    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.pNext = 0;
+    descriptorSetLayoutCreateInfo.flags = 0;
+    descriptorSetLayoutCreateInfo.bindingCount = binding_count;
+    descriptorSetLayoutCreateInfo.pBindings = descriptorSetLayoutBindings.data();
+
+    VkDescriptorSetLayout descriptorSetLayout;
+    VkResult ret = vkCreateDescriptorSetLayout(get_gpu_device(), &descriptorSetLayoutCreateInfo, 0, &descriptorSetLayout);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorSetLayout failed %d\n", ret);
+        return 0;
+    }
+
+    DescriptorSetLayoutCacheEntry entry;
+    entry.descriptorTypes.assign(descriptorTypes, descriptorTypes + binding_count);
+    entry.descriptorSetLayout = descriptorSetLayout;
+    descriptor_set_layout_cache.push_back(entry);
+
+    return descriptorSetLayout;
+}
+
+// one push constant range at offset 0 visible to the compute stage
+VkPipelineLayout get_pipeline_layout(VkDescriptorSetLayout descriptorSetLayout, uint32_t push_constant_size)
+{
+    std::vector<PipelineLayoutCacheEntry>& pipeline_layout_cache = get_current_gpu_context()->pipeline_layout_cache;
+
+    for (size_t i=0; i<pipeline_layout_cache.size(); i++)
+    {
+        const PipelineLayoutCacheEntry& entry = pipeline_layout_cache[i];
+        if (entry.descriptorSetLayout == descriptorSetLayout && entry.push_constant_size == push_constant_size)
+            return entry.pipelineLayout;
+    }
+
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = push_constant_size;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo;
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.pNext = 0;
+    pipelineLayoutCreateInfo.flags = 0;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = push_constant_size ? 1 : 0;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+
+    VkPipelineLayout pipelineLayout;
+    VkResult ret = vkCreatePipelineLayout(get_gpu_device(), &pipelineLayoutCreateInfo, 0, &pipelineLayout);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreatePipelineLayout failed %d\n", ret);
+        return 0;
+    }
+
+    PipelineLayoutCacheEntry entry;
+    entry.descriptorSetLayout = descriptorSetLayout;
+    entry.push_constant_size = push_constant_size;
+    entry.pipelineLayout = pipelineLayout;
+    pipeline_layout_cache.push_back(entry);
+
+    return pipelineLayout;
+}
+
+static void destroy_gpu_layout_cache(GpuContext* ctx)
+{
+    for (size_t i=0; i<ctx->pipeline_layout_cache.size(); i++)
+    {
+        vkDestroyPipelineLayout(ctx->device, ctx->pipeline_layout_cache[i].pipelineLayout, 0);
+    }
+    ctx->pipeline_layout_cache.clear();
+
+    for (size_t i=0; i<ctx->descriptor_set_layout_cache.size(); i++)
+    {
+        vkDestroyDescriptorSetLayout(ctx->device, ctx->descriptor_set_layout_cache[i].descriptorSetLayout, 0);
+    }
+    ctx->descriptor_set_layout_cache.clear();
+}
+
+// push constants of the shape generic kernels, matches the push_constant block in the shaders
+// one pipeline serves every shape, strides are in elements
+struct ShapeConstants
+{
+    int w;
+    int h;
+    int c;
+    int rowstep;
+    int cstep;
+};
+
+struct ComputePipeline
+{
+    VkShaderModule shaderModule;
+    VkDescriptorSetLayout descriptorSetLayout;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline pipeline;
+    uint32_t local_size_x;
+    uint32_t local_size_y;
+    uint32_t local_size_z;
+};
+
+// constant_id 0 1 2 are local_size_x local_size_y local_size_z, the 32-bit extra_specializations follow from constant_id 3
+static VkPipeline create_pipeline(VkShaderModule shaderModule, VkPipelineLayout pipelineLayout, uint32_t local_size_x, uint32_t local_size_y, uint32_t local_size_z, VkPipelineCache cache, const std::vector<uint32_t>& extra_specializations = std::vector<uint32_t>())
+{
+    std::vector<uint32_t> specializations(3);
+    specializations[0] = local_size_x;
+    specializations[1] = local_size_y;
+    specializations[2] = local_size_z;
+    specializations.insert(specializations.end(), extra_specializations.begin(), extra_specializations.end());
+
+    const uint32_t specialization_count = (uint32_t)specializations.size();
+
+    std::vector<VkSpecializationMapEntry> specializationMapEntries(specialization_count);
+    for (uint32_t i=0; i<specialization_count; i++)
+    {
+        specializationMapEntries[i].constantID = i;
+        specializationMapEntries[i].offset = i * sizeof(uint32_t);
+        specializationMapEntries[i].size = sizeof(uint32_t);
+    }
+
+    VkSpecializationInfo specializationInfo;
+    specializationInfo.mapEntryCount = specialization_count;
+    specializationInfo.pMapEntries = specializationMapEntries.data();
+    specializationInfo.dataSize = specialization_count * sizeof(uint32_t);
+    specializationInfo.pData = specializations.data();
+
+    VkPipelineShaderStageCreateInfo pipelineShaderStageCreateInfo;
+    pipelineShaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineShaderStageCreateInfo.pNext = 0;
+    pipelineShaderStageCreateInfo.flags = 0;
+    pipelineShaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineShaderStageCreateInfo.module = shaderModule;
+    pipelineShaderStageCreateInfo.pName = "main";
+    pipelineShaderStageCreateInfo.pSpecializationInfo = &specializationInfo;
+
+    VkComputePipelineCreateInfo computePipelineCreateInfo;
+    computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    computePipelineCreateInfo.pNext = 0;
+    computePipelineCreateInfo.flags = 0;
+    computePipelineCreateInfo.stage = pipelineShaderStageCreateInfo;
+    computePipelineCreateInfo.layout = pipelineLayout;
+    computePipelineCreateInfo.basePipelineHandle = 0;
+    computePipelineCreateInfo.basePipelineIndex = 0;
+
+    VkPipeline pipeline = 0;
+    VkResult ret = vkCreateComputePipelines(get_gpu_device(), cache, 1, &computePipelineCreateInfo, 0, &pipeline);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateComputePipelines failed %d\n", ret);
+        return 0;
+    }
+
+    return pipeline;
+}
+
+// binding i of set 0 has type descriptorTypes[i], extra_specializations start at constant_id 3
+int create_compute_pipeline(const char* spv_path, const VkDescriptorType* descriptorTypes, int binding_count, uint32_t local_size_x, uint32_t local_size_y, uint32_t local_size_z, ComputePipeline* cp, const std::vector<uint32_t>& extra_specializations = std::vector<uint32_t>())
+{
+    cp->descriptorSetLayout = 0;
+    cp->pipelineLayout = 0;
+    cp->pipeline = 0;
+    cp->local_size_x = local_size_x;
+    cp->local_size_y = local_size_y;
+    cp->local_size_z = local_size_z;
+
+    cp->shaderModule = get_shader_module(spv_path);
+    if (!cp->shaderModule)
+        return -1;
+
+    cp->descriptorSetLayout = get_descriptor_set_layout(descriptorTypes, binding_count);
+    if (!cp->descriptorSetLayout)
+        return -1;
+
+    cp->pipelineLayout = get_pipeline_layout(cp->descriptorSetLayout, sizeof(ShapeConstants));
+    if (!cp->pipelineLayout)
+        return -1;
+
+    // pipeline
+    double t0 = get_current_time();
+
+    cp->pipeline = create_pipeline(cp->shaderModule, cp->pipelineLayout, local_size_x, local_size_y, local_size_z, get_gpu_pipeline_cache(), extra_specializations);
+    if (!cp->pipeline)
+        return -1;
+
+    double t1 = get_current_time();
+
+    GpuContext* ctx = get_current_gpu_context();
+    ctx->pipelineCache_create_time += t1 - t0;
+    ctx->pipelineCache_create_count++;
+
+    VKTEST_LOGI("create pipeline %s %u %u %u %.3f ms\n", spv_path, local_size_x, local_size_y, local_size_z, t1 - t0);
+
+    return 0;
+}
+
+void destroy_compute_pipeline(ComputePipeline* cp)
+{
+    VkDevice device = get_gpu_device();
+
+    vkDestroyPipeline(device, cp->pipeline, 0);
+
+    // layouts and shader modules belong to their caches
+}
+
+// workgroup count by ceil-division of the problem size
+void record_dispatch(VkCommandBuffer commandBuffer, const ComputePipeline& cp, int w, int h, int d)
+{
+    uint32_t group_x = (w + cp.local_size_x - 1) / cp.local_size_x;
+    uint32_t group_y = (h + cp.local_size_y - 1) / cp.local_size_y;
+    uint32_t group_z = (d + cp.local_size_z - 1) / cp.local_size_z;
+
+    vkCmdDispatch(commandBuffer, group_x, group_y, group_z);
+}
+
+// densely packed shape, rows of w elements and channels of w * h elements
+ShapeConstants make_shape_constants(int w, int h, int c)
+{
+    ShapeConstants shape;
+    shape.w = w;
+    shape.h = h;
+    shape.c = c;
+    shape.rowstep = w;
+    shape.cstep = w * h;
+    return shape;
+}
+
+void record_shape_constants(VkCommandBuffer commandBuffer, const ComputePipeline& cp, const ShapeConstants& shape)
+{
+    vkCmdPushConstants(commandBuffer, cp.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ShapeConstants), &shape);
+}
+
+// create one more pipeline from cp with the given cache and return the elapsed ms
+static double time_compute_pipeline_creation(const ComputePipeline& cp, VkPipelineCache cache)
+{
+    double t0 = get_current_time();
+
+    VkPipeline pipeline = create_pipeline(cp.shaderModule, cp.pipelineLayout, cp.local_size_x, cp.local_size_y, cp.local_size_z, cache);
+    if (!pipeline)
+        return -1;
+
+    double t1 = get_current_time();
+
+    vkDestroyPipeline(get_gpu_device(), pipeline, 0);
+
+    return t1 - t0;
+}
+
+// cold pipeline creation with an empty cache vs warm creation from the persisted cache
+static int bench_pipeline_cache()
+{
+    const char* spv_paths[] = { "imagetest.comp.spv", "imagescale.comp.spv" };
+    const int binding_counts[] = { 1, 2 };
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    fprintf(stderr, "%-24s %12s %12s\n", "shader", "cold(ms)", "warm(ms)");
+
+    for (int i=0; i<2; i++)
+    {
+        // also populates the persisted cache for the warm run
+        ComputePipeline cp;
+        if (create_compute_pipeline(spv_paths[i], descriptorTypes, binding_counts[i], 8, 8, 1, &cp) != 0)
+            return -1;
+
+        VkPipelineCacheCreateInfo pipelineCacheCreateInfo;
+        pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        pipelineCacheCreateInfo.pNext = 0;
+        pipelineCacheCreateInfo.flags = 0;
+        pipelineCacheCreateInfo.initialDataSize = 0;
+        pipelineCacheCreateInfo.pInitialData = 0;
+
+        VkPipelineCache emptyCache = 0;
+        VkResult ret = vkCreatePipelineCache(get_gpu_device(), &pipelineCacheCreateInfo, 0, &emptyCache);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkCreatePipelineCache failed %d\n", ret);
+            destroy_compute_pipeline(&cp);
+            return -1;
+        }
+
+        double cold = time_compute_pipeline_creation(cp, emptyCache);
+        double warm = time_compute_pipeline_creation(cp, get_gpu_pipeline_cache());
+
+        fprintf(stderr, "%-24s %12.3f %12.3f\n", spv_paths[i], cold, warm);
+
+        vkDestroyPipelineCache(get_gpu_device(), emptyCache, 0);
+
+        destroy_compute_pipeline(&cp);
+    }
+
+    return 0;
+}
+
+enum ImageStorageMode
+{
+    IMAGE_STORAGE_HOST_LINEAR = 0,// linear tiling in host visible memory, host reads and writes pitched rows through the mapped pointer
+    IMAGE_STORAGE_DEVICE_OPTIMAL = 1,// optimal tiling in device local memory, data moves through VkStagingRing copies
+};
+
+struct VkStorageImage
+{
+    int w;
+    int h;
+    int c;
+    ImageStorageMode mode;
+    ImageStorageFormat format;
+    ImageChannelLayout channel_layout;
+    VkImage image;
+    VkImageView imageview;
+    VkMemoryBlock memoryBlock;
+    VkSubresourceLayout subresourceLayout;// host linear only
+};
+
+// w x h x c, w and h count texels, a pack4 texel holds 4 channels
+int create_storage_image(ImageStorageMode mode, ImageChannelLayout channel_layout, int w, int h, int c, VkStorageImage* si, ImageStorageFormat format = IMAGE_FORMAT_FP32)
+{
+    const bool linear = mode == IMAGE_STORAGE_HOST_LINEAR;
+    const VkPhysicalDeviceLimits& limits = get_gpu_info().properties.limits;
+
+    si->w = w;
+    si->h = h;
+    si->c = c;
+    si->mode = mode;
+    si->format = format;
+    si->channel_layout = channel_layout;
+    si->imageview = 0;
+    si->memoryBlock.memory = 0;
+    memset(&si->subresourceLayout, 0, sizeof(VkSubresourceLayout));
+
+    si->image = 0;
+
+    if (!linear && !is_image_format_supported(format))
+    {
+        fprintf(stderr, "storage image format %s not supported\n", get_image_format_name(format));
+        return -1;
+    }
+
+    if ((channel_layout == IMAGE_CHANNEL_2D && c != 1)
+        || (channel_layout == IMAGE_CHANNEL_3D && (uint32_t)std::max(std::max(w, h), c) > limits.maxImageDimension3D)
+        || (channel_layout == IMAGE_CHANNEL_ARRAY && (uint32_t)c > limits.maxImageArrayLayers))
+    {
+        fprintf(stderr, "storage image %d x %d x %d exceeds the channel layout %d limits\n", w, h, c, channel_layout);
+        return -1;
+    }
+
+    const VkImageType imageType = channel_layout == IMAGE_CHANNEL_3D ? VK_IMAGE_TYPE_3D : VK_IMAGE_TYPE_2D;
+    si->image = create_image(imageType, w, h, c, get_image_format_vkformat(format), linear ? VK_IMAGE_TILING_LINEAR : VK_IMAGE_TILING_OPTIMAL);
+    if (!si->image)
+        return -1;
+
+    // alloc
+    VkMemoryRequirements memoryRequirements;
+    vkGetImageMemoryRequirements(get_gpu_device(), si->image, &memoryRequirements);
+
+    const uint32_t memoryTypeIndex = linear ? get_gpu_host_visible_memoryTypeIndex() : get_gpu_device_local_memoryTypeIndex();
+    if (get_gpu_block_allocator(memoryTypeIndex)->fastMalloc(memoryRequirements, linear, &si->memoryBlock) != 0)
+        return -1;
+
+    VkResult ret = vkBindImageMemory(get_gpu_device(), si->image, si->memoryBlock.memory, si->memoryBlock.offset);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBindImageMemory failed %d\n", ret);
+        return -1;
+    }
+
+    const VkImageViewType viewType = channel_layout == IMAGE_CHANNEL_3D ? VK_IMAGE_VIEW_TYPE_3D : channel_layout == IMAGE_CHANNEL_ARRAY ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+    si->imageview = create_imageview(viewType, si->image, get_image_format_vkformat(format));
+    if (!si->imageview)
+        return -1;
+
+    if (linear)
+    {
+        // get image memory layout, depthPitch and arrayPitch step to the next channel
+        VkImageSubresource subresource;
+        subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        subresource.mipLevel = 0;
+        subresource.arrayLayer = 0;
+        vkGetImageSubresourceLayout(get_gpu_device(), si->image, &subresource, &si->subresourceLayout);
+    }
+
+    return 0;
+}
+
+int create_storage_image(ImageStorageMode mode, int w, int h, VkStorageImage* si, ImageStorageFormat format = IMAGE_FORMAT_FP32)
+{
+    return create_storage_image(mode, IMAGE_CHANNEL_2D, w, h, 1, si, format);
+}
+
+// host linear only, offset of channel z in the mapped memory
+static size_t get_storage_image_channel_offset(const VkStorageImage& si, int z)
+{
+    const VkSubresourceLayout& layout = si.subresourceLayout;
+    return layout.offset + z * (si.channel_layout == IMAGE_CHANNEL_3D ? layout.depthPitch : layout.arrayPitch);
+}
+
+void destroy_storage_image(VkStorageImage* si)
+{
+    VkDevice device = get_gpu_device();
+
+    if (si->imageview)
+        vkDestroyImageView(device, si->imageview, 0);
+
+    if (si->image)
+        vkDestroyImage(device, si->image, 0);
+
+    if (si->memoryBlock.memory)
+        get_gpu_block_allocator(si->memoryBlock.memoryTypeIndex)->fastFree(si->memoryBlock);
+
+    si->image = 0;
+    si->imageview = 0;
+    si->memoryBlock.memory = 0;
+}
+
+// host linear only, the image must already be in VK_IMAGE_LAYOUT_GENERAL
+void write_storage_image(const VkStorageImage& si, const void* data)
+{
+    const size_t row_size = si.w * get_image_format_elemsize(si.format);
+
+    for (int z=0; z<si.c; z++)
+    {
+        unsigned char* mapped_ptr = (unsigned char*)si.memoryBlock.mapped_ptr + get_storage_image_channel_offset(si, z);
+        const unsigned char* channel_data = (const unsigned char*)data + row_size * si.h * z;
+        for (int i=0; i<si.h; i++)
+        {
+            memcpy(mapped_ptr + si.subresourceLayout.rowPitch * i, channel_data + row_size * i, row_size);
+        }
+    }
+
+    flush_memory_block(si.memoryBlock);
+}
+
+// host linear only
+void read_storage_image(const VkStorageImage& si, void* data)
+{
+    invalidate_memory_block(si.memoryBlock);
+
+    const size_t row_size = si.w * get_image_format_elemsize(si.format);
+
+    for (int z=0; z<si.c; z++)
+    {
+        const unsigned char* mapped_ptr = (const unsigned char*)si.memoryBlock.mapped_ptr + get_storage_image_channel_offset(si, z);
+        unsigned char* channel_data = (unsigned char*)data + row_size * si.h * z;
+        for (int i=0; i<si.h; i++)
+        {
+            memcpy(channel_data + row_size * i, mapped_ptr + si.subresourceLayout.rowPitch * i, row_size);
+        }
+    }
+}
+
+// fixed worker threads running parallel loops, the calling thread takes a share too
+// one parallel_for at a time
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    // num_threads counts the caller, 0 uses every hardware thread
+    int create(int num_threads = 0);
+    void destroy();
+
+    int get_thread_count() const;
+
+    // func(i) for i in [0, count), returns when all calls are done
+    void parallel_for(int count, const std::function<void(int)>& func);
+
+private:
+    void worker();
+
+private:
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable job_condition;
+    std::condition_variable done_condition;
+
+    const std::function<void(int)>* job;
+    int job_count;
+    int job_next;
+    int job_done;
+    bool quit;
+};
+
+ThreadPool::ThreadPool()
+{
+    job = 0;
+    job_count = 0;
+    job_next = 0;
+    job_done = 0;
+    quit = false;
+}
+
+ThreadPool::~ThreadPool()
+{
+    destroy();
+}
+
+int ThreadPool::create(int num_threads)
+{
+    if (num_threads <= 0)
+        num_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+    quit = false;
+    for (int i=1; i<num_threads; i++)
+    {
+        threads.push_back(std::thread(&ThreadPool::worker, this));
+    }
+
+    return 0;
+}
+
+void ThreadPool::destroy()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    job_condition.notify_all();
+
+    for (size_t i=0; i<threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    threads.clear();
+}
+
+int ThreadPool::get_thread_count() const
+{
+    return (int)threads.size() + 1;
+}
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)>& func)
+{
+    if (threads.empty() || count <= 1)
+    {
+        for (int i=0; i<count; i++)
+        {
+            func(i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    job = &func;
+    job_count = count;
+    job_next = 0;
+    job_done = 0;
+    job_condition.notify_all();
+
+    while (job_next < job_count)
+    {
+        int i = job_next++;
+        guard.unlock();
+        func(i);
+        guard.lock();
+        job_done++;
+    }
+
+    done_condition.wait(guard, [this]() { return job_done == job_count; });
+    job = 0;
+}
+
+void ThreadPool::worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        job_condition.wait(guard, [this]() { return quit || (job && job_next < job_count); });
+        if (quit)
+            return;
+
+        const std::function<void(int)>* func = job;
+        int i = job_next++;
+        guard.unlock();
+        (*func)(i);
+        guard.lock();
+
+        if (++job_done == job_count)
+            done_condition.notify_all();
+    }
+}
+
+// ieee half bits to float, denormals included
+static float float16_to_float32(unsigned short value)
+{
+    const unsigned int sign = (value & 0x8000) << 16;
+    unsigned int exponent = (value >> 10) & 0x1f;
+    unsigned int significand = value & 0x3ff;
+
+    union { unsigned int u; float f; } tmp;
+    if (exponent == 0)
+    {
+        if (significand == 0)
+        {
+            tmp.u = sign;
+            return tmp.f;
+        }
+
+        // denormal, renormalize
+        exponent = 1;
+        while ((significand & 0x400) == 0)
+        {
+            significand <<= 1;
+            exponent--;
+        }
+        significand &= 0x3ff;
+        tmp.u = sign | ((exponent + 112) << 23) | (significand << 13);
+    }
+    else if (exponent == 0x1f)
+    {
+        // inf and nan
+        tmp.u = sign | 0x7f800000 | (significand << 13);
+    }
+    else
+    {
+        tmp.u = sign | ((exponent + 112) << 23) | (significand << 13);
+    }
+
+    return tmp.f;
+}
+
+// float to half bits, round to nearest even, overflow to inf
+static unsigned short float32_to_float16(float value)
+{
+    union { unsigned int u; float f; } tmp;
+    tmp.f = value;
+
+    const unsigned short sign = (tmp.u >> 16) & 0x8000;
+    const int exponent = ((tmp.u >> 23) & 0xff) - 127 + 15;
+    unsigned int significand = tmp.u & 0x7fffff;
+
+    if (((tmp.u >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (significand ? 0x200 : 0);
+
+    if (exponent >= 0x1f)
+        return sign | 0x7c00;
+
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return sign;
+
+        // denormal
+        significand |= 0x800000;
+        const int shift = 14 - exponent;
+        unsigned int half = significand >> shift;
+        const unsigned int rest = significand & ((1u << shift) - 1);
+        const unsigned int halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    unsigned int half = (exponent << 10) | (significand >> 13);
+    const unsigned int rest = significand & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+// 64 bytes per step, mapped device memory prefers wide loads
+static void copy_row(void* dst, const void* src, size_t size)
+{
+    unsigned char* outptr = (unsigned char*)dst;
+    const unsigned char* ptr = (const unsigned char*)src;
+
+    size_t i = 0;
+#if __SSE2__
+    for (; i + 63 < size; i += 64)
+    {
+        __m128i _p0 = _mm_loadu_si128((const __m128i*)(ptr + i));
+        __m128i _p1 = _mm_loadu_si128((const __m128i*)(ptr + i + 16));
+        __m128i _p2 = _mm_loadu_si128((const __m128i*)(ptr + i + 32));
+        __m128i _p3 = _mm_loadu_si128((const __m128i*)(ptr + i + 48));
+        _mm_storeu_si128((__m128i*)(outptr + i), _p0);
+        _mm_storeu_si128((__m128i*)(outptr + i + 16), _p1);
+        _mm_storeu_si128((__m128i*)(outptr + i + 32), _p2);
+        _mm_storeu_si128((__m128i*)(outptr + i + 48), _p3);
+    }
+#elif __ARM_NEON
+    for (; i + 63 < size; i += 64)
+    {
+        uint8x16_t _p0 = vld1q_u8(ptr + i);
+        uint8x16_t _p1 = vld1q_u8(ptr + i + 16);
+        uint8x16_t _p2 = vld1q_u8(ptr + i + 32);
+        uint8x16_t _p3 = vld1q_u8(ptr + i + 48);
+        vst1q_u8(outptr + i, _p0);
+        vst1q_u8(outptr + i + 16, _p1);
+        vst1q_u8(outptr + i + 32, _p2);
+        vst1q_u8(outptr + i + 48, _p3);
+    }
+#endif
+    if (i < size)
+        memcpy(outptr + i, ptr + i, size - i);
+}
+
+static void convert_row_fp16_to_fp32(float* dst, const unsigned short* src, int n)
+{
+    int i = 0;
+#if __F16C__
+    for (; i + 7 < n; i += 8)
+    {
+        __m128i _p = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_ps(dst + i, _mm_cvtph_ps(_p));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(_p, _p)));
+    }
+#elif __ARM_NEON && __aarch64__
+    for (; i + 7 < n; i += 8)
+    {
+        float16x8_t _p = vreinterpretq_f16_u16(vld1q_u16(src + i));
+        vst1q_f32(dst + i, vcvt_f32_f16(vget_low_f16(_p)));
+        vst1q_f32(dst + i + 4, vcvt_high_f32_f16(_p));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[i] = float16_to_float32(src[i]);
+    }
+}
+
+// w rgba texels to 4 planes
+static void unpack4_row(float* dst0, float* dst1, float* dst2, float* dst3, const float* src, int w)
+{
+    int i = 0;
+#if __SSE2__
+    for (; i + 3 < w; i += 4)
+    {
+        __m128 _r0 = _mm_loadu_ps(src + i * 4);
+        __m128 _r1 = _mm_loadu_ps(src + i * 4 + 4);
+        __m128 _r2 = _mm_loadu_ps(src + i * 4 + 8);
+        __m128 _r3 = _mm_loadu_ps(src + i * 4 + 12);
+        _MM_TRANSPOSE4_PS(_r0, _r1, _r2, _r3);
+        _mm_storeu_ps(dst0 + i, _r0);
+        _mm_storeu_ps(dst1 + i, _r1);
+        _mm_storeu_ps(dst2 + i, _r2);
+        _mm_storeu_ps(dst3 + i, _r3);
+    }
+#elif __ARM_NEON
+    for (; i + 3 < w; i += 4)
+    {
+        float32x4x4_t _p = vld4q_f32(src + i * 4);
+        vst1q_f32(dst0 + i, _p.val[0]);
+        vst1q_f32(dst1 + i, _p.val[1]);
+        vst1q_f32(dst2 + i, _p.val[2]);
+        vst1q_f32(dst3 + i, _p.val[3]);
+    }
+#endif
+    for (; i < w; i++)
+    {
+        dst0[i] = src[i * 4];
+        dst1[i] = src[i * 4 + 1];
+        dst2[i] = src[i * 4 + 2];
+        dst3[i] = src[i * 4 + 3];
+    }
+}
+
+// dense host layout readback_storage_image produces
+enum ReadbackConversion
+{
+    READBACK_RAW = 0,// texels as stored, rows de-pitched only
+    READBACK_FP32 = 1,// fp16 widened to fp32, pack4 texels stay interleaved
+    READBACK_FP32_PLANAR = 2,// fp32, and pack4 texel rows split into 4 channel planes
+};
+
+// host linear only, copies the pitched rows of every channel into dense dst
+// rows are split across the pool threads, no pool copies on the calling thread
+// a pack4 image stacks channel groups of plane_h texel rows vertically, 0 means si.h,
+// READBACK_FP32_PLANAR then writes w x plane_h planes in channel order
+int readback_storage_image(const VkStorageImage& si, void* dst, ReadbackConversion conversion = READBACK_RAW, int plane_h = 0, ThreadPool* pool = 0)
+{
+    if (si.mode != IMAGE_STORAGE_HOST_LINEAR)
+    {
+        fprintf(stderr, "readback_storage_image needs a host linear image\n");
+        return -1;
+    }
+
+    const int elempack = get_image_format_elempack(si.format);
+    const bool fp16 = si.format == IMAGE_FORMAT_FP16 || si.format == IMAGE_FORMAT_FP16_PACK4;
+    const bool planar = conversion == READBACK_FP32_PLANAR && elempack == 4;
+
+    if (plane_h == 0)
+        plane_h = si.h;
+
+    if (planar && si.h % plane_h != 0)
+    {
+        fprintf(stderr, "readback_storage_image plane_h %d does not divide %d\n", plane_h, si.h);
+        return -1;
+    }
+
+    invalidate_memory_block(si.memoryBlock);
+
+    const size_t row_size = si.w * get_image_format_elemsize(si.format);
+    const size_t dst_row_size = conversion == READBACK_RAW ? row_size : si.w * elempack * sizeof(float);
+
+    const int rows = si.h * si.c;
+    const int chunk_count = std::min(pool ? pool->get_thread_count() * 4 : 1, rows);
+    const int chunk_rows = (rows + chunk_count - 1) / chunk_count;
+
+    std::function<void(int)> func = [&](int ci) {
+        // fp16 pack4 is widened here before the split
+        std::vector<float> tmp(planar && fp16 ? si.w * 4 : 0);
+
+        const int row_end = std::min((ci + 1) * chunk_rows, rows);
+        for (int r=ci * chunk_rows; r<row_end; r++)
+        {
+            const int z = r / si.h;
+            const int y = r % si.h;
+
+            const unsigned char* ptr = (const unsigned char*)si.memoryBlock.mapped_ptr + get_storage_image_channel_offset(si, z) + si.subresourceLayout.rowPitch * y;
+            unsigned char* outptr = (unsigned char*)dst + dst_row_size * r;
+
+            if (conversion == READBACK_RAW || (!fp16 && !planar))
+            {
+                copy_row(outptr, ptr, row_size);
+                continue;
+            }
+
+            if (!planar)
+            {
+                convert_row_fp16_to_fp32((float*)outptr, (const unsigned short*)ptr, si.w * elempack);
+                continue;
+            }
+
+            const float* texels = (const float*)ptr;
+            if (fp16)
+            {
+                convert_row_fp16_to_fp32(tmp.data(), (const unsigned short*)ptr, si.w * 4);
+                texels = tmp.data();
+            }
+
+            // texel row y of channel group q holds row yy of planes 4q .. 4q+3
+            const int q = y / plane_h;
+            const int yy = y % plane_h;
+            float* plane0 = (float*)dst + (size_t)si.w * si.h * 4 * z + ((size_t)4 * q * plane_h + yy) * si.w;
+            const size_t plane_size = (size_t)si.w * plane_h;
+            unpack4_row(plane0, plane0 + plane_size, plane0 + plane_size * 2, plane0 + plane_size * 3, texels, si.w);
+        }
+    };
+
+    if (pool)
+        pool->parallel_for(chunk_count, func);
+    else
+        func(0);
+
+    return 0;
+}
+
+static void update_descriptor_set_images(VkDescriptorSet descriptorSet, const VkImageView* imageviews, int count)
+{
+    std::vector<VkDescriptorImageInfo> descriptorImageInfos(count);
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets(count);
+    for (int i=0; i<count; i++)
+    {
+        descriptorImageInfos[i].sampler = 0;
+        descriptorImageInfos[i].imageView = imageviews[i];
+        descriptorImageInfos[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSets[i].pNext = 0;
+        writeDescriptorSets[i].dstSet = descriptorSet;
+        writeDescriptorSets[i].dstBinding = i;
+        writeDescriptorSets[i].dstArrayElement = 0;
+        writeDescriptorSets[i].descriptorCount = 1;
+        writeDescriptorSets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        writeDescriptorSets[i].pImageInfo = &descriptorImageInfos[i];
+        writeDescriptorSets[i].pBufferInfo = 0;
+        writeDescriptorSets[i].pTexelBufferView = 0;
+    }
+
+    vkUpdateDescriptorSets(get_gpu_device(), count, writeDescriptorSets.data(), 0, 0);
+}
+
+static void update_descriptor_set_buffers(VkDescriptorSet descriptorSet, const VkDescriptorBufferInfo* bufferInfos, int count)
+{
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets(count);
+    for (int i=0; i<count; i++)
+    {
+        writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSets[i].pNext = 0;
+        writeDescriptorSets[i].dstSet = descriptorSet;
+        writeDescriptorSets[i].dstBinding = i;
+        writeDescriptorSets[i].dstArrayElement = 0;
+        writeDescriptorSets[i].descriptorCount = 1;
+        writeDescriptorSets[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writeDescriptorSets[i].pImageInfo = 0;
+        writeDescriptorSets[i].pBufferInfo = &bufferInfos[i];
+        writeDescriptorSets[i].pTexelBufferView = 0;
+    }
+
+    vkUpdateDescriptorSets(get_gpu_device(), count, writeDescriptorSets.data(), 0, 0);
+}
+
+// descriptor sets of one frame come from a list of pools that grows when allocation fails,
+// the pools are reset as a whole when the frame slot is reused and sets are never freed one by one
+// within a frame a set with the same layout and images is handed out again without any update
+class VkDescriptorAllocator
+{
+public:
+    VkDescriptorAllocator();
+    ~VkDescriptorAllocator();
+
+    int create(int frame_count);
+    void destroy();
+
+    // reset the pools of frame, its previous submit must have retired
+    void begin_frame(int frame);
+
+    VkDescriptorSet allocate(VkDescriptorSetLayout descriptorSetLayout);
+
+    // cached set with the images bound to binding 0 .. count-1
+    VkDescriptorSet get(VkDescriptorSetLayout descriptorSetLayout, const VkImageView* imageviews, int count);
+
+    // same with buffer ranges
+    VkDescriptorSet get(VkDescriptorSetLayout descriptorSetLayout, const VkDescriptorBufferInfo* bufferInfos, int count);
+
+public:
+    int pool_count;
+    int allocate_count;
+    int reuse_count;
+
+private:
+    struct CachedSet
+    {
+        std::vector<uint64_t> key;
+        VkDescriptorSet descriptorSet;
+    };
+
+    struct Frame
+    {
+        std::vector<VkDescriptorPool> pools;
+        int pool_index;
+        std::unordered_map<uint64_t, CachedSet> sets;
+    };
+
+    VkDescriptorPool create_pool(uint32_t max_sets);
+
+    // the cached set of key in the current frame, 0 and its hash when there is none yet
+    VkDescriptorSet find(const std::vector<uint64_t>& key, uint64_t* hash);
+    void insert(const std::vector<uint64_t>& key, uint64_t hash, VkDescriptorSet descriptorSet);
+
+    int frame_index;
+    std::vector<Frame> frames;
+};
+
+VkDescriptorAllocator::VkDescriptorAllocator()
+{
+    pool_count = 0;
+    allocate_count = 0;
+    reuse_count = 0;
+    frame_index = 0;
+}
+
+VkDescriptorAllocator::~VkDescriptorAllocator()
+{
+    destroy();
+}
+
+int VkDescriptorAllocator::create(int frame_count)
+{
+    frames.resize(frame_count);
+    for (int i=0; i<frame_count; i++)
+    {
+        frames[i].pool_index = 0;
+    }
+
+    frame_index = 0;
+
+    return 0;
+}
+
+void VkDescriptorAllocator::destroy()
+{
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        for (size_t j=0; j<frames[i].pools.size(); j++)
+        {
+            vkDestroyDescriptorPool(get_gpu_device(), frames[i].pools[j], 0);
+        }
+    }
+    frames.clear();
+
+    pool_count = 0;
+}
+
+VkDescriptorPool VkDescriptorAllocator::create_pool(uint32_t max_sets)
+{
+    // enough of every type we bind for max_sets sets of a few bindings
+    VkDescriptorPoolSize poolSizes[2] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            max_sets * 4 // descriptorCount
+        },
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            max_sets * 4 // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = max_sets;
+    descriptorPoolCreateInfo.poolSizeCount = 2;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool;
+    VkResult ret = vkCreateDescriptorPool(get_gpu_device(), &descriptorPoolCreateInfo, 0, &descriptorPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        return 0;
+    }
+
+    pool_count++;
+
+    return descriptorPool;
+}
+
+void VkDescriptorAllocator::begin_frame(int frame)
+{
+    frame_index = frame;
+
+    Frame& f = frames[frame_index];
+
+    for (size_t i=0; i<f.pools.size(); i++)
+    {
+        vkResetDescriptorPool(get_gpu_device(), f.pools[i], 0);
+    }
+
+    f.pool_index = 0;
+    f.sets.clear();
+}
+
+VkDescriptorSet VkDescriptorAllocator::allocate(VkDescriptorSetLayout descriptorSetLayout)
+{
+    Frame& f = frames[frame_index];
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = 0;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &descriptorSetLayout;
+
+    // vulkan 1.0 drivers may report an exhausted pool as out of memory instead of
+    // VK_ERROR_OUT_OF_POOL_MEMORY, any failure moves on to the next pool
+    while (true)
+    {
+        bool fresh = false;
+        if (f.pool_index == (int)f.pools.size())
+        {
+            // each new pool is twice as large as the previous one
+            const uint32_t max_sets = std::min(16u << f.pools.size(), 1024u);
+
+            VkDescriptorPool descriptorPool = create_pool(max_sets);
+            if (!descriptorPool)
+                return 0;
+
+            f.pools.push_back(descriptorPool);
+            fresh = true;
+        }
+
+        descriptorSetAllocateInfo.descriptorPool = f.pools[f.pool_index];
+
+        VkDescriptorSet descriptorSet;
+        VkResult ret = vkAllocateDescriptorSets(get_gpu_device(), &descriptorSetAllocateInfo, &descriptorSet);
+        if (ret == VK_SUCCESS)
+        {
+            allocate_count++;
+            return descriptorSet;
+        }
+
+        // a new pool that cannot hold one set will not get better
+        if (fresh)
+        {
+            fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+            return 0;
+        }
+
+        f.pool_index++;
+    }
+}
+
+VkDescriptorSet VkDescriptorAllocator::find(const std::vector<uint64_t>& key, uint64_t* hash)
+{
+    Frame& f = frames[frame_index];
+
+    // fnv-1a
+    *hash = 14695981039346656037ull;
+    for (size_t i=0; i<key.size(); i++)
+    {
+        *hash ^= key[i];
+        *hash *= 1099511628211ull;
+    }
+
+    std::unordered_map<uint64_t, CachedSet>::iterator it = f.sets.find(*hash);
+    if (it != f.sets.end() && it->second.key == key)
+    {
+        reuse_count++;
+        return it->second.descriptorSet;
+    }
+
+    return 0;
+}
+
+void VkDescriptorAllocator::insert(const std::vector<uint64_t>& key, uint64_t hash, VkDescriptorSet descriptorSet)
+{
+    CachedSet cached;
+    cached.key = key;
+    cached.descriptorSet = descriptorSet;
+    frames[frame_index].sets[hash] = cached;
+}
+
+VkDescriptorSet VkDescriptorAllocator::get(VkDescriptorSetLayout descriptorSetLayout, const VkImageView* imageviews, int count)
+{
+    std::vector<uint64_t> key(count + 1);
+    key[0] = (uint64_t)descriptorSetLayout;
+    for (int i=0; i<count; i++)
+    {
+        key[i + 1] = (uint64_t)imageviews[i];
+    }
+
+    uint64_t hash;
+    VkDescriptorSet descriptorSet = find(key, &hash);
+    if (descriptorSet)
+        return descriptorSet;
+
+    descriptorSet = allocate(descriptorSetLayout);
+    if (!descriptorSet)
+        return 0;
+
+    update_descriptor_set_images(descriptorSet, imageviews, count);
+
+    insert(key, hash, descriptorSet);
+
+    return descriptorSet;
+}
+
+VkDescriptorSet VkDescriptorAllocator::get(VkDescriptorSetLayout descriptorSetLayout, const VkDescriptorBufferInfo* bufferInfos, int count)
+{
+    std::vector<uint64_t> key(count * 3 + 1);
+    key[0] = (uint64_t)descriptorSetLayout;
+    for (int i=0; i<count; i++)
+    {
+        key[i * 3 + 1] = (uint64_t)bufferInfos[i].buffer;
+        key[i * 3 + 2] = bufferInfos[i].offset;
+        key[i * 3 + 3] = bufferInfos[i].range;
+    }
+
+    uint64_t hash;
+    VkDescriptorSet descriptorSet = find(key, &hash);
+    if (descriptorSet)
+        return descriptorSet;
+
+    descriptorSet = allocate(descriptorSetLayout);
+    if (!descriptorSet)
+        return 0;
+
+    update_descriptor_set_buffers(descriptorSet, bufferInfos, count);
+
+    insert(key, hash, descriptorSet);
+
+    return descriptorSet;
+}
+
+// w x h x c fp32 tensor in device local memory
+// both backends are addressed as w x (h * c) with rows rowstep and channel planes cstep elements apart,
+// so make_shape_constants(w, h * c, 1) drives the same kernel on either
+struct VkBlob
+{
+    int w;
+    int h;
+    int c;
+    BlobBackend backend;
+    VkStorageImage image;// image backend
+    VkBuffer buffer;// buffer backend
+    VkMemoryBlock memoryBlock;// buffer backend
+};
+
+VkDescriptorType get_blob_descriptor_type(BlobBackend backend)
+{
+    return backend == BLOB_BACKEND_BUFFER ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+}
+
+// kernel is the shader name without extension, the buffer build carries a _buffer suffix
+std::string get_blob_spv_path(const char* kernel, BlobBackend backend)
+{
+    return std::string(kernel) + (backend == BLOB_BACKEND_BUFFER ? "_buffer" : "") + ".comp.spv";
+}
+
+int create_blob(BlobBackend backend, int w, int h, int c, VkBlob* blob)
+{
+    blob->w = w;
+    blob->h = h;
+    blob->c = c;
+    blob->backend = backend;
+    blob->image.image = 0;
+    blob->image.imageview = 0;
+    blob->image.memoryBlock.memory = 0;
+    blob->buffer = 0;
+    blob->memoryBlock.memory = 0;
+
+    if (backend == BLOB_BACKEND_IMAGE)
+        return create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h * c, &blob->image);
+
+    blob->buffer = create_buffer((VkDeviceSize)w * h * c * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    if (!blob->buffer)
+        return -1;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(get_gpu_device(), blob->buffer, &memoryRequirements);
+
+    if (get_gpu_block_allocator(get_gpu_device_local_memoryTypeIndex())->fastMalloc(memoryRequirements, true, &blob->memoryBlock) != 0)
+        return -1;
+
+    VkResult ret = vkBindBufferMemory(get_gpu_device(), blob->buffer, blob->memoryBlock.memory, blob->memoryBlock.offset);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBindBufferMemory failed %d\n", ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+void destroy_blob(VkBlob* blob)
+{
+    if (blob->backend == BLOB_BACKEND_IMAGE)
+    {
+        destroy_storage_image(&blob->image);
+        return;
+    }
+
+    if (blob->buffer)
+        vkDestroyBuffer(get_gpu_device(), blob->buffer, 0);
+
+    if (blob->memoryBlock.memory)
+        get_gpu_block_allocator(blob->memoryBlock.memoryTypeIndex)->fastFree(blob->memoryBlock);
+
+    blob->buffer = 0;
+    blob->memoryBlock.memory = 0;
+}
+
+// an image blob still in VK_IMAGE_LAYOUT_UNDEFINED is passed with discard
+int upload_blob(VkStagingRing& ring, const float* src, const VkBlob& blob, bool discard = false)
+{
+    if (blob.backend == BLOB_BACKEND_IMAGE)
+        return ring.upload(src, blob.image.image, discard ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL, blob.w, blob.h * blob.c, 1, sizeof(float));
+
+    return ring.upload(src, (VkDeviceSize)blob.w * blob.h * blob.c * sizeof(float), blob.buffer, 0);
+}
+
+int download_blob(VkStagingRing& ring, const VkBlob& blob, float* dst)
+{
+    if (blob.backend == BLOB_BACKEND_IMAGE)
+        return ring.download(blob.image.image, blob.w, blob.h * blob.c, 1, sizeof(float), dst);
+
+    return ring.download(blob.buffer, 0, (VkDeviceSize)blob.w * blob.h * blob.c * sizeof(float), dst);
+}
+
+// image blobs move to VK_IMAGE_LAYOUT_GENERAL for a kernel to write them, buffers need nothing
+void record_blob_init(VkCommandBuffer commandBuffer, const VkBlob& blob)
+{
+    if (blob.backend != BLOB_BACKEND_IMAGE)
+        return;
+
+    record_image_barrier(commandBuffer, blob.image.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+}
+
+// blobs bound to binding 0 .. count-1, all of one backend
+VkDescriptorSet get_blob_descriptor_set(VkDescriptorAllocator& descriptorAllocator, VkDescriptorSetLayout descriptorSetLayout, const VkBlob* blobs, int count)
+{
+    if (blobs[0].backend == BLOB_BACKEND_IMAGE)
+    {
+        std::vector<VkImageView> imageviews(count);
+        for (int i=0; i<count; i++)
+        {
+            imageviews[i] = blobs[i].image.imageview;
+        }
+
+        return descriptorAllocator.get(descriptorSetLayout, imageviews.data(), count);
+    }
+
+    std::vector<VkDescriptorBufferInfo> bufferInfos(count);
+    for (int i=0; i<count; i++)
+    {
+        bufferInfos[i].buffer = blobs[i].buffer;
+        bufferInfos[i].offset = 0;
+        bufferInfos[i].range = VK_WHOLE_SIZE;
+    }
+
+    return descriptorAllocator.get(descriptorSetLayout, bufferInfos.data(), count);
+}
+
+enum ReduceOp
+{
+    REDUCE_SUM = 0,
+    REDUCE_MAX = 1,
+    REDUCE_ARGMAX = 2,
+    REDUCE_MEAN = 3,// a sum divided by the element count in its last pass
+    REDUCE_OP_COUNT = 4
+};
+
+const char* get_reduce_op_name(ReduceOp op)
+{
+    static const char* names[REDUCE_OP_COUNT] = { "sum", "max", "argmax", "mean" };
+    return names[op];
+}
+
+// the partial layout of reduce.comp, index is the linear element index of an argmax
+struct ReduceResult
+{
+    float value;
+    int index;
+};
+
+// reduce_<op>_<input>[_subgroup].comp.spv, input is image, buffer or partial
+static std::string get_reduce_spv_path(ReduceOp op, const char* input, bool subgroup)
+{
+    const char* op_name = get_reduce_op_name(op == REDUCE_MEAN ? REDUCE_SUM : op);
+    return std::string("reduce_") + op_name + "_" + input + (subgroup ? "_subgroup" : "") + ".comp.spv";
+}
+
+// every element of a blob down to one ReduceResult, recorded as a chain of passes in one command buffer
+// a pass folds local_size * 4 elements into one partial, the partials ping-pong between two buffers
+// a pass dispatches at most maxComputeWorkGroupCount[0] workgroups, each striding over the rest
+// subgroup arithmetic does the in-workgroup step where the device has it, a shared memory tree otherwise
+class VkReduction
+{
+public:
+    VkReduction();
+    ~VkReduction();
+
+    // pipelines and partial buffers for blobs of w x h x c, use_subgroup false forces the shared memory tree
+    int create(ReduceOp op, BlobBackend backend, int w, int h, int c, bool use_subgroup = true);
+    void destroy();
+
+    // blob is expected in VK_IMAGE_LAYOUT_GENERAL with its writes visible to compute
+    // the result is at offset 0 of result_buffer when the command buffer retires
+    void record(VkCommandBuffer commandBuffer, VkDescriptorAllocator& descriptorAllocator, const VkBlob& blob);
+
+public:
+    VkBuffer result_buffer;
+    int pass_count;
+    bool subgroup;
+
+private:
+    // workgroups of the pass over n elements, clamped to the dispatch limit
+    int get_group_count(int n) const;
+
+    ReduceOp op;
+    int element_count;
+    uint32_t local_size;
+    uint32_t max_group_count;
+
+    ComputePipeline blob_cp;// first pass, reads the blob
+    ComputePipeline partial_cp;// later passes
+    VkBlob partials[2];
+};
+
+VkReduction::VkReduction()
+{
+    result_buffer = 0;
+    pass_count = 0;
+    subgroup = false;
+    op = REDUCE_SUM;
+    element_count = 0;
+    local_size = 0;
+    max_group_count = 0;
+    memset(&blob_cp, 0, sizeof(blob_cp));
+    memset(&partial_cp, 0, sizeof(partial_cp));
+    memset(partials, 0, sizeof(partials));
+}
+
+VkReduction::~VkReduction()
+{
+    destroy();
+}
+
+int VkReduction::create(ReduceOp _op, BlobBackend backend, int w, int h, int c, bool use_subgroup)
+{
+    GpuContext* ctx = get_current_gpu_context();
+    const VkPhysicalDeviceLimits& limits = ctx->info.properties.limits;
+
+    op = _op;
+    element_count = w * h * c;
+    if (element_count <= 0)
+    {
+        fprintf(stderr, "reduce over %d elements\n", element_count);
+        return -1;
+    }
+
+    subgroup = use_subgroup && ctx->support_subgroup_arithmetic;
+
+    // the tree halves the workgroup, it takes a power of two
+    local_size = 256;
+    while (local_size > limits.maxComputeWorkGroupSize[0] || local_size > limits.maxComputeWorkGroupInvocations)
+    {
+        local_size /= 2;
+    }
+
+    max_group_count = limits.maxComputeWorkGroupCount[0];
+
+    pass_count = 0;
+    int partial_count = 0;
+    for (int n=element_count; ; n=get_group_count(n))
+    {
+        if (pass_count == 1)
+            partial_count = n;
+
+        if (pass_count > 0 && n == 1)
+            break;
+
+        pass_count++;
+    }
+
+    VkDescriptorType blobDescriptorTypes[2] = { get_blob_descriptor_type(backend), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+    VkDescriptorType partialDescriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+
+    const char* input = backend == BLOB_BACKEND_IMAGE ? "image" : "buffer";
+    if (create_compute_pipeline(get_reduce_spv_path(op, input, subgroup).c_str(), blobDescriptorTypes, 2, local_size, 1, 1, &blob_cp) != 0)
+        return -1;
+
+    if (pass_count > 1 && create_compute_pipeline(get_reduce_spv_path(op, "partial", subgroup).c_str(), partialDescriptorTypes, 2, local_size, 1, 1, &partial_cp) != 0)
+        return -1;
+
+    // a partial is two floats wide, the second buffer takes the partials of the second pass
+    const int second_count = std::max(get_group_count(partial_count), 1);
+    if (create_blob(BLOB_BACKEND_BUFFER, partial_count * 2, 1, 1, &partials[0]) != 0 || create_blob(BLOB_BACKEND_BUFFER, second_count * 2, 1, 1, &partials[1]) != 0)
+        return -1;
+
+    result_buffer = partials[(pass_count - 1) % 2].buffer;
+
+    return 0;
+}
+
+void VkReduction::destroy()
+{
+    if (blob_cp.pipeline)
+        destroy_compute_pipeline(&blob_cp);
+    if (partial_cp.pipeline)
+        destroy_compute_pipeline(&partial_cp);
+
+    destroy_blob(&partials[0]);
+    destroy_blob(&partials[1]);
+
+    memset(&blob_cp, 0, sizeof(blob_cp));
+    memset(&partial_cp, 0, sizeof(partial_cp));
+    memset(partials, 0, sizeof(partials));
+
+    result_buffer = 0;
+    pass_count = 0;
+}
+
+void VkReduction::record(VkCommandBuffer commandBuffer, VkDescriptorAllocator& descriptorAllocator, const VkBlob& blob)
+{
+    int n = element_count;
+    for (int pi=0; pi<pass_count; pi++)
+    {
+        const ComputePipeline& cp = pi == 0 ? blob_cp : partial_cp;
+        const VkBlob& top_blob = partials[pi % 2];
+
+        VkDescriptorSet descriptorSet;
+        if (pi == 0 && blob.backend == BLOB_BACKEND_IMAGE)
+        {
+            // an image and a buffer, the allocator caches sets of one kind only
+            descriptorSet = descriptorAllocator.allocate(cp.descriptorSetLayout);
+
+            VkDescriptorImageInfo descriptorImageInfo;
+            descriptorImageInfo.sampler = 0;
+            descriptorImageInfo.imageView = blob.image.imageview;
+            descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+            VkDescriptorBufferInfo descriptorBufferInfo;
+            descriptorBufferInfo.buffer = top_blob.buffer;
+            descriptorBufferInfo.offset = 0;
+            descriptorBufferInfo.range = VK_WHOLE_SIZE;
+
+            VkWriteDescriptorSet writeDescriptorSets[2];
+            writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writeDescriptorSets[0].pNext = 0;
+            writeDescriptorSets[0].dstSet = descriptorSet;
+            writeDescriptorSets[0].dstBinding = 0;
+            writeDescriptorSets[0].dstArrayElement = 0;
+            writeDescriptorSets[0].descriptorCount = 1;
+            writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            writeDescriptorSets[0].pImageInfo = &descriptorImageInfo;
+            writeDescriptorSets[0].pBufferInfo = 0;
+            writeDescriptorSets[0].pTexelBufferView = 0;
+            writeDescriptorSets[1] = writeDescriptorSets[0];
+            writeDescriptorSets[1].dstBinding = 1;
+            writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writeDescriptorSets[1].pImageInfo = 0;
+            writeDescriptorSets[1].pBufferInfo = &descriptorBufferInfo;
+
+            vkUpdateDescriptorSets(get_gpu_device(), 2, writeDescriptorSets, 0, 0);
+        }
+        else
+        {
+            const VkBlob& bottom_blob = pi == 0 ? blob : partials[(pi - 1) % 2];
+            const VkBlob blobs[2] = { bottom_blob, top_blob };
+            descriptorSet = get_blob_descriptor_set(descriptorAllocator, cp.descriptorSetLayout, blobs, 2);
+        }
+
+        // an image is read row by row, buffers are flat
+        ShapeConstants shape;
+        shape.w = pi == 0 && blob.backend == BLOB_BACKEND_IMAGE ? blob.w : n;
+        shape.h = pi == 0 && blob.backend == BLOB_BACKEND_IMAGE ? blob.h * blob.c : 1;
+        shape.c = element_count;
+        shape.rowstep = 0;
+        shape.cstep = op == REDUCE_MEAN ? 1 : 0;
+
+        const int group_count = get_group_count(n);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+        record_shape_constants(commandBuffer, cp, shape);
+        vkCmdDispatch(commandBuffer, group_count, 1, 1);
+
+        // the next pass reads these partials, and overwrites the ones this pass read
+        record_buffer_barrier(commandBuffer, top_blob.buffer, 0, VK_WHOLE_SIZE,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+        n = group_count;
+    }
+}
+
+int VkReduction::get_group_count(int n) const
+{
+    const int group_elements = (int)local_size * 4;
+
+    const int group_count = (n + group_elements - 1) / group_elements;
+
+    return (uint32_t)group_count > max_group_count ? (int)max_group_count : group_count;
+}
+
+// work split of gemm.comp, the local size is local_size_x x local_size_y
+// a workgroup covers a (local_size_y * thread_m) x (local_size_x * thread_n) tile of C
+struct GemmTileConfig
+{
+    uint32_t local_size_x;
+    uint32_t local_size_y;
+    uint32_t thread_m;
+    uint32_t thread_n;
+    uint32_t tile_k;
+};
+
+// smallest first, the last one the device takes is the default
+static const GemmTileConfig gemm_tile_configs[] =
+{
+    { 8, 8, 1, 1, 8 },
+    { 16, 16, 1, 1, 16 },
+    { 16, 16, 2, 2, 16 },
+    { 16, 8, 4, 4, 16 },
+    { 16, 16, 4, 4, 16 },
+    { 16, 16, 4, 4, 32 },
+    { 16, 16, 8, 8, 16 },
+};
+
+static const int gemm_tile_config_count = sizeof(gemm_tile_configs) / sizeof(gemm_tile_configs[0]);
+
+// bytes of the A and B slices in shared memory
+static uint32_t get_gemm_shared_memory_size(const GemmTileConfig& tile)
+{
+    return (tile.local_size_y * tile.thread_m + tile.local_size_x * tile.thread_n) * tile.tile_k * sizeof(float);
+}
+
+static bool is_gemm_tile_supported(const GemmTileConfig& tile)
+{
+    const VkPhysicalDeviceLimits& limits = get_current_gpu_context()->info.properties.limits;
+
+    return tile.local_size_x <= limits.maxComputeWorkGroupSize[0]
+        && tile.local_size_y <= limits.maxComputeWorkGroupSize[1]
+        && tile.local_size_x * tile.local_size_y <= limits.maxComputeWorkGroupInvocations
+        && get_gemm_shared_memory_size(tile) <= limits.maxComputeSharedMemorySize;
+}
+
+// the largest tile within maxComputeSharedMemorySize and the workgroup limits
+GemmTileConfig select_gemm_tile()
+{
+    GemmTileConfig tile = gemm_tile_configs[0];
+    for (int i=1; i<gemm_tile_config_count; i++)
+    {
+        if (is_gemm_tile_supported(gemm_tile_configs[i]))
+            tile = gemm_tile_configs[i];
+    }
+
+    return tile;
+}
+
+// A B C bindings of one blob backend, the tile goes in through constant_id 3 4 5
+int create_gemm_pipeline(BlobBackend backend, const GemmTileConfig& tile, ComputePipeline* cp)
+{
+    const VkDescriptorType descriptorType = get_blob_descriptor_type(backend);
+    const VkDescriptorType descriptorTypes[3] = { descriptorType, descriptorType, descriptorType };
+
+    std::vector<uint32_t> specializations(3);
+    specializations[0] = tile.tile_k;
+    specializations[1] = tile.thread_m;
+    specializations[2] = tile.thread_n;
+
+    return create_compute_pipeline(get_blob_spv_path("gemm", backend).c_str(), descriptorTypes, 3, tile.local_size_x, tile.local_size_y, 1, cp, specializations);
+}
+
+// C = A * B with A of M x K and B of K x N, as blobs of w = K h = M and w = N h = K
+void record_gemm(VkCommandBuffer commandBuffer, const ComputePipeline& cp, const GemmTileConfig& tile, VkDescriptorSet descriptorSet, int M, int N, int K)
+{
+    ShapeConstants shape;
+    shape.w = N;
+    shape.h = M;
+    shape.c = K;
+    shape.rowstep = 0;
+    shape.cstep = 0;
+
+    const uint32_t tile_m = tile.local_size_y * tile.thread_m;
+    const uint32_t tile_n = tile.local_size_x * tile.thread_n;
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+    record_shape_constants(commandBuffer, cp, shape);
+    vkCmdDispatch(commandBuffer, (N + tile_n - 1) / tile_n, (M + tile_m - 1) / tile_m, 1);
+}
+
+// ms per dispatch of spv_path over a w x h x d grid, best of the warm submits, -1 on failure
+// prepare records the inputs into the first frame and returns the descriptor set, 0 on failure,
+// download records the output readback into the last timed submit and may be empty
+static double time_kernel_dispatch(const char* spv_path, const VkDescriptorType* descriptorTypes, int binding_count, VkDeviceSize staging_size, const ShapeConstants& shape, int w, int h, int d,
+    const std::function<VkDescriptorSet(VkStagingRing&, VkDescriptorAllocator&, const ComputePipeline&)>& prepare, const std::function<void(VkStagingRing&)>& download)
+{
+    const int loop = 10;
+
+    ComputePipeline cp;
+    if (create_compute_pipeline(spv_path, descriptorTypes, binding_count, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkStagingRing ring;
+    int ret = ring.create(staging_size, 1);
+
+    VkDescriptorAllocator descriptorAllocator;
+    ret |= descriptorAllocator.create(1);
+
+    double best = -1;
+
+    if (ret == 0)
+    {
+        descriptorAllocator.begin_frame(0);
+
+        ring.begin_frame();
+        VkDescriptorSet descriptorSet = prepare(ring, descriptorAllocator, cp);
+        ring.end_frame();
+        ring.wait_idle();
+
+        for (int ti=0; descriptorSet && ti<3; ti++)
+        {
+            double t0 = get_current_time();
+
+            ring.begin_frame();
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+            record_shape_constants(commandBuffer, cp, shape);
+            for (int li=0; li<loop; li++)
+            {
+                record_dispatch(commandBuffer, cp, w, h, d);
+            }
+            if (download && ti == 2)
+            {
+                download(ring);
+            }
+            ring.end_frame();
+            ring.wait_idle();
+
+            double t1 = get_current_time();
+
+            // first submit warms up the pipeline
+            if (ti > 0 && (best < 0 || (t1 - t0) / loop < best))
+                best = (t1 - t0) / loop;
+        }
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+
+    destroy_compute_pipeline(&cp);
+
+    return best;
+}
+
+// ms per dispatch of kernel over blobs of one backend, the last binding is the output
+// out receives the output blob when not null, returns -1 on failure
+static double time_blob_kernel(const char* kernel, int binding_count, BlobBackend backend, int w, int h, int c, const float* in, float* out)
+{
+    std::vector<VkDescriptorType> descriptorTypes(binding_count, get_blob_descriptor_type(backend));
+
+    std::vector<VkBlob> blobs(binding_count);
+    int ret = 0;
+    for (int i=0; i<binding_count; i++)
+    {
+        ret |= create_blob(backend, w, h, c, &blobs[i]);
+    }
+
+    double best = -1;
+
+    if (ret == 0)
+    {
+        best = time_kernel_dispatch(get_blob_spv_path(kernel, backend).c_str(), descriptorTypes.data(), binding_count, (VkDeviceSize)w * h * c * sizeof(float) * 2 + 1024, make_shape_constants(w, h * c, 1), w, h * c, 1,
+            [&](VkStagingRing& ring, VkDescriptorAllocator& descriptorAllocator, const ComputePipeline& cp) -> VkDescriptorSet {
+                // inputs get data, the output only its layout
+                for (int i=0; i<binding_count - 1; i++)
+                {
+                    upload_blob(ring, in, blobs[i], true);
+                }
+                record_blob_init(ring.command_buffer(), blobs[binding_count - 1]);
+
+                return get_blob_descriptor_set(descriptorAllocator, cp.descriptorSetLayout, blobs.data(), binding_count);
+            },
+            [&](VkStagingRing& ring) {
+                if (out)
+                    download_blob(ring, blobs[binding_count - 1], out);
+            });
+    }
+
+    for (int i=0; i<binding_count; i++)
+    {
+        destroy_blob(&blobs[i]);
+    }
+
+    return best;
+}
+
+// image against buffer performance varies a lot across vendors, measure kernel once per device
+// on a representative blob and keep the faster backend for the lifetime of the context
+BlobBackend select_blob_backend(const char* kernel, int binding_count)
+{
+    std::unordered_map<std::string, BlobBackend>& blob_backends = get_current_gpu_context()->blob_backends;
+
+    std::unordered_map<std::string, BlobBackend>::iterator it = blob_backends.find(kernel);
+    if (it != blob_backends.end())
+        return it->second;
+
+    const int w = 1024;
+    const int h = 1024;
+    const int c = 1;
+
+    std::vector<float> in(w * h * c, 1.f);
+
+    const double image_time = time_blob_kernel(kernel, binding_count, BLOB_BACKEND_IMAGE, w, h, c, in.data(), 0);
+    const double buffer_time = time_blob_kernel(kernel, binding_count, BLOB_BACKEND_BUFFER, w, h, c, in.data(), 0);
+
+    BlobBackend backend = BLOB_BACKEND_IMAGE;
+    if (buffer_time >= 0 && (image_time < 0 || buffer_time < image_time))
+        backend = BLOB_BACKEND_BUFFER;
+
+    VKTEST_LOGI("blob backend %s image %.4f ms buffer %.4f ms, use %s\n", kernel, image_time, buffer_time, backend == BLOB_BACKEND_BUFFER ? "buffer" : "image");
+
+    blob_backends[kernel] = backend;
+
+    return backend;
+}
+
+// a storage buffer kernels read caller host memory through
+// imported maps the caller pages themselves, the caller keeps them alive and unchanged until destroy_host_buffer,
+// otherwise the data was copied into a host visible block
+struct VkHostBuffer
+{
+    VkBuffer buffer;
+    VkDeviceSize offset;// of the caller pointer in buffer, imports start at the aligned address below it
+    VkDeviceSize size;
+    bool imported;
+    VkDeviceMemory memory;// imported allocation
+    VkMemoryBlock memoryBlock;// copy fallback
+};
+
+static int import_host_pointer(const void* ptr, size_t size, VkHostBuffer* hb)
+{
+    GpuContext* ctx = get_current_gpu_context();
+    VkDevice device = ctx->device;
+
+    // import whole aligned pages around the caller range
+    const VkDeviceSize alignment = ctx->minImportedHostPointerAlignment;
+    const size_t address = (size_t)ptr;
+    const size_t aligned_address = address / alignment * alignment;
+    const VkDeviceSize import_size = alignSize(address + size - aligned_address, alignment);
+    void* aligned_ptr = (void*)aligned_address;
+
+    VkMemoryHostPointerPropertiesEXT memoryHostPointerProperties;
+    memoryHostPointerProperties.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    memoryHostPointerProperties.pNext = 0;
+    memoryHostPointerProperties.memoryTypeBits = 0;
+
+    VkResult ret = ctx->vkGetMemoryHostPointerPropertiesEXT(device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, aligned_ptr, &memoryHostPointerProperties);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkGetMemoryHostPointerPropertiesEXT failed %d\n", ret);
+        return -1;
+    }
+
+    VkExternalMemoryBufferCreateInfo externalMemoryBufferCreateInfo;
+    externalMemoryBufferCreateInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    externalMemoryBufferCreateInfo.pNext = 0;
+    externalMemoryBufferCreateInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+    VkBufferCreateInfo bufferCreateInfo;
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.pNext = &externalMemoryBufferCreateInfo;
+    bufferCreateInfo.flags = 0;
+    bufferCreateInfo.size = import_size;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    bufferCreateInfo.queueFamilyIndexCount = 0;
+    bufferCreateInfo.pQueueFamilyIndices = 0;
+
+    ret = vkCreateBuffer(device, &bufferCreateInfo, 0, &hb->buffer);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateBuffer failed %d\n", ret);
+        hb->buffer = 0;
+        return -1;
+    }
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(device, hb->buffer, &memoryRequirements);
+
+    // prefer host coherent among the types both the buffer and the pointer allow
+    const uint32_t memoryTypeBits = memoryRequirements.memoryTypeBits & memoryHostPointerProperties.memoryTypeBits;
+    uint32_t memoryTypeIndex = (uint32_t)-1;
+    for (uint32_t i=0; i<ctx->info.memoryProperties.memoryTypeCount; i++)
+    {
+        if (!(memoryTypeBits & (1 << i)))
+            continue;
+
+        if (memoryTypeIndex == (uint32_t)-1 || (!is_host_coherent(memoryTypeIndex) && is_host_coherent(i)))
+            memoryTypeIndex = i;
+    }
+
+    if (memoryTypeIndex == (uint32_t)-1)
+    {
+        fprintf(stderr, "no memory type can import host pointer %p\n", aligned_ptr);
+        vkDestroyBuffer(device, hb->buffer, 0);
+        hb->buffer = 0;
+        return -1;
+    }
+
+    VkImportMemoryHostPointerInfoEXT importMemoryHostPointerInfo;
+    importMemoryHostPointerInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    importMemoryHostPointerInfo.pNext = 0;
+    importMemoryHostPointerInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    importMemoryHostPointerInfo.pHostPointer = aligned_ptr;
+
+    VkMemoryAllocateInfo memoryAllocateInfo;
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.pNext = &importMemoryHostPointerInfo;
+    memoryAllocateInfo.allocationSize = import_size;
+    memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    ret = vkAllocateMemory(device, &memoryAllocateInfo, 0, &hb->memory);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkAllocateMemory import failed %d\n", ret);
+        vkDestroyBuffer(device, hb->buffer, 0);
+        hb->buffer = 0;
+        hb->memory = 0;
+        return -1;
+    }
+
+    ret = vkBindBufferMemory(device, hb->buffer, hb->memory, 0);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBindBufferMemory failed %d\n", ret);
+        return -1;
+    }
+
+    hb->offset = address - aligned_address;
+    hb->imported = true;
+
+    return 0;
+}
+
+void destroy_host_buffer(VkHostBuffer* hb)
+{
+    if (hb->buffer)
+        vkDestroyBuffer(get_gpu_device(), hb->buffer, 0);
+
+    if (hb->memory)
+        vkFreeMemory(get_gpu_device(), hb->memory, 0);
+
+    if (hb->memoryBlock.memory)
+        get_gpu_block_allocator(hb->memoryBlock.memoryTypeIndex)->fastFree(hb->memoryBlock);
+
+    hb->buffer = 0;
+    hb->memory = 0;
+    hb->memoryBlock.memory = 0;
+}
+
+// zero copy when the device imports host pointers, allow_import is set and the descriptor offset of ptr is usable
+// a copy into host visible memory otherwise
+int import_host_buffer(const void* ptr, size_t size, VkHostBuffer* hb, bool allow_import = true)
+{
+    hb->buffer = 0;
+    hb->offset = 0;
+    hb->size = size;
+    hb->imported = false;
+    hb->memory = 0;
+    hb->memoryBlock.memory = 0;
+
+    // the pointer lands at its offset within the first imported page, which a descriptor can only bind at minStorageBufferOffsetAlignment
+    GpuContext* ctx = get_current_gpu_context();
+    const VkDeviceSize import_offset = (size_t)ptr % ctx->minImportedHostPointerAlignment;
+    const bool offset_aligned = import_offset % ctx->info.properties.limits.minStorageBufferOffsetAlignment == 0;
+    if (allow_import && ctx->support_external_memory_host && !offset_aligned)
+    {
+        VKTEST_LOGI("host pointer %p offset %lu is not storage buffer aligned, copy instead\n", ptr, (unsigned long)import_offset);
+    }
+
+    if (allow_import && ctx->support_external_memory_host && offset_aligned)
+    {
+        if (import_host_pointer(ptr, size, hb) == 0)
+            return 0;
+
+        destroy_host_buffer(hb);
+        hb->size = size;
+        fprintf(stderr, "import host pointer %p failed, copy instead\n", ptr);
+    }
+
+    hb->buffer = create_buffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+    if (!hb->buffer)
+        return -1;
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(get_gpu_device(), hb->buffer, &memoryRequirements);
+
+    if (get_gpu_block_allocator(get_gpu_host_visible_memoryTypeIndex())->fastMalloc(memoryRequirements, true, &hb->memoryBlock) != 0)
+        return -1;
+
+    VkResult ret = vkBindBufferMemory(get_gpu_device(), hb->buffer, hb->memoryBlock.memory, hb->memoryBlock.offset);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBindBufferMemory failed %d\n", ret);
+        return -1;
+    }
+
+    memcpy(hb->memoryBlock.mapped_ptr, ptr, size);
+    flush_memory_block(hb->memoryBlock);
+
+    return 0;
+}
+
+static const char* get_channel_layout_name(ImageChannelLayout channel_layout)
+{
+    if (channel_layout == IMAGE_CHANNEL_3D)
+        return "3d";
+    if (channel_layout == IMAGE_CHANNEL_ARRAY)
+        return "array";
+    return "2d";
+}
+
+// ms per imagescale dispatch over a w x h x c image of one channel layout
+// out receives the output when not null, returns -1 on failure or when the shape exceeds the layout limits
+static double time_channel_layout(ImageChannelLayout channel_layout, int w, int h, int c, const float* in, float* out)
+{
+    // 3d keeps c in depth, array in layers
+    const int d = channel_layout == IMAGE_CHANNEL_3D ? c : 1;
+    const int layers = channel_layout == IMAGE_CHANNEL_3D ? 1 : c;
+
+    const std::string spv_path = std::string("imagescale_") + get_channel_layout_name(channel_layout) + ".comp.spv";
+
+    VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    VkStorageImage bottom_blob;
+    VkStorageImage top_blob;
+    int ret = create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, channel_layout, w, h, c, &bottom_blob);
+    ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, channel_layout, w, h, c, &top_blob);
+
+    double best = -1;
+
+    if (ret == 0)
+    {
+        best = time_kernel_dispatch(spv_path.c_str(), descriptorTypes, 2, (VkDeviceSize)w * h * c * sizeof(float) * 2 + 1024, make_shape_constants(w, h, c), w, h, c,
+            [&](VkStagingRing& ring, VkDescriptorAllocator& descriptorAllocator, const ComputePipeline& cp) -> VkDescriptorSet {
+                ring.upload(in, bottom_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, w, h, d, sizeof(float), layers);
+                record_image_barrier(ring.command_buffer(), top_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+                VkImageView imageviews[2] = { bottom_blob.imageview, top_blob.imageview };
+                return descriptorAllocator.get(cp.descriptorSetLayout, imageviews, 2);
+            },
+            [&](VkStagingRing& ring) {
+                if (out)
+                    ring.download(top_blob.image, w, h, d, sizeof(float), out, layers);
+            });
+    }
+
+    destroy_storage_image(&bottom_blob);
+    destroy_storage_image(&top_blob);
+
+    return best;
+}
+
+// the 3d against array trade-off depends on how the driver tiles depth, chosen like select_blob_backend
+// on a many channel shape
+ImageChannelLayout select_channel_layout()
+{
+    GpuContext* ctx = get_current_gpu_context();
+    if (ctx->channel_layout != -1)
+        return (ImageChannelLayout)ctx->channel_layout;
+
+    const int w = 128;
+    const int h = 128;
+    const int c = 64;
+
+    std::vector<float> in(w * h * c, 1.f);
+
+    const double time_3d = time_channel_layout(IMAGE_CHANNEL_3D, w, h, c, in.data(), 0);
+    const double time_array = time_channel_layout(IMAGE_CHANNEL_ARRAY, w, h, c, in.data(), 0);
+
+    ImageChannelLayout channel_layout = IMAGE_CHANNEL_3D;
+    if (time_array >= 0 && (time_3d < 0 || time_array < time_3d))
+        channel_layout = IMAGE_CHANNEL_ARRAY;
+
+    VKTEST_LOGI("channel layout 3d %.4f ms array %.4f ms, use %s\n", time_3d, time_array, get_channel_layout_name(channel_layout));
+
+    ctx->channel_layout = channel_layout;
+
+    return channel_layout;
+}
+
+// a bind, barrier and dispatch sequence recorded once and resubmitted as is
+// vulkan invalidates a command buffer when a set it binds is updated, so nothing patchable goes into the recording:
+// parameters live in a host visible uniform buffer with one copy per frame, bound at the frame offset of a
+// dynamic uniform buffer, and a descriptor slot takes all its sets up front, every combination of set variants
+// gets a command buffer per frame and patching one only picks another
+class VkRecordedProgram
+{
+public:
+    VkRecordedProgram();
+    ~VkRecordedProgram();
+
+    // parameter_size bytes of parameters for frame_count submits in flight
+    int create(VkDeviceSize parameter_size = 0, int frame_count = 2);
+    void destroy();
+
+    // build, the ops are replayed in order
+    void record_pipeline(const ComputePipeline& cp);
+
+    // variant 0 is bound until patched, a set holding the uniform buffer dynamic of parameter_slot gets the frame offset
+    int record_descriptor_set(const VkDescriptorSet* descriptorSets, int variant_count = 1, int parameter_slot = -1);
+
+    // size bytes of the parameter buffer, -1 when they do not fit in parameter_size
+    int record_parameters(const void* data, uint32_t size);
+
+    // the grid is recorded, patched parameters may shrink the shape but not grow it
+    void record_dispatch(int w, int h, int d);
+    void record_image_barrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask);
+
+    // write this into the uniform buffer dynamic binding of every set of the slot
+    VkDescriptorBufferInfo get_parameter_buffer_info(int parameter_slot) const;
+
+    // records the command buffers of every frame and variant combination, the first submit does it otherwise
+    int build();
+
+    // patch between submissions, neither waits nor records
+    void patch_descriptor_set(int slot, int variant);
+    void patch_parameters(int parameter_slot, const void* data);
+
+    // waits only for the frame submitted frame_count submits ago
+    int submit();
+    int wait();
+
+public:
+    int record_count;
+
+private:
+    enum OpType
+    {
+        OP_BIND_PIPELINE,
+        OP_BIND_DESCRIPTOR_SET,
+        OP_DISPATCH,
+        OP_IMAGE_BARRIER
+    };
+
+    struct Op
+    {
+        OpType type;
+        ComputePipeline cp;
+        std::vector<VkDescriptorSet> descriptorSets;
+        int variant;
+        int parameter_slot;
+        int w;
+        int h;
+        int d;
+        VkImage image;
+        VkImageLayout oldLayout;
+        VkImageLayout newLayout;
+        VkAccessFlags srcAccessMask;
+        VkAccessFlags dstAccessMask;
+        VkPipelineStageFlags srcStageMask;
+        VkPipelineStageFlags dstStageMask;
+    };
+
+    struct Parameters
+    {
+        VkDeviceSize offset;// within the copy of a frame
+        std::vector<unsigned char> data;
+    };
+
+    struct Frame
+    {
+        std::vector<VkCommandBuffer> commandBuffers;// one per variant combination
+        VkFence fence;
+        bool submitted;
+    };
+
+    // the combination of the currently patched variants, mixed radix over the descriptor slots
+    int get_combination() const;
+
+    int record(VkCommandBuffer commandBuffer, int frame, int combination);
+    int retire(Frame& frame);
+
+    VkCommandPool commandPool;
+    VkBuffer parameterBuffer;
+    VkMemoryBlock parameterMemoryBlock;
+    VkDeviceSize parameter_frame_size;
+    VkDeviceSize parameter_cursor;
+    int frame_index;
+    bool built;
+    std::vector<Frame> frames;
+    std::vector<Parameters> parameters;
+    std::vector<Op> ops;
+};
+
+VkRecordedProgram::VkRecordedProgram()
+{
+    record_count = 0;
+    commandPool = 0;
+    parameterBuffer = 0;
+    memset(&parameterMemoryBlock, 0, sizeof(parameterMemoryBlock));
+    parameter_frame_size = 0;
+    parameter_cursor = 0;
+    frame_index = 0;
+    built = false;
+}
+
+VkRecordedProgram::~VkRecordedProgram()
+{
+    destroy();
+}
+
+int VkRecordedProgram::create(VkDeviceSize parameter_size, int frame_count)
+{
+    VkDevice device = get_gpu_device();
+
+    if (parameter_size > 0)
+    {
+        // every frame copy starts at a valid dynamic offset
+        parameter_frame_size = alignSize(parameter_size, get_gpu_info().properties.limits.minUniformBufferOffsetAlignment);
+
+        parameterBuffer = create_buffer(parameter_frame_size * frame_count, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+        if (!parameterBuffer)
+            return -1;
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetBufferMemoryRequirements(device, parameterBuffer, &memoryRequirements);
+
+        if (get_gpu_block_allocator(get_gpu_host_visible_memoryTypeIndex())->fastMalloc(memoryRequirements, true, &parameterMemoryBlock) != 0)
+            return -1;
+
+        VkResult ret = vkBindBufferMemory(device, parameterBuffer, parameterMemoryBlock.memory, parameterMemoryBlock.offset);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkBindBufferMemory failed %d\n", ret);
+            return -1;
+        }
+    }
+
+    VkCommandPoolCreateInfo commandPoolCreateInfo;
+    commandPoolCreateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    commandPoolCreateInfo.pNext = 0;
+    commandPoolCreateInfo.flags = 0;
+    commandPoolCreateInfo.queueFamilyIndex = get_gpu_queueFamilyIndex();
+
+    VkResult ret = vkCreateCommandPool(device, &commandPoolCreateInfo, 0, &commandPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateCommandPool failed %d\n", ret);
+        return -1;
+    }
+
+    frames.resize(frame_count);
+    for (int i=0; i<frame_count; i++)
+    {
+        Frame& frame = frames[i];
+        frame.fence = 0;
+        frame.submitted = false;
+
+        VkFenceCreateInfo fenceCreateInfo;
+        fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceCreateInfo.pNext = 0;
+        fenceCreateInfo.flags = 0;
+
+        ret = vkCreateFence(device, &fenceCreateInfo, 0, &frame.fence);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkCreateFence failed %d\n", ret);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void VkRecordedProgram::destroy()
+{
+    VkDevice device = get_gpu_device();
+
+    wait();
+
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        vkDestroyFence(device, frames[i].fence, 0);
+    }
+    frames.clear();
+
+    if (commandPool)
+    {
+        vkDestroyCommandPool(device, commandPool, 0);
+        commandPool = 0;
+    }
+
+    if (parameterBuffer)
+    {
+        vkDestroyBuffer(device, parameterBuffer, 0);
+        parameterBuffer = 0;
+    }
+
+    if (parameterMemoryBlock.memory)
+    {
+        get_gpu_block_allocator(parameterMemoryBlock.memoryTypeIndex)->fastFree(parameterMemoryBlock);
+        parameterMemoryBlock.memory = 0;
+    }
+
+    parameter_frame_size = 0;
+    parameter_cursor = 0;
+    frame_index = 0;
+    built = false;
+    parameters.clear();
+    ops.clear();
+}
+
+void VkRecordedProgram::record_pipeline(const ComputePipeline& cp)
+{
+    Op op;
+    op.type = OP_BIND_PIPELINE;
+    op.cp = cp;
+    ops.push_back(op);
+    built = false;
+}
+
+int VkRecordedProgram::record_descriptor_set(const VkDescriptorSet* descriptorSets, int variant_count, int parameter_slot)
+{
+    Op op;
+    op.type = OP_BIND_DESCRIPTOR_SET;
+    op.descriptorSets.assign(descriptorSets, descriptorSets + variant_count);
+    op.variant = 0;
+    op.parameter_slot = parameter_slot;
+    ops.push_back(op);
+    built = false;
+    return (int)ops.size() - 1;
+}
+
+int VkRecordedProgram::record_parameters(const void* data, uint32_t size)
+{
+    const VkDeviceSize offset = alignSize(parameter_cursor, get_gpu_info().properties.limits.minUniformBufferOffsetAlignment);
+    if (offset + size > parameter_frame_size)
+    {
+        fprintf(stderr, "parameters of %u bytes exceed the parameter size %lu\n", size, (unsigned long)parameter_frame_size);
+        return -1;
+    }
+
+    Parameters p;
+    p.offset = offset;
+    p.data.assign((const unsigned char*)data, (const unsigned char*)data + size);
+    parameters.push_back(p);
+
+    parameter_cursor = offset + size;
+
+    return (int)parameters.size() - 1;
+}
+
+void VkRecordedProgram::record_dispatch(int w, int h, int d)
+{
+    Op op;
+    op.type = OP_DISPATCH;
+    op.w = w;
+    op.h = h;
+    op.d = d;
+    ops.push_back(op);
+    built = false;
+}
+
+void VkRecordedProgram::record_image_barrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask)
+{
+    Op op;
+    op.type = OP_IMAGE_BARRIER;
+    op.image = image;
+    op.oldLayout = oldLayout;
+    op.newLayout = newLayout;
+    op.srcAccessMask = srcAccessMask;
+    op.dstAccessMask = dstAccessMask;
+    op.srcStageMask = srcStageMask;
+    op.dstStageMask = dstStageMask;
+    ops.push_back(op);
+    built = false;
+}
+
+VkDescriptorBufferInfo VkRecordedProgram::get_parameter_buffer_info(int parameter_slot) const
+{
+    // the offset of frame 0, later frames add theirs as the dynamic offset
+    VkDescriptorBufferInfo descriptorBufferInfo;
+    descriptorBufferInfo.buffer = parameterBuffer;
+    descriptorBufferInfo.offset = parameters[parameter_slot].offset;
+    descriptorBufferInfo.range = parameters[parameter_slot].data.size();
+    return descriptorBufferInfo;
+}
+
+int VkRecordedProgram::get_combination() const
+{
+    int combination = 0;
+    for (size_t i=0; i<ops.size(); i++)
+    {
+        const Op& op = ops[i];
+        if (op.type == OP_BIND_DESCRIPTOR_SET)
+            combination = combination * (int)op.descriptorSets.size() + op.variant;
+    }
+
+    return combination;
+}
+
+int VkRecordedProgram::build()
+{
+    VkDevice device = get_gpu_device();
+
+    wait();
+
+    int combination_count = 1;
+    for (size_t i=0; i<ops.size(); i++)
+    {
+        if (ops[i].type == OP_BIND_DESCRIPTOR_SET)
+            combination_count *= (int)ops[i].descriptorSets.size();
+    }
+
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        Frame& frame = frames[i];
+
+        if (!frame.commandBuffers.empty())
+        {
+            vkFreeCommandBuffers(device, commandPool, frame.commandBuffers.size(), frame.commandBuffers.data());
+            frame.commandBuffers.clear();
+        }
+
+        frame.commandBuffers.resize(combination_count);
+
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo;
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.pNext = 0;
+        commandBufferAllocateInfo.commandPool = commandPool;
+        commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        commandBufferAllocateInfo.commandBufferCount = combination_count;
+
+        VkResult ret = vkAllocateCommandBuffers(device, &commandBufferAllocateInfo, frame.commandBuffers.data());
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkAllocateCommandBuffers failed %d\n", ret);
+            frame.commandBuffers.clear();
+            return -1;
+        }
+
+        for (int j=0; j<combination_count; j++)
+        {
+            if (record(frame.commandBuffers[j], (int)i, j) != 0)
+                return -1;
+        }
+    }
+
+    built = true;
+
+    return 0;
+}
+
+int VkRecordedProgram::record(VkCommandBuffer commandBuffer, int frame, int combination)
+{
+    // reusable, no one time submit bit
+    VkCommandBufferBeginInfo commandBufferBeginInfo;
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = 0;
+    commandBufferBeginInfo.flags = 0;
+    commandBufferBeginInfo.pInheritanceInfo = 0;
+
+    VkResult ret = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkBeginCommandBuffer failed %d\n", ret);
+        return -1;
+    }
+
+    // the variant of every slot, the last slot varies fastest as in get_combination
+    std::vector<int> variants;
+    for (int i=(int)ops.size()-1; i>=0; i--)
+    {
+        const Op& op = ops[i];
+        if (op.type != OP_BIND_DESCRIPTOR_SET)
+            continue;
+
+        const int variant_count = (int)op.descriptorSets.size();
+        variants.insert(variants.begin(), combination % variant_count);
+        combination /= variant_count;
+    }
+
+    const ComputePipeline* cp = 0;
+    int set_index = 0;
+    for (size_t i=0; i<ops.size(); i++)
+    {
+        const Op& op = ops[i];
+
+        if (op.type == OP_BIND_PIPELINE)
+        {
+            cp = &op.cp;
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp->pipeline);
+        }
+        if (op.type == OP_BIND_DESCRIPTOR_SET)
+        {
+            const VkDescriptorSet descriptorSet = op.descriptorSets[variants[set_index++]];
+            const uint32_t dynamicOffset = (uint32_t)(frame * parameter_frame_size);
+            if (op.parameter_slot >= 0)
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp->pipelineLayout, 0, 1, &descriptorSet, 1, &dynamicOffset);
+            else
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp->pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+        }
+        if (op.type == OP_DISPATCH)
+        {
+            ::record_dispatch(commandBuffer, *cp, op.w, op.h, op.d);
+        }
+        if (op.type == OP_IMAGE_BARRIER)
+        {
+            ::record_image_barrier(commandBuffer, op.image, op.oldLayout, op.newLayout, op.srcAccessMask, op.dstAccessMask, op.srcStageMask, op.dstStageMask);
+        }
+    }
+
+    ret = vkEndCommandBuffer(commandBuffer);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkEndCommandBuffer failed %d\n", ret);
+        return -1;
+    }
+
+    record_count++;
+
+    return 0;
+}
+
+void VkRecordedProgram::patch_descriptor_set(int slot, int variant)
+{
+    ops[slot].variant = variant;
+}
+
+void VkRecordedProgram::patch_parameters(int parameter_slot, const void* data)
+{
+    // lands in the copy of the next frame at its submit
+    Parameters& p = parameters[parameter_slot];
+    memcpy(p.data.data(), data, p.data.size());
+}
+
+int VkRecordedProgram::submit()
+{
+    if (!built && build() != 0)
+        return -1;
+
+    // the command buffers are not simultaneous use, and the frame copy of the parameters is overwritten below
+    Frame& frame = frames[frame_index];
+    if (retire(frame) != 0)
+        return -1;
+
+    if (!parameters.empty())
+    {
+        unsigned char* frame_ptr = (unsigned char*)parameterMemoryBlock.mapped_ptr + frame_index * parameter_frame_size;
+        for (size_t i=0; i<parameters.size(); i++)
+        {
+            memcpy(frame_ptr + parameters[i].offset, parameters[i].data.data(), parameters[i].data.size());
+        }
+
+        flush_memory_block(parameterMemoryBlock);
+    }
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = 0;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = 0;
+    submitInfo.pWaitDstStageMask = 0;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &frame.commandBuffers[get_combination()];
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = 0;
+
+    VkResult ret = vkQueueSubmit(get_gpu_queue(), 1, &submitInfo, frame.fence);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkQueueSubmit failed %d\n", ret);
+        return -1;
+    }
+
+    frame.submitted = true;
+    frame_index = (frame_index + 1) % (int)frames.size();
+
+    return 0;
+}
+
+int VkRecordedProgram::retire(Frame& frame)
+{
+    if (!frame.submitted)
+        return 0;
+
+    VkResult ret = vkWaitForFences(get_gpu_device(), 1, &frame.fence, VK_TRUE, (uint64_t)-1);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkWaitForFences failed %d\n", ret);
+        return -1;
+    }
+
+    vkResetFences(get_gpu_device(), 1, &frame.fence);
+
+    frame.submitted = false;
+
+    return 0;
+}
+
+int VkRecordedProgram::wait()
+{
+    int ret = 0;
+    for (size_t i=0; i<frames.size(); i++)
+    {
+        if (retire(frames[i]) != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+// kernels declared with the images and buffers they read and write, recorded in order into one command buffer
+// a barrier goes in only before a kernel that reads what an earlier kernel wrote, or writes what an earlier
+// kernel read or wrote, and every pending write a later kernel touches is folded into that same vkCmdPipelineBarrier
+class VkComputeGraph
+{
+public:
+    VkComputeGraph();
+
+    // layout is the current one, VK_IMAGE_LAYOUT_UNDEFINED discards the contents on first use
+    int add_image(VkImage image, VkImageLayout layout);
+    int add_buffer(VkBuffer buffer);
+
+    // reads and writes are ids from add_image and add_buffer
+    void add_kernel(const ComputePipeline& cp, VkDescriptorSet descriptorSet, const ShapeConstants& shape, int w, int h, int d, const std::vector<int>& reads, const std::vector<int>& writes);
+
+    // naive puts one broad barrier per touched resource after every dispatch instead
+    // images are left in VK_IMAGE_LAYOUT_GENERAL, the outputs of the last writers are not synchronized
+    // recording again into the same command buffer continues from the accesses the previous record left pending
+    void record(VkCommandBuffer commandBuffer, bool naive = false);
+
+    // forget the pending accesses, before recording into a command buffer that starts after the previous one retired
+    void reset();
+
+public:
+    // of the last record
+    int barrier_call_count;
+    int barrier_count;
+
+private:
+    struct Resource
+    {
+        VkImage image;
+        VkBuffer buffer;
+        VkImageLayout layout;
+        int last_use;// kernel index
+    };
+
+    struct Kernel
+    {
+        ComputePipeline cp;
+        VkDescriptorSet descriptorSet;
+        ShapeConstants shape;
+        int w;
+        int h;
+        int d;
+        std::vector<int> reads;
+        std::vector<int> writes;
+    };
+
+    void record_barrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, const std::vector<VkBufferMemoryBarrier>& bufferBarriers, const std::vector<VkImageMemoryBarrier>& imageBarriers);
+
+    std::vector<Resource> resources;
+    std::vector<Kernel> kernels;
+
+    // written or read by a dispatch no barrier has covered yet, per resource
+    std::vector<char> pending_write;
+    std::vector<char> pending_read;
+};
+
+VkComputeGraph::VkComputeGraph()
+{
+    barrier_call_count = 0;
+    barrier_count = 0;
+}
+
+int VkComputeGraph::add_image(VkImage image, VkImageLayout layout)
+{
+    Resource r;
+    r.image = image;
+    r.buffer = 0;
+    r.layout = layout;
+    r.last_use = -1;
+    resources.push_back(r);
+    pending_write.push_back(0);
+    pending_read.push_back(0);
+    return (int)resources.size() - 1;
+}
+
+int VkComputeGraph::add_buffer(VkBuffer buffer)
+{
+    Resource r;
+    r.image = 0;
+    r.buffer = buffer;
+    r.layout = VK_IMAGE_LAYOUT_GENERAL;
+    r.last_use = -1;
+    resources.push_back(r);
+    pending_write.push_back(0);
+    pending_read.push_back(0);
+    return (int)resources.size() - 1;
+}
+
+void VkComputeGraph::add_kernel(const ComputePipeline& cp, VkDescriptorSet descriptorSet, const ShapeConstants& shape, int w, int h, int d, const std::vector<int>& reads, const std::vector<int>& writes)
+{
+    Kernel k;
+    k.cp = cp;
+    k.descriptorSet = descriptorSet;
+    k.shape = shape;
+    k.w = w;
+    k.h = h;
+    k.d = d;
+    k.reads = reads;
+    k.writes = writes;
+    kernels.push_back(k);
+
+    const int ki = (int)kernels.size() - 1;
+    for (size_t i=0; i<reads.size(); i++)
+    {
+        resources[reads[i]].last_use = ki;
+    }
+    for (size_t i=0; i<writes.size(); i++)
+    {
+        resources[writes[i]].last_use = ki;
+    }
+}
+
+static VkBufferMemoryBarrier make_buffer_barrier(VkBuffer buffer, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask)
+{
+    VkBufferMemoryBarrier bufferBarrier;
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.pNext = 0;
+    bufferBarrier.srcAccessMask = srcAccessMask;
+    bufferBarrier.dstAccessMask = dstAccessMask;
+    bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.buffer = buffer;
+    bufferBarrier.offset = 0;
+    bufferBarrier.size = VK_WHOLE_SIZE;
+    return bufferBarrier;
+}
+
+static VkImageMemoryBarrier make_image_barrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask)
+{
+    VkImageMemoryBarrier imageBarrier;
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.pNext = 0;
+    imageBarrier.srcAccessMask = srcAccessMask;
+    imageBarrier.dstAccessMask = dstAccessMask;
+    imageBarrier.oldLayout = oldLayout;
+    imageBarrier.newLayout = newLayout;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.baseMipLevel = 0;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.baseArrayLayer = 0;
+    imageBarrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    return imageBarrier;
+}
+
+void VkComputeGraph::record_barrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, const std::vector<VkBufferMemoryBarrier>& bufferBarriers, const std::vector<VkImageMemoryBarrier>& imageBarriers)
+{
+    vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 0, 0, (uint32_t)bufferBarriers.size(), bufferBarriers.empty() ? 0 : bufferBarriers.data(), (uint32_t)imageBarriers.size(), imageBarriers.empty() ? 0 : imageBarriers.data());
+
+    barrier_call_count++;
+    barrier_count += (int)(bufferBarriers.size() + imageBarriers.size());
+}
+
+void VkComputeGraph::record(VkCommandBuffer commandBuffer, bool naive)
+{
+    barrier_call_count = 0;
+    barrier_count = 0;
+
+    const VkAccessFlags shader_access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    for (size_t ki=0; ki<kernels.size(); ki++)
+    {
+        const Kernel& k = kernels[ki];
+
+        std::vector<VkBufferMemoryBarrier> bufferBarriers;
+        std::vector<VkImageMemoryBarrier> imageBarriers;
+
+        if (naive)
+        {
+            // one transition per image right before its first use
+            for (int pass=0; pass<2; pass++)
+            {
+                const std::vector<int>& ids = pass == 0 ? k.reads : k.writes;
+                for (size_t i=0; i<ids.size(); i++)
+                {
+                    Resource& r = resources[ids[i]];
+                    if (!r.image || r.layout == VK_IMAGE_LAYOUT_GENERAL)
+                        continue;
+
+                    imageBarriers.assign(1, make_image_barrier(r.image, r.layout, VK_IMAGE_LAYOUT_GENERAL, 0, shader_access));
+                    record_barrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, bufferBarriers, imageBarriers);
+                    r.layout = VK_IMAGE_LAYOUT_GENERAL;
+                }
+            }
+        }
+        else
+        {
+            bool need_barrier = false;
+            for (size_t i=0; i<k.reads.size(); i++)
+            {
+                const int id = k.reads[i];
+                if (pending_write[id] || resources[id].layout != VK_IMAGE_LAYOUT_GENERAL)
+                    need_barrier = true;
+            }
+            for (size_t i=0; i<k.writes.size(); i++)
+            {
+                const int id = k.writes[i];
+                if (pending_write[id] || pending_read[id] || resources[id].layout != VK_IMAGE_LAYOUT_GENERAL)
+                    need_barrier = true;
+            }
+
+            if (need_barrier)
+            {
+                VkPipelineStageFlags srcStageMask = 0;
+
+                // the execution dependency already covers every earlier dispatch, so pay for all
+                // pending writes and transitions the remaining kernels need in this one call
+                for (size_t id=0; id<resources.size(); id++)
+                {
+                    Resource& r = resources[id];
+                    if (r.last_use < (int)ki)
+                        continue;
+
+                    const bool transition = r.image && r.layout != VK_IMAGE_LAYOUT_GENERAL;
+                    if (!transition && !pending_write[id])
+                        continue;
+
+                    const VkAccessFlags srcAccessMask = pending_write[id] ? VK_ACCESS_SHADER_WRITE_BIT : 0;
+                    srcStageMask |= pending_write[id] ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+
+                    if (r.image)
+                        imageBarriers.push_back(make_image_barrier(r.image, r.layout, VK_IMAGE_LAYOUT_GENERAL, srcAccessMask, shader_access));
+                    else
+                        bufferBarriers.push_back(make_buffer_barrier(r.buffer, srcAccessMask, shader_access));
+
+                    r.layout = VK_IMAGE_LAYOUT_GENERAL;
+                    pending_write[id] = 0;
+                }
+
+                // write after read needs the execution dependency only
+                for (size_t id=0; id<resources.size(); id++)
+                {
+                    if (pending_read[id])
+                        srcStageMask |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+                    pending_read[id] = 0;
+                }
+
+                record_barrier(commandBuffer, srcStageMask, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, bufferBarriers, imageBarriers);
+            }
+        }
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, k.cp.pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, k.cp.pipelineLayout, 0, 1, &k.descriptorSet, 0, 0);
+        record_shape_constants(commandBuffer, k.cp, k.shape);
+        record_dispatch(commandBuffer, k.cp, k.w, k.h, k.d);
+
+        for (size_t i=0; i<k.reads.size(); i++)
+        {
+            pending_read[k.reads[i]] = 1;
+        }
+        for (size_t i=0; i<k.writes.size(); i++)
+        {
+            pending_write[k.writes[i]] = 1;
+        }
+
+        if (naive)
+        {
+            // everything the dispatch touched, made visible to anything after it
+            for (int pass=0; pass<2; pass++)
+            {
+                const std::vector<int>& ids = pass == 0 ? k.reads : k.writes;
+                for (size_t i=0; i<ids.size(); i++)
+                {
+                    const Resource& r = resources[ids[i]];
+
+                    // covers both the reads and the writes of the dispatch
+                    pending_read[ids[i]] = 0;
+                    pending_write[ids[i]] = 0;
+
+                    bufferBarriers.clear();
+                    imageBarriers.clear();
+                    if (r.image)
+                        imageBarriers.push_back(make_image_barrier(r.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT));
+                    else
+                        bufferBarriers.push_back(make_buffer_barrier(r.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT));
+
+                    record_barrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, bufferBarriers, imageBarriers);
+                }
+            }
+        }
+    }
+}
+
+void VkComputeGraph::reset()
+{
+    std::fill(pending_write.begin(), pending_write.end(), 0);
+    std::fill(pending_read.begin(), pending_read.end(), 0);
+}
+
+struct LocalSizeTuneEntry
+{
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    std::string kernel;
+    uint32_t local_size_x;
+    uint32_t local_size_y;
+};
+
+static const char* get_local_size_tune_path()
+{
+    const char* path = getenv("VKTEST_TUNE_CACHE");
+    return path ? path : "imagetest.tune";
+}
+
+// one entry per line, vendorID deviceID driverVersion kernel local_size_x local_size_y
+static std::vector<LocalSizeTuneEntry> load_local_size_tune_entries()
+{
+    std::vector<LocalSizeTuneEntry> entries;
+
+    FILE* fp = fopen(get_local_size_tune_path(), "rb");
+    if (!fp)
+        return entries;
+
+    char kernel[256];
+    LocalSizeTuneEntry entry;
+    while (fscanf(fp, "%x %x %u %255s %u %u", &entry.vendorID, &entry.deviceID, &entry.driverVersion, kernel, &entry.local_size_x, &entry.local_size_y) == 6)
+    {
+        entry.kernel = kernel;
+        entries.push_back(entry);
+    }
+
+    fclose(fp);
+
+    return entries;
+}
+
+static void save_local_size_tune_entries(const std::vector<LocalSizeTuneEntry>& entries)
+{
+    FILE* fp = fopen(get_local_size_tune_path(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", get_local_size_tune_path());
+        return;
+    }
+
+    for (size_t i=0; i<entries.size(); i++)
+    {
+        const LocalSizeTuneEntry& entry = entries[i];
+        fprintf(fp, "%x %x %u %s %u %u\n", entry.vendorID, entry.deviceID, entry.driverVersion, entry.kernel.c_str(), entry.local_size_x, entry.local_size_y);
+    }
+
+    fclose(fp);
+}
+
+// host time of repeat back-to-back dispatches, best of a few submits
+static double time_dispatch(VkStagingRing& ring, VkPipeline pipeline, const ComputePipeline& cp, VkDescriptorSet descriptorSet, int w, int h, uint32_t local_size_x, uint32_t local_size_y)
+{
+    const int repeat = 8;
+
+    ComputePipeline tuned = cp;
+    tuned.pipeline = pipeline;
+    tuned.local_size_x = local_size_x;
+    tuned.local_size_y = local_size_y;
+    tuned.local_size_z = 1;
+
+    double best = 1e30;
+    for (int i=0; i<4; i++)
+    {
+        double t0 = get_current_time();
+
+        ring.begin_frame();
+        VkCommandBuffer commandBuffer = ring.command_buffer();
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+        for (int j=0; j<repeat; j++)
+        {
+            record_shape_constants(commandBuffer, tuned, make_shape_constants(w, h, 1));
+            record_dispatch(commandBuffer, tuned, w, h, 1);
+        }
+        ring.end_frame();
+        ring.wait_idle();
+
+        double t1 = get_current_time();
+
+        // first submit warms up the pipeline
+        if (i > 0 && t1 - t0 < best)
+            best = t1 - t0;
+    }
+
+    return best / repeat;
+}
+
+// pick the fastest local size of a 2d storage image kernel on this device
+// the winner is cached per device and kernel in imagetest.tune
+int autotune_local_size(const char* spv_path, int binding_count, int w, int h, uint32_t* local_size_x, uint32_t* local_size_y)
+{
+    VkDevice device = get_gpu_device();
+    const VkPhysicalDeviceLimits& limits = get_gpu_info().properties.limits;
+
+    std::vector<LocalSizeTuneEntry> entries = load_local_size_tune_entries();
+    for (size_t i=0; i<entries.size(); i++)
+    {
+        const LocalSizeTuneEntry& entry = entries[i];
+        if (entry.vendorID == get_gpu_info().properties.vendorID
+            && entry.deviceID == get_gpu_info().properties.deviceID
+            && entry.driverVersion == get_gpu_info().properties.driverVersion
+            && entry.kernel == spv_path)
+        {
+            *local_size_x = entry.local_size_x;
+            *local_size_y = entry.local_size_y;
+            return 0;
+        }
+    }
+
+    std::vector<VkDescriptorType> descriptorTypes(binding_count, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+    ComputePipeline cp;
+    if (create_compute_pipeline(spv_path, descriptorTypes.data(), binding_count, 1, 1, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    std::vector<VkStorageImage> blobs(binding_count);
+    std::vector<VkImageView> imageviews(binding_count);
+    for (int i=0; i<binding_count; i++)
+    {
+        create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[i]);
+        imageviews[i] = blobs[i].imageview;
+    }
+
+    VkDescriptorPoolSize poolSizes[1] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            (uint32_t)binding_count // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = 1;
+    descriptorPoolCreateInfo.poolSizeCount = 1;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool = 0;
+    vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = 0;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+    VkDescriptorSet descriptorSet = 0;
+    vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet);
+
+    update_descriptor_set_images(descriptorSet, imageviews.data(), binding_count);
+
+    VkStagingRing ring;
+    ring.create(256, 1);
+
+    ring.begin_frame();
+    for (int i=0; i<binding_count; i++)
+    {
+        record_image_barrier(ring.command_buffer(), blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
+    ring.end_frame();
+    ring.wait_idle();
+
+    uint32_t best_x = 1;
+    uint32_t best_y = 1;
+    double best_time = time_dispatch(ring, cp.pipeline, cp, descriptorSet, w, h, 1, 1);
+
+    VKTEST_LOGI("autotune %s %dx%d\n", spv_path, w, h);
+    VKTEST_LOGD("    %3u x %-3u %10.4f ms\n", 1, 1, best_time);
+
+    // power of two candidates within the device workgroup limits
+    for (uint32_t x=1; x<=limits.maxComputeWorkGroupSize[0] && x<=1024; x*=2)
+    {
+        for (uint32_t y=1; y<=limits.maxComputeWorkGroupSize[1] && y<=1024; y*=2)
+        {
+            if (x * y > limits.maxComputeWorkGroupInvocations)
+                break;
+
+            // a workgroup smaller than a few lanes never wins
+            if (x * y < 4)
+                continue;
+
+            VkPipeline pipeline = create_pipeline(cp.shaderModule, cp.pipelineLayout, x, y, 1, 0);
+            if (!pipeline)
+                continue;
+
+            double t = time_dispatch(ring, pipeline, cp, descriptorSet, w, h, x, y);
+
+            VKTEST_LOGD("    %3u x %-3u %10.4f ms\n", x, y, t);
+
+            if (t < best_time)
+            {
+                best_time = t;
+                best_x = x;
+                best_y = y;
+            }
+
+            vkDestroyPipeline(device, pipeline, 0);
+        }
+    }
+
+    VKTEST_LOGI("autotune %s best %u x %u %.4f ms\n", spv_path, best_x, best_y, best_time);
+
+    ring.destroy();
+
+    vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+    for (int i=0; i<binding_count; i++)
+    {
+        destroy_storage_image(&blobs[i]);
+    }
+
+    destroy_compute_pipeline(&cp);
+
+    LocalSizeTuneEntry entry;
+    entry.vendorID = get_gpu_info().properties.vendorID;
+    entry.deviceID = get_gpu_info().properties.deviceID;
+    entry.driverVersion = get_gpu_info().properties.driverVersion;
+    entry.kernel = spv_path;
+    entry.local_size_x = best_x;
+    entry.local_size_y = best_y;
+    entries.push_back(entry);
+
+    save_local_size_tune_entries(entries);
+
+    *local_size_x = best_x;
+    *local_size_y = best_y;
+
+    return 0;
+}
+
+// tune every kernel on a large image and report the winners
+static int bench_autotune()
+{
+    const char* spv_paths[] = { "imagetest.comp.spv", "imagescale.comp.spv" };
+    const int binding_counts[] = { 1, 2 };
+
+    for (int i=0; i<2; i++)
+    {
+        uint32_t local_size_x = 1;
+        uint32_t local_size_y = 1;
+        if (autotune_local_size(spv_paths[i], binding_counts[i], 1024, 1024, &local_size_x, &local_size_y) != 0)
+            return -1;
+
+        fprintf(stderr, "%s local size %u x %u\n", spv_paths[i], local_size_x, local_size_y);
+    }
+
+    return 0;
+}
+
+// a rectangle of the image, tiles are processed independently
+struct ImageTile
+{
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+// shards one image across several contexts, one worker thread drives each compute queue of each context
+// every worker starts with a contiguous share of the tiles and steals from the back of the fullest queue when its own runs dry
+// a worker copies its tile out of the source, runs the kernel and merges the result into the destination
+class VkTileScheduler
+{
+public:
+    VkTileScheduler();
+    ~VkTileScheduler();
+
+    // kernel reads binding 0 and writes binding 1, both tile_w x tile_h r32f storage images
+    int create(const std::vector<GpuContext*>& contexts, const char* spv_path, int tile_w, int tile_h);
+    void destroy();
+
+    // dst = kernel(src) over the whole w x h image, returns once every tile is merged
+    int run(const float* src, float* dst, int w, int h);
+
+    int worker_count() const { return (int)workers.size(); }
+
+public:
+    // tiles run and tiles stolen by each worker in the last run
+    std::vector<int> tile_counts;
+    std::vector<int> steal_counts;
+
+private:
+    struct Worker
+    {
+        GpuContext* ctx;
+        int compute_queue;
+        ComputePipeline cp;
+        VkStorageImage blobs[2];
+        VkDescriptorAllocator descriptorAllocator;
+        VkDescriptorSet descriptorSet;
+        VkStagingRing ring;
+        std::vector<float> tile_in;
+        std::vector<float> tile_out;
+
+        std::mutex lock;
+        std::deque<ImageTile> tiles;
+    };
+
+    bool pop_tile(int wi, ImageTile* tile);
+    int run_worker(int wi, const float* src, float* dst, int w);
+
+    int tile_w;
+    int tile_h;
+    std::vector<Worker*> workers;
+};
+
+VkTileScheduler::VkTileScheduler()
+{
+    tile_w = 0;
+    tile_h = 0;
+}
+
+VkTileScheduler::~VkTileScheduler()
+{
+    destroy();
+}
+
+int VkTileScheduler::create(const std::vector<GpuContext*>& contexts, const char* spv_path, int _tile_w, int _tile_h)
+{
+    tile_w = _tile_w;
+    tile_h = _tile_h;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    // per context resources are created on this thread with the context made current
+    GpuContext* current = g_current_gpu_context;
+
+    // workers of one context submit to different queues, a queue is never shared between threads
+    std::vector< std::pair<GpuContext*, int> > worker_queues;
+    for (size_t i=0; i<contexts.size(); i++)
+    {
+        set_current_gpu_context(contexts[i]);
+
+        for (int qi=0; qi<get_gpu_compute_queue_count(); qi++)
+        {
+            worker_queues.push_back(std::make_pair(contexts[i], qi));
+        }
+    }
+
+    int ret = 0;
+    for (size_t i=0; i<worker_queues.size(); i++)
+    {
+        Worker* worker = new Worker;
+        worker->ctx = worker_queues[i].first;
+        worker->compute_queue = worker_queues[i].second;
+        worker->descriptorSet = 0;
+        workers.push_back(worker);
+
+        set_current_gpu_context(worker->ctx);
+
+        uint32_t local_size_x = 8;
+        uint32_t local_size_y = 8;
+        autotune_local_size(spv_path, 2, tile_w, tile_h, &local_size_x, &local_size_y);
+
+        if (create_compute_pipeline(spv_path, descriptorTypes, 2, local_size_x, local_size_y, 1, &worker->cp) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, tile_w, tile_h, &worker->blobs[0]) != 0
+            || create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, tile_w, tile_h, &worker->blobs[1]) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (worker->descriptorAllocator.create(1) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        const VkImageView imageviews[2] = { worker->blobs[0].imageview, worker->blobs[1].imageview };
+        worker->descriptorAllocator.begin_frame(0);
+        worker->descriptorSet = worker->descriptorAllocator.get(worker->cp.descriptorSetLayout, imageviews, 2);
+
+        if (worker->ring.create((VkDeviceSize)tile_w * tile_h * sizeof(float) * 2 + 1024, 1, false, worker->compute_queue) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        worker->tile_in.resize(tile_w * tile_h);
+        worker->tile_out.resize(tile_w * tile_h);
+
+        worker->ring.begin_frame();
+        record_image_barrier(worker->ring.command_buffer(), worker->blobs[0].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+        record_image_barrier(worker->ring.command_buffer(), worker->blobs[1].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        worker->ring.end_frame();
+        worker->ring.wait_idle();
+    }
+
+    set_current_gpu_context(current);
+
+    if (ret != 0)
+    {
+        destroy();
+        return -1;
+    }
+
+    tile_counts.resize(workers.size(), 0);
+    steal_counts.resize(workers.size(), 0);
+
+    return 0;
+}
+
+void VkTileScheduler::destroy()
+{
+    GpuContext* current = g_current_gpu_context;
+
+    for (size_t i=0; i<workers.size(); i++)
+    {
+        Worker* worker = workers[i];
+
+        set_current_gpu_context(worker->ctx);
+
+        worker->ring.destroy();
+        worker->descriptorAllocator.destroy();
+        destroy_storage_image(&worker->blobs[0]);
+        destroy_storage_image(&worker->blobs[1]);
+        destroy_compute_pipeline(&worker->cp);
+
+        delete worker;
+    }
+    workers.clear();
+
+    set_current_gpu_context(current);
+
+    tile_counts.clear();
+    steal_counts.clear();
+}
+
+bool VkTileScheduler::pop_tile(int wi, ImageTile* tile)
+{
+    {
+        Worker* worker = workers[wi];
+        std::lock_guard<std::mutex> guard(worker->lock);
+        if (!worker->tiles.empty())
+        {
+            *tile = worker->tiles.front();
+            worker->tiles.pop_front();
+            return true;
+        }
+    }
+
+    // steal from the back of whichever queue has the most left
+    while (true)
+    {
+        int victim = -1;
+        size_t victim_size = 0;
+        for (int i=0; i<(int)workers.size(); i++)
+        {
+            if (i == wi)
+                continue;
+
+            std::lock_guard<std::mutex> guard(workers[i]->lock);
+            if (workers[i]->tiles.size() > victim_size)
+            {
+                victim = i;
+                victim_size = workers[i]->tiles.size();
+            }
+        }
+
+        if (victim == -1)
+            return false;
+
+        std::lock_guard<std::mutex> guard(workers[victim]->lock);
+        if (workers[victim]->tiles.empty())
+            continue;
+
+        *tile = workers[victim]->tiles.back();
+        workers[victim]->tiles.pop_back();
+        steal_counts[wi]++;
+        return true;
+    }
+}
+
+int VkTileScheduler::run_worker(int wi, const float* src, float* dst, int w)
+{
+    Worker* worker = workers[wi];
+
+    set_current_gpu_context(worker->ctx);
+
+    ImageTile tile;
+    while (pop_tile(wi, &tile))
+    {
+        for (int y=0; y<tile.h; y++)
+        {
+            memcpy(worker->tile_in.data() + y * tile.w, src + (tile.y + y) * w + tile.x, tile.w * sizeof(float));
+        }
+
+        // edge tiles use the top left corner of the images, the kernel is bounded by the shape constants
+        worker->ring.begin_frame();
+        VkCommandBuffer commandBuffer = worker->ring.command_buffer();
+        worker->ring.upload(worker->tile_in.data(), worker->blobs[0].image, VK_IMAGE_LAYOUT_GENERAL, tile.w, tile.h, 1, sizeof(float));
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, worker->cp.pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, worker->cp.pipelineLayout, 0, 1, &worker->descriptorSet, 0, 0);
+        record_shape_constants(commandBuffer, worker->cp, make_shape_constants(tile.w, tile.h, 1));
+        record_dispatch(commandBuffer, worker->cp, tile.w, tile.h, 1);
+        worker->ring.download(worker->blobs[1].image, tile.w, tile.h, 1, sizeof(float), worker->tile_out.data());
+        if (worker->ring.end_frame() != 0 || worker->ring.wait_idle() != 0)
+        {
+            set_current_gpu_context(0);
+            return -1;
+        }
+
+        // tiles never overlap, workers merge without locking
+        for (int y=0; y<tile.h; y++)
+        {
+            memcpy(dst + (tile.y + y) * w + tile.x, worker->tile_out.data() + y * tile.w, tile.w * sizeof(float));
+        }
+
+        tile_counts[wi]++;
+    }
+
+    set_current_gpu_context(0);
+
+    return 0;
+}
+
+int VkTileScheduler::run(const float* src, float* dst, int w, int h)
+{
+    const int worker_count = (int)workers.size();
+    if (worker_count == 0)
+        return -1;
+
+    const int tile_count_x = (w + tile_w - 1) / tile_w;
+    const int tile_count_y = (h + tile_h - 1) / tile_h;
+    const int tile_count = tile_count_x * tile_count_y;
+
+    // row major contiguous shares keep each worker on neighbouring rows
+    for (int i=0; i<tile_count; i++)
+    {
+        ImageTile tile;
+        tile.x = (i % tile_count_x) * tile_w;
+        tile.y = (i / tile_count_x) * tile_h;
+        tile.w = std::min(tile_w, w - tile.x);
+        tile.h = std::min(tile_h, h - tile.y);
+
+        workers[(long)i * worker_count / tile_count]->tiles.push_back(tile);
+    }
+
+    for (int i=0; i<worker_count; i++)
+    {
+        tile_counts[i] = 0;
+        steal_counts[i] = 0;
+    }
+
+    std::vector<int> rets(worker_count, 0);
+    std::vector<std::thread> threads;
+    for (int i=0; i<worker_count; i++)
+    {
+        threads.push_back(std::thread([this, i, src, dst, w, &rets]() { rets[i] = run_worker(i, src, dst, w); }));
+    }
+
+    for (int i=0; i<worker_count; i++)
+    {
+        threads[i].join();
+    }
+
+    int ret = 0;
+    for (int i=0; i<worker_count; i++)
+    {
+        // a failed worker leaves its remaining tiles behind
+        workers[i]->tiles.clear();
+
+        if (rets[i] != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+struct BenchPercentiles
+{
+    double min;
+    double median;
+    double p99;
+};
+
+static BenchPercentiles compute_percentiles(std::vector<double> samples)
+{
+    BenchPercentiles p;
+    p.min = 0;
+    p.median = 0;
+    p.p99 = 0;
+
+    if (samples.empty())
+        return p;
+
+    std::sort(samples.begin(), samples.end());
+
+    const size_t n = samples.size();
+    p.min = samples[0];
+    p.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) * 0.5;
+    p.p99 = samples[std::min(n - 1, (size_t)(n * 0.99))];
+
+    return p;
+}
+
+static void fprint_percentiles(FILE* fp, const char* name, const BenchPercentiles& p)
+{
+    fprintf(fp, "\"%s\": {\"min\": %.6f, \"median\": %.6f, \"p99\": %.6f}", name, p.min, p.median, p.p99);
+}
+
+static const char* get_bench_output_path()
+{
+    const char* path = getenv("VKTEST_BENCH_OUTPUT");
+    return path ? path : "bench_output.txt";
+}
+
+// gpu time of each kernel over a size sweep from timestamp queries
+// results go to bench_output.txt as json, times in ms and bandwidth in GB/s
+static int bench_dispatch()
+{
+    VkDevice device = get_gpu_device();
+
+    struct BenchKernel
+    {
+        const char* name;
+        const char* spv_path;
+        int binding_count;
+    };
+
+    const BenchKernel kernels[] =
+    {
+        { "imagetest", "imagetest.comp.spv", 1 },
+        { "imagescale", "imagescale.comp.spv", 2 },
+    };
+    const int kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+    const int sizes[] = { 64, 128, 256, 512, 1024, 2048 };
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const int warmup = 5;
+    const int loop = 100;
+
+    VkTimestampQueryPool timestampQueryPool;
+    if (timestampQueryPool.create(1) != 0)
+        return -1;
+
+    VkStagingRing ring;
+    if (ring.create(256, 1) != 0)
+        return -1;
+
+    FILE* fp = fopen(get_bench_output_path(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", get_bench_output_path());
+        return -1;
+    }
+
+    const VkPhysicalDeviceProperties& properties = get_gpu_info().properties;
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"device\": {\"name\": \"%s\", \"vendorID\": %u, \"deviceID\": %u, \"driverVersion\": %u, \"timestampPeriod\": %f, \"timestampValidBits\": %u},\n", properties.deviceName, properties.vendorID, properties.deviceID, properties.driverVersion, properties.limits.timestampPeriod, get_gpu_info().timestampValidBits);
+    fprintf(fp, "  \"results\": [");
+
+    fprintf(stderr, "%-12s %6s %8s %10s %10s %10s %12s %10s\n", "kernel", "size", "local", "min(ms)", "median(ms)", "p99(ms)", "submit(ms)", "GB/s");
+
+    bool first_result = true;
+
+    for (int ki=0; ki<kernel_count; ki++)
+    {
+        const BenchKernel& kernel = kernels[ki];
+
+        uint32_t local_size_x = 8;
+        uint32_t local_size_y = 8;
+        autotune_local_size(kernel.spv_path, kernel.binding_count, 1024, 1024, &local_size_x, &local_size_y);
+
+        std::vector<VkDescriptorType> descriptorTypes(kernel.binding_count, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+        ComputePipeline cp;
+        if (create_compute_pipeline(kernel.spv_path, descriptorTypes.data(), kernel.binding_count, local_size_x, local_size_y, 1, &cp) != 0)
+        {
+            destroy_compute_pipeline(&cp);
+            continue;
+        }
+
+        VkDescriptorPoolSize poolSizes[1] =
+        {
+            {
+                VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                (uint32_t)kernel.binding_count // descriptorCount
+            }
+        };
+
+        VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+        descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        descriptorPoolCreateInfo.pNext = 0;
+        descriptorPoolCreateInfo.flags = 0;
+        descriptorPoolCreateInfo.maxSets = 1;
+        descriptorPoolCreateInfo.poolSizeCount = 1;
+        descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+        VkDescriptorPool descriptorPool;
+        VkResult ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+            destroy_compute_pipeline(&cp);
+            continue;
+        }
+
+        for (int si=0; si<size_count; si++)
+        {
+            const int w = sizes[si];
+            const int h = sizes[si];
+
+            if ((uint32_t)w > properties.limits.maxImageDimension2D)
+                break;
+
+            std::vector<VkStorageImage> blobs(kernel.binding_count);
+            std::vector<VkImageView> imageviews(kernel.binding_count);
+            bool blobs_ok = true;
+            for (int i=0; i<kernel.binding_count; i++)
+            {
+                if (create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[i]) != 0)
+                    blobs_ok = false;
+
+                imageviews[i] = blobs[i].imageview;
+            }
+
+            if (!blobs_ok)
+            {
+                fprintf(stderr, "create_storage_image %s %d failed\n", kernel.name, w);
+                for (int i=0; i<kernel.binding_count; i++)
+                {
+                    destroy_storage_image(&blobs[i]);
+                }
+                continue;
+            }
+
+            vkResetDescriptorPool(device, descriptorPool, 0);
+
+            VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+            descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            descriptorSetAllocateInfo.pNext = 0;
+            descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+            descriptorSetAllocateInfo.descriptorSetCount = 1;
+            descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+            VkDescriptorSet descriptorSet;
+            ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet);
+            if (ret != VK_SUCCESS)
+            {
+                fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+            }
+
+            update_descriptor_set_images(descriptorSet, imageviews.data(), kernel.binding_count);
+
+            ring.begin_frame();
+            for (int i=0; i<kernel.binding_count; i++)
+            {
+                record_image_barrier(ring.command_buffer(), blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+            }
+            ring.end_frame();
+            ring.wait_idle();
+
+            std::vector<double> gpu_times;
+            std::vector<double> submit_times;
+
+            for (int li=0; li<warmup + loop; li++)
+            {
+                ring.begin_frame();
+                VkCommandBuffer commandBuffer = ring.command_buffer();
+                timestampQueryPool.reset(commandBuffer);
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+                timestampQueryPool.begin_region(commandBuffer, 0);
+                record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+                record_dispatch(commandBuffer, cp, w, h, 1);
+                timestampQueryPool.end_region(commandBuffer, 0);
+
+                // host latency from submit until the fence signals
+                double t0 = get_current_time();
+
+                ring.end_frame();
+                ring.wait_idle();
+
+                double t1 = get_current_time();
+
+                std::vector<double> elapsed;
+                if (timestampQueryPool.get_elapsed(elapsed) != 0)
+                    break;
+
+                if (li < warmup)
+                    continue;
+
+                gpu_times.push_back(elapsed[0]);
+                submit_times.push_back(t1 - t0);
+            }
+
+            const BenchPercentiles gpu = compute_percentiles(gpu_times);
+            const BenchPercentiles submit = compute_percentiles(submit_times);
+
+            // every binding is read or written once per pixel
+            const double bytes = (double)w * h * sizeof(float) * kernel.binding_count;
+            const double bandwidth = gpu.median > 0 ? bytes / (gpu.median * 1000000.0) : 0;
+
+            fprintf(stderr, "%-12s %6d %4ux%-3u %10.4f %10.4f %10.4f %12.4f %10.2f\n", kernel.name, w, local_size_x, local_size_y, gpu.min, gpu.median, gpu.p99, submit.median, bandwidth);
+
+            fprintf(fp, "%s\n    {\"kernel\": \"%s\", \"width\": %d, \"height\": %d, \"local_size\": [%u, %u, 1], \"loop\": %d, ", first_result ? "" : ",", kernel.name, w, h, local_size_x, local_size_y, (int)gpu_times.size());
+            fprint_percentiles(fp, "gpu_ms", gpu);
+            fprintf(fp, ", ");
+            fprint_percentiles(fp, "submit_to_fence_ms", submit);
+            fprintf(fp, ", \"bandwidth_gbps\": %.4f}", bandwidth);
+
+            first_result = false;
+
+            for (int i=0; i<kernel.binding_count; i++)
+            {
+                destroy_storage_image(&blobs[i]);
+            }
+        }
+
+        vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+        destroy_compute_pipeline(&cp);
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+
+    fprintf(stderr, "bench results written to %s\n", get_bench_output_path());
+
+    return 0;
+}
+
+// host linear vs device optimal storage images, round trip includes upload and readback
+static int bench_image_storage()
+{
+    VkDevice device = get_gpu_device();
+
+    const int sizes[] = { 64, 128, 256, 512, 1024, 2048 };
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const int max_size = sizes[size_count - 1];
+    const int loop = 20;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0)
+        return -1;
+
+    VkDescriptorPoolSize poolSizes[1] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            2 // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = 1;
+    descriptorPoolCreateInfo.poolSizeCount = 1;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool;
+    VkResult ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    // upload and download of the largest size in one frame
+    VkStagingRing ring;
+    if (ring.create((VkDeviceSize)max_size * max_size * sizeof(float) * 2 + 1024, 2) != 0)
+    {
+        vkDestroyDescriptorPool(device, descriptorPool, 0);
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(get_current_gpu_context()->physicalDevice, VK_FORMAT_R32_SFLOAT, &formatProperties);
+    const bool linear_storage = formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+
+    fprintf(stderr, "%-20s %6s %14s %14s\n", "mode", "size", "compute(ms)", "roundtrip(ms)");
+
+    for (int si=0; si<size_count; si++)
+    {
+        const int w = sizes[si];
+        const int h = sizes[si];
+
+        if ((uint32_t)w > get_gpu_info().properties.limits.maxImageDimension2D)
+            break;
+
+        std::vector<float> in(w * h);
+        std::vector<float> out(w * h);
+        for (int i=0; i<w * h; i++)
+        {
+            in[i] = (float)(i % 1000);
+        }
+
+        for (int mi=0; mi<2; mi++)
+        {
+            const ImageStorageMode mode = mi == 0 ? IMAGE_STORAGE_HOST_LINEAR : IMAGE_STORAGE_DEVICE_OPTIMAL;
+            const char* mode_name = mi == 0 ? "host_linear" : "device_optimal";
+
+            if (mode == IMAGE_STORAGE_HOST_LINEAR && !linear_storage)
+            {
+                fprintf(stderr, "%-20s %6d %14s %14s\n", mode_name, w, "unsupported", "unsupported");
+                continue;
+            }
+
+            VkStorageImage bottom_blob;
+            if (create_storage_image(mode, w, h, &bottom_blob) != 0)
+            {
+                fprintf(stderr, "create_storage_image %s %d failed\n", mode_name, w);
+                destroy_storage_image(&bottom_blob);
+                continue;
+            }
+
+            VkStorageImage top_blob;
+            if (create_storage_image(mode, w, h, &top_blob) != 0)
+            {
+                fprintf(stderr, "create_storage_image %s %d failed\n", mode_name, w);
+                destroy_storage_image(&bottom_blob);
+                destroy_storage_image(&top_blob);
+                continue;
+            }
+
+            vkResetDescriptorPool(device, descriptorPool, 0);
+
+            VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+            descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            descriptorSetAllocateInfo.pNext = 0;
+            descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+            descriptorSetAllocateInfo.descriptorSetCount = 1;
+            descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+            VkDescriptorSet descriptorSet;
+            ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet);
+            if (ret != VK_SUCCESS)
+            {
+                fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+            }
+
+            const VkImageView imageviews[2] = { bottom_blob.imageview, top_blob.imageview };
+            update_descriptor_set_images(descriptorSet, imageviews, 2);
+
+            // images live in general layout from now on
+            ring.begin_frame();
+            record_image_barrier(ring.command_buffer(), bottom_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+            record_image_barrier(ring.command_buffer(), top_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+            ring.end_frame();
+            ring.wait_idle();
+
+            double compute_time = 0;
+            double roundtrip_time = 0;
+
+            for (int li=0; li<loop; li++)
+            {
+                // compute only
+                double t0 = get_current_time();
+
+                ring.begin_frame();
+                VkCommandBuffer commandBuffer = ring.command_buffer();
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+                record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+                record_dispatch(commandBuffer, cp, w, h, 1);
+                ring.end_frame();
+                ring.wait_idle();
+
+                double t1 = get_current_time();
+
+                // upload, compute and readback
+                if (mode == IMAGE_STORAGE_HOST_LINEAR)
+                {
+                    write_storage_image(bottom_blob, in.data());
+                }
+
+                ring.begin_frame();
+                commandBuffer = ring.command_buffer();
+
+                if (mode == IMAGE_STORAGE_DEVICE_OPTIMAL)
+                {
+                    ring.upload(in.data(), bottom_blob.image, VK_IMAGE_LAYOUT_GENERAL, w, h, 1, sizeof(float));
+                }
+
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+                record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+                record_dispatch(commandBuffer, cp, w, h, 1);
+
+                if (mode == IMAGE_STORAGE_DEVICE_OPTIMAL)
+                {
+                    ring.download(top_blob.image, w, h, 1, sizeof(float), out.data());
+                }
+                else
+                {
+                    VkMemoryBarrier memoryBarrier;
+                    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                    memoryBarrier.pNext = 0;
+                    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+                    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+
+                    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+                }
+
+                ring.end_frame();
+                ring.wait_idle();
+
+                if (mode == IMAGE_STORAGE_HOST_LINEAR)
+                {
+                    read_storage_image(top_blob, out.data());
+                }
+
+                double t2 = get_current_time();
+
+                compute_time += t1 - t0;
+                roundtrip_time += t2 - t1;
+            }
+
+            // top = bottom * 2
+            for (int i=0; i<w * h; i += 997)
+            {
+                if (out[i] != in[i] * 2)
+                {
+                    fprintf(stderr, "%s %d mismatch at %d, %f != %f\n", mode_name, w, i, out[i], in[i] * 2);
+                    break;
+                }
+            }
+
+            fprintf(stderr, "%-20s %6d %14.3f %14.3f\n", mode_name, w, compute_time / loop, roundtrip_time / loop);
+
+            destroy_storage_image(&bottom_blob);
+            destroy_storage_image(&top_blob);
+        }
+    }
+
+    ring.destroy();
+
+    vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+    destroy_compute_pipeline(&cp);
+
+    return 0;
+}
+
+static std::string get_imagescale_spv_path(ImageStorageFormat format)
+{
+    if (format == IMAGE_FORMAT_FP32)
+        return "imagescale.comp.spv";
+
+    return std::string("imagescale_") + get_image_format_name(format) + ".comp.spv";
+}
+
+static std::string get_imageconvert_spv_path(ImageStorageFormat from, ImageStorageFormat to)
+{
+    return std::string("imageconvert_") + get_image_format_name(from) + "_to_" + get_image_format_name(to) + ".comp.spv";
+}
+
+static void record_compute_to_compute_barrier(VkCommandBuffer commandBuffer, VkImage image)
+{
+    record_image_barrier(commandBuffer, image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+        VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+}
+
+// a 4 channel blob uploaded as fp32 planes, converted into each layout, scaled there and converted back
+// the scale pass is timed alone, it reads and writes every texel once
+static int bench_image_format()
+{
+    const int w = 1024;
+    const int h = 1024;
+    const int c = 4;
+    const int loop = 20;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    std::vector<float> in(w * h * c);
+    std::vector<float> out(w * h * c);
+    for (int i=0; i<w * h * c; i++)
+    {
+        in[i] = (float)(i % 1000);
+    }
+
+    VkStagingRing ring;
+    if (ring.create((VkDeviceSize)w * h * c * sizeof(float) * 2 + 1024, 1) != 0)
+        return -1;
+
+    VkDescriptorAllocator descriptorAllocator;
+    descriptorAllocator.create(1);
+    descriptorAllocator.begin_frame(0);
+
+    fprintf(stderr, "auto selected %s\n", get_image_format_name(select_image_format(c, true)));
+    fprintf(stderr, "%-12s %10s %12s %12s %10s %10s\n", "format", "texel(B)", "pass(MB)", "scale(ms)", "GB/s", "saved");
+
+    double fp32_bytes = 0;
+
+    for (int fi=0; fi<IMAGE_FORMAT_COUNT; fi++)
+    {
+        const ImageStorageFormat format = (ImageStorageFormat)fi;
+        const bool planar_fp32 = format == IMAGE_FORMAT_FP32;
+        const int texel_h = h * c / get_image_format_elempack(format);
+        const size_t elemsize = get_image_format_elemsize(format);
+        const double pass_bytes = 2.0 * w * texel_h * elemsize;
+
+        if (planar_fp32)
+            fp32_bytes = pass_bytes;
+
+        if (!is_image_format_supported(format))
+        {
+            fprintf(stderr, "%-12s %10d %12s\n", get_image_format_name(format), (int)elemsize, "unsupported");
+            continue;
+        }
+
+        ComputePipeline scale_cp;
+        ComputePipeline to_cp;
+        ComputePipeline from_cp;
+        VkStorageImage plane_blob;
+        VkStorageImage bottom_blob;
+        VkStorageImage top_blob;
+
+        int ret = create_compute_pipeline(get_imagescale_spv_path(format).c_str(), descriptorTypes, 2, 8, 8, 1, &scale_cp);
+        ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, texel_h, &bottom_blob, format);
+        ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, texel_h, &top_blob, format);
+        if (!planar_fp32)
+        {
+            ret |= create_compute_pipeline(get_imageconvert_spv_path(IMAGE_FORMAT_FP32, format).c_str(), descriptorTypes, 2, 8, 8, 1, &to_cp);
+            ret |= create_compute_pipeline(get_imageconvert_spv_path(format, IMAGE_FORMAT_FP32).c_str(), descriptorTypes, 2, 8, 8, 1, &from_cp);
+            ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h * c, &plane_blob);
+        }
+
+        if (ret != 0)
+        {
+            fprintf(stderr, "%-12s setup failed\n", get_image_format_name(format));
+        }
+        else
+        {
+            const VkImageView scale_views[2] = { bottom_blob.imageview, top_blob.imageview };
+            VkDescriptorSet scale_set = descriptorAllocator.get(scale_cp.descriptorSetLayout, scale_views, 2);
+
+            ring.begin_frame();
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            record_image_barrier(commandBuffer, top_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+            if (planar_fp32)
+            {
+                ring.upload(in.data(), bottom_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, w, h * c, 1, sizeof(float));
+            }
+            else
+            {
+                record_image_barrier(commandBuffer, bottom_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+                ring.upload(in.data(), plane_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, w, h * c, 1, sizeof(float));
+
+                const VkImageView to_views[2] = { plane_blob.imageview, bottom_blob.imageview };
+                VkDescriptorSet to_set = descriptorAllocator.get(to_cp.descriptorSetLayout, to_views, 2);
+
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, to_cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, to_cp.pipelineLayout, 0, 1, &to_set, 0, 0);
+                record_shape_constants(commandBuffer, to_cp, make_shape_constants(w, h, c));
+                record_dispatch(commandBuffer, to_cp, w, texel_h, 1);
+                record_compute_to_compute_barrier(commandBuffer, bottom_blob.image);
+            }
+            ring.end_frame();
+            ring.wait_idle();
+
+            double best = 1e30;
+            for (int ti=0; ti<3; ti++)
+            {
+                double t0 = get_current_time();
+
+                ring.begin_frame();
+                commandBuffer = ring.command_buffer();
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, scale_cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, scale_cp.pipelineLayout, 0, 1, &scale_set, 0, 0);
+                record_shape_constants(commandBuffer, scale_cp, make_shape_constants(w, texel_h, 1));
+                for (int li=0; li<loop; li++)
+                {
+                    record_dispatch(commandBuffer, scale_cp, w, texel_h, 1);
+                }
+                ring.end_frame();
+                ring.wait_idle();
+
+                double t1 = get_current_time();
+
+                best = std::min(best, (t1 - t0) / loop);
+            }
+
+            ring.begin_frame();
+            commandBuffer = ring.command_buffer();
+            record_compute_to_compute_barrier(commandBuffer, top_blob.image);
+            if (planar_fp32)
+            {
+                ring.download(top_blob.image, w, h * c, 1, sizeof(float), out.data());
+            }
+            else
+            {
+                const VkImageView from_views[2] = { top_blob.imageview, plane_blob.imageview };
+                VkDescriptorSet from_set = descriptorAllocator.get(from_cp.descriptorSetLayout, from_views, 2);
+
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, from_cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, from_cp.pipelineLayout, 0, 1, &from_set, 0, 0);
+                record_shape_constants(commandBuffer, from_cp, make_shape_constants(w, h, c));
+                record_dispatch(commandBuffer, from_cp, w, texel_h, 1);
+                ring.download(plane_blob.image, w, h * c, 1, sizeof(float), out.data());
+            }
+            ring.end_frame();
+            ring.wait_idle();
+
+            // the inputs are small integers, exact in fp16 too
+            int mismatch = 0;
+            for (int i=0; i<w * h * c; i += 997)
+            {
+                if (out[i] != in[i] * 2)
+                    mismatch++;
+            }
+
+            const double saved = fp32_bytes > 0 ? 1.0 - pass_bytes / fp32_bytes : 0;
+            fprintf(stderr, "%-12s %10d %12.2f %12.3f %10.2f %9.0f%%\n", get_image_format_name(format), (int)elemsize, pass_bytes / 1024 / 1024, best, best > 0 ? pass_bytes / best / 1e6 : 0, saved * 100);
+
+            if (mismatch)
+            {
+                fprintf(stderr, "%s mismatch %d\n", get_image_format_name(format), mismatch);
+            }
+        }
+
+        destroy_storage_image(&bottom_blob);
+        destroy_storage_image(&top_blob);
+        destroy_compute_pipeline(&scale_cp);
+        if (!planar_fp32)
+        {
+            destroy_storage_image(&plane_blob);
+            destroy_compute_pipeline(&to_cp);
+            destroy_compute_pipeline(&from_cp);
+        }
+    }
+
+    descriptorAllocator.destroy();
+
+    ring.destroy();
+
+    return 0;
+}
+
+// both backends of every kernel over a few blob shapes, then the backend this device settles on
+static int bench_blob_backend()
+{
+    const char* kernels[] = { "imagetest", "imagescale" };
+    const int binding_counts[] = { 1, 2 };
+    const int sizes[] = { 256, 1024, 2048 };
+    const int c = 4;
+
+    fprintf(stderr, "%-12s %6s %12s %12s %8s\n", "kernel", "size", "image(ms)", "buffer(ms)", "faster");
+
+    for (int ki=0; ki<2; ki++)
+    {
+        for (int si=0; si<3; si++)
+        {
+            const int w = sizes[si];
+            const int h = sizes[si];
+
+            if ((uint32_t)(h * c) > get_gpu_info().properties.limits.maxImageDimension2D)
+                break;
+
+            std::vector<float> in(w * h * c);
+            for (int i=0; i<w * h * c; i++)
+            {
+                in[i] = (float)(i % 1000);
+            }
+
+            double times[BLOB_BACKEND_COUNT];
+            for (int bi=0; bi<BLOB_BACKEND_COUNT; bi++)
+            {
+                std::vector<float> out(w * h * c, 0.f);
+                times[bi] = time_blob_kernel(kernels[ki], binding_counts[ki], (BlobBackend)bi, w, h, c, in.data(), out.data());
+
+                // imagetest writes 233, imagescale doubles its input
+                int mismatch = 0;
+                for (int i=0; i<w * h * c; i += 997)
+                {
+                    const float expect = ki == 0 ? 233.f : in[i] * 2;
+                    if (out[i] != expect)
+                        mismatch++;
+                }
+
+                if (times[bi] >= 0 && mismatch)
+                {
+                    fprintf(stderr, "%s %s %d mismatch %d\n", kernels[ki], bi == BLOB_BACKEND_BUFFER ? "buffer" : "image", w, mismatch);
+                }
+            }
+
+            const char* faster = times[BLOB_BACKEND_BUFFER] >= 0 && (times[BLOB_BACKEND_IMAGE] < 0 || times[BLOB_BACKEND_BUFFER] < times[BLOB_BACKEND_IMAGE]) ? "buffer" : "image";
+            fprintf(stderr, "%-12s %6d %12.4f %12.4f %8s\n", kernels[ki], w, times[BLOB_BACKEND_IMAGE], times[BLOB_BACKEND_BUFFER], faster);
+        }
+    }
+
+    for (int ki=0; ki<2; ki++)
+    {
+        select_blob_backend(kernels[ki], binding_counts[ki]);
+    }
+
+    return 0;
+}
+
+// 3d against 2d array images over wide, square and deep tensors, then the layout this device settles on
+static int bench_channel_layout()
+{
+    const int shapes[][3] = {
+        { 512, 512, 4 },
+        { 128, 128, 64 },
+        { 32, 32, 512 },
+    };
+
+    const VkPhysicalDeviceLimits& limits = get_gpu_info().properties.limits;
+    fprintf(stderr, "maxImageDimension3D %u maxImageArrayLayers %u\n", limits.maxImageDimension3D, limits.maxImageArrayLayers);
+
+    fprintf(stderr, "%-16s %12s %12s %8s\n", "shape", "3d(ms)", "array(ms)", "faster");
+
+    for (int si=0; si<3; si++)
+    {
+        const int w = shapes[si][0];
+        const int h = shapes[si][1];
+        const int c = shapes[si][2];
+
+        std::vector<float> in(w * h * c);
+        for (int i=0; i<w * h * c; i++)
+        {
+            in[i] = (float)(i % 1000);
+        }
+
+        // a layout whose limits the shape exceeds reports -1
+        double times[2];
+        for (int li=0; li<2; li++)
+        {
+            const ImageChannelLayout channel_layout = li == 0 ? IMAGE_CHANNEL_3D : IMAGE_CHANNEL_ARRAY;
+
+            std::vector<float> out(w * h * c, 0.f);
+            times[li] = time_channel_layout(channel_layout, w, h, c, in.data(), out.data());
+
+            int mismatch = 0;
+            for (int i=0; i<w * h * c; i += 997)
+            {
+                if (out[i] != in[i] * 2)
+                    mismatch++;
+            }
+
+            if (times[li] >= 0 && mismatch)
+            {
+                fprintf(stderr, "%s %dx%dx%d mismatch %d\n", get_channel_layout_name(channel_layout), w, h, c, mismatch);
+            }
+        }
+
+        char shape[32];
+        sprintf(shape, "%dx%dx%d", w, h, c);
+
+        const char* faster = times[1] >= 0 && (times[0] < 0 || times[1] < times[0]) ? "array" : "3d";
+        fprintf(stderr, "%-16s %12.4f %12.4f %8s\n", shape, times[0], times[1], faster);
+    }
+
+    select_channel_layout();
+
+    return 0;
+}
+
+// best of a few runs of a host side copy, ms
+static double time_host_copy(const std::function<void()>& func)
+{
+    double best = 1e30;
+    for (int i=0; i<5; i++)
+    {
+        double t0 = get_current_time();
+        func();
+        double t1 = get_current_time();
+
+        // first run faults the pages in
+        if (i > 0)
+            best = std::min(best, t1 - t0);
+    }
+
+    return best;
+}
+
+static void print_host_copy(const char* method, double ms, size_t bytes)
+{
+    fprintf(stderr, "%-32s %10.3f %10.2f\n", method, ms, bytes / ms / 1e6);
+}
+
+// memcpy between host buffers is the ceiling, then host linear images read through the mapped pointer
+// row by row with read_storage_image and with readback_storage_image on one and on every thread
+static int bench_readback()
+{
+    const int w = 2048;
+    const int h = 2048;
+
+    ThreadPool pool;
+    pool.create();
+
+    const int thread_count = pool.get_thread_count();
+
+    fprintf(stderr, "readback %d x %d, %d threads\n", w, h, thread_count);
+    fprintf(stderr, "%-32s %10s %10s\n", "method", "ms", "GB/s");
+
+    {
+        const size_t size = (size_t)w * h * sizeof(float);
+        std::vector<unsigned char> src(size, 1);
+        std::vector<unsigned char> dst(size);
+
+        print_host_copy("memcpy", time_host_copy([&]() { memcpy(dst.data(), src.data(), size); }), size);
+
+        const size_t chunk_size = (size + thread_count * 4 - 1) / (thread_count * 4);
+        print_host_copy("memcpy threads", time_host_copy([&]() {
+            pool.parallel_for(thread_count * 4, [&](int i) {
+                const size_t offset = chunk_size * i;
+                if (offset < size)
+                    memcpy(dst.data() + offset, src.data() + offset, std::min(chunk_size, size - offset));
+            });
+        }), size);
+    }
+
+    for (int fi=0; fi<IMAGE_FORMAT_COUNT; fi++)
+    {
+        const ImageStorageFormat format = (ImageStorageFormat)fi;
+        const char* name = get_image_format_name(format);
+        const int elempack = get_image_format_elempack(format);
+        const bool fp16 = format == IMAGE_FORMAT_FP16 || format == IMAGE_FORMAT_FP16_PACK4;
+        const size_t row_size = w * get_image_format_elemsize(format);
+        const size_t size = row_size * h;
+
+        VkStorageImage si;
+        if (create_storage_image(IMAGE_STORAGE_HOST_LINEAR, w, h, &si, format) != 0)
+        {
+            fprintf(stderr, "%s linear storage image not supported, skipped\n", name);
+            destroy_storage_image(&si);
+            continue;
+        }
+
+        // small integers, exact in fp16 too
+        const int count = w * h * elempack;
+        std::vector<float> values(count);
+        std::vector<unsigned short> values_fp16(fp16 ? count : 0);
+        for (int i=0; i<count; i++)
+        {
+            values[i] = (float)(i % 1000);
+            if (fp16)
+                values_fp16[i] = float32_to_float16(values[i]);
+        }
+        write_storage_image(si, fp16 ? (const void*)values_fp16.data() : (const void*)values.data());
+
+        std::vector<unsigned char> raw(size);
+        std::vector<float> out(count);
+
+        char method[64];
+        if (fi == 0)
+        {
+            sprintf(method, "%s read_storage_image", name);
+            print_host_copy(method, time_host_copy([&]() { read_storage_image(si, raw.data()); }), size);
+        }
+
+        sprintf(method, "%s raw", name);
+        print_host_copy(method, time_host_copy([&]() { readback_storage_image(si, raw.data()); }), size);
+
+        sprintf(method, "%s raw threads", name);
+        print_host_copy(method, time_host_copy([&]() { readback_storage_image(si, raw.data(), READBACK_RAW, 0, &pool); }), size);
+
+        if (fp16)
+        {
+            sprintf(method, "%s to fp32 threads", name);
+            print_host_copy(method, time_host_copy([&]() { readback_storage_image(si, out.data(), READBACK_FP32, 0, &pool); }), size);
+
+            int mismatch = 0;
+            for (int i=0; i<count; i++)
+            {
+                if (out[i] != values[i])
+                    mismatch++;
+            }
+
+            if (mismatch)
+                fprintf(stderr, "%s to fp32 mismatch %d\n", name, mismatch);
+        }
+
+        if (elempack == 4)
+        {
+            sprintf(method, "%s to fp32 planar threads", name);
+            print_host_copy(method, time_host_copy([&]() { readback_storage_image(si, out.data(), READBACK_FP32_PLANAR, 0, &pool); }), size);
+
+            // texel (x, y) channel k lands at row y of plane k
+            int mismatch = 0;
+            for (int i=0; i<count; i++)
+            {
+                const int k = i / (w * h);
+                const int xy = i % (w * h);
+                if (out[i] != values[xy * 4 + k])
+                    mismatch++;
+            }
+
+            if (mismatch)
+                fprintf(stderr, "%s to fp32 planar mismatch %d\n", name, mismatch);
+        }
+
+        if (memcmp(raw.data(), fp16 ? (const void*)values_fp16.data() : (const void*)values.data(), size) != 0)
+            fprintf(stderr, "%s raw mismatch\n", name);
+
+        destroy_storage_image(&si);
+    }
+
+    pool.destroy();
+
+    return 0;
+}
+
+// caller memory to kernel input through a copy and through a host pointer import,
+// the import saves the memcpy but the kernel then reads over the host bus
+static int bench_host_import()
+{
+    const int sizes_mb[] = { 16, 64, 256 };
+    const int w = 1024;
+
+    GpuContext* ctx = get_current_gpu_context();
+    fprintf(stderr, "external memory host %d minImportedHostPointerAlignment %lu\n", ctx->support_external_memory_host, (unsigned long)ctx->minImportedHostPointerAlignment);
+
+    VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale_buffer.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkDescriptorAllocator descriptorAllocator;
+    descriptorAllocator.create(1);
+
+    fprintf(stderr, "%6s %8s %12s %12s %12s\n", "MB", "path", "prepare(ms)", "kernel(ms)", "total(ms)");
+
+    for (int si=0; si<3; si++)
+    {
+        const int h = sizes_mb[si] * 1024 * 1024 / sizeof(float) / w;
+        const size_t size = (size_t)w * h * sizeof(float);
+
+        // caller data in page aligned host memory
+        const size_t alignment = (size_t)ctx->minImportedHostPointerAlignment;
+        std::vector<unsigned char> storage(size + alignment);
+        float* in = (float*)alignSize((size_t)storage.data(), alignment);
+        for (int i=0; i<w * h; i++)
+        {
+            in[i] = (float)(i % 1000);
+        }
+
+        VkBlob top_blob;
+        VkStagingRing ring;
+        if (create_blob(BLOB_BACKEND_BUFFER, w, h, 1, &top_blob) != 0 || ring.create(size + 1024, 1) != 0)
+        {
+            destroy_blob(&top_blob);
+            ring.destroy();
+            break;
+        }
+
+        std::vector<float> out(w * h);
+
+        for (int pi=0; pi<2; pi++)
+        {
+            const bool allow_import = pi == 1;
+            if (allow_import && !ctx->support_external_memory_host)
+            {
+                fprintf(stderr, "%6d %8s %12s %12s %12s\n", sizes_mb[si], "import", "-", "-", "-");
+                continue;
+            }
+
+            double t0 = get_current_time();
+
+            VkHostBuffer bottom_blob;
+            if (import_host_buffer(in, size, &bottom_blob, allow_import) != 0)
+            {
+                destroy_host_buffer(&bottom_blob);
+                continue;
+            }
+
+            double t1 = get_current_time();
+
+            VkDescriptorBufferInfo bufferInfos[2];
+            bufferInfos[0].buffer = bottom_blob.buffer;
+            bufferInfos[0].offset = bottom_blob.offset;
+            bufferInfos[0].range = size;
+            bufferInfos[1].buffer = top_blob.buffer;
+            bufferInfos[1].offset = 0;
+            bufferInfos[1].range = size;
+
+            descriptorAllocator.begin_frame(0);
+            VkDescriptorSet descriptorSet = descriptorAllocator.get(cp.descriptorSetLayout, bufferInfos, 2);
+
+            ring.begin_frame();
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+            record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+            record_dispatch(commandBuffer, cp, w, h, 1);
+            ring.end_frame();
+            ring.wait_idle();
+
+            double t2 = get_current_time();
+
+            ring.begin_frame();
+            download_blob(ring, top_blob, out.data());
+            ring.end_frame();
+            ring.wait_idle();
+
+            destroy_host_buffer(&bottom_blob);
+
+            int mismatch = 0;
+            for (int i=0; i<w * h; i += 997)
+            {
+                if (out[i] != in[i] * 2)
+                    mismatch++;
+            }
+
+            fprintf(stderr, "%6d %8s %12.3f %12.3f %12.3f\n", sizes_mb[si], bottom_blob.imported ? "import" : "copy", t1 - t0, t2 - t1, t2 - t0);
+
+            if (mismatch)
+            {
+                fprintf(stderr, "%s mismatch %d\n", bottom_blob.imported ? "import" : "copy", mismatch);
+            }
+        }
+
+        ring.destroy();
+        destroy_blob(&top_blob);
+    }
+
+    descriptorAllocator.destroy();
+    destroy_compute_pipeline(&cp);
+
+    return 0;
+}
+
+// one imagetest dispatch on a small image, what a short lived worker does first
+// prints its init and first dispatch time on stdout for bench_startup
+static int startup_child(double init_time)
+{
+    const double t0 = get_current_time();
+
+    const int w = 64;
+    const int h = 64;
+
+    const VkDescriptorType descriptorTypes[1] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagetest.comp.spv", descriptorTypes, 1, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkStorageImage top_blob;
+    VkStagingRing ring;
+    VkDescriptorAllocator descriptorAllocator;
+    int ret = create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &top_blob);
+    ret |= ring.create(1024, 1);
+    ret |= descriptorAllocator.create(1);
+
+    if (ret == 0)
+    {
+        descriptorAllocator.begin_frame(0);
+        VkDescriptorSet descriptorSet = descriptorAllocator.get(cp.descriptorSetLayout, &top_blob.imageview, 1);
+
+        ring.begin_frame();
+        VkCommandBuffer commandBuffer = ring.command_buffer();
+        record_image_barrier(commandBuffer, top_blob.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+        record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+        record_dispatch(commandBuffer, cp, w, h, 1);
+        ring.end_frame();
+        ring.wait_idle();
+
+        const double t1 = get_current_time();
+
+        printf("startup init %.3f first_dispatch %.3f\n", init_time, t1 - t0);
+        fflush(stdout);
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+    destroy_storage_image(&top_blob);
+    destroy_compute_pipeline(&cp);
+
+    return ret;
+}
+
+// process start to first dispatch of short lived workers running startup_child
+// cold starts have neither device snapshot nor pipeline cache, warm starts reuse what the previous run saved
+// the children keep their caches aside, the ones of this process stay untouched
+static int bench_startup(const char* self)
+{
+    const int runs = 5;
+
+    const std::string device_cache = std::string(get_gpu_info_snapshot_path()) + ".startup";
+    const std::string pipeline_cache = std::string(get_pipeline_cache_path()) + ".startup";
+    const std::string command = "VKTEST_LOG_LEVEL=0 VKTEST_DEVICE_CACHE='" + device_cache + "' VKTEST_PIPELINE_CACHE='" + pipeline_cache + "' '" + self + "' startup_child";
+
+    fprintf(stderr, "%-6s %14s %12s %16s %12s\n", "start", "to_first(ms)", "init(ms)", "first_disp(ms)", "exit(ms)");
+
+    for (int ci=0; ci<2; ci++)
+    {
+        const bool cold = ci == 0;
+
+        // one untimed run leaves the caches of a warm start behind
+        if (!cold)
+        {
+            FILE* fp = popen(command.c_str(), "r");
+            if (fp)
+                pclose(fp);
+        }
+
+        std::vector<double> to_first_times;
+        std::vector<double> init_times;
+        std::vector<double> first_dispatch_times;
+        std::vector<double> exit_times;
+
+        for (int ri=0; ri<runs; ri++)
+        {
+            if (cold)
+            {
+                remove(device_cache.c_str());
+                remove(pipeline_cache.c_str());
+            }
+
+            double t0 = get_current_time();
+
+            FILE* fp = popen(command.c_str(), "r");
+            if (!fp)
+            {
+                fprintf(stderr, "popen %s failed\n", command.c_str());
+                return -1;
+            }
+
+            char line[256];
+            double init_time = 0;
+            double first_dispatch_time = 0;
+            const bool reported = fgets(line, sizeof(line), fp) && sscanf(line, "startup init %lf first_dispatch %lf", &init_time, &first_dispatch_time) == 2;
+
+            double t1 = get_current_time();
+
+            int status = pclose(fp);
+
+            double t2 = get_current_time();
+
+            if (!reported || status != 0)
+            {
+                fprintf(stderr, "startup_child failed %d\n", status);
+                continue;
+            }
+
+            to_first_times.push_back(t1 - t0);
+            init_times.push_back(init_time);
+            first_dispatch_times.push_back(first_dispatch_time);
+            exit_times.push_back(t2 - t0);
+        }
+
+        fprintf(stderr, "%-6s %14.3f %12.3f %16.3f %12.3f\n", cold ? "cold" : "warm", compute_percentiles(to_first_times).median, compute_percentiles(init_times).median, compute_percentiles(first_dispatch_times).median, compute_percentiles(exit_times).median);
+    }
+
+    remove(device_cache.c_str());
+    remove(pipeline_cache.c_str());
+
+    return 0;
+}
+
+// a fan out of independent kernels followed by their consumers, and a ping pong chain,
+// recorded with the minimal barriers of VkComputeGraph and with a broad barrier after every dispatch
+static int bench_graph()
+{
+    const int w = 512;
+    const int h = 512;
+    const int fan = 8;
+    const int loop = 10;
+
+    VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    // X feeds the fan out into Y, Y feeds Z, the chain ping pongs between Y[0] and Y[1]
+    std::vector<VkStorageImage> blobs(1 + fan * 2);
+    int ret = 0;
+    for (size_t i=0; i<blobs.size(); i++)
+    {
+        ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[i]);
+    }
+
+    VkStagingRing ring;
+    ret |= ring.create((VkDeviceSize)w * h * sizeof(float) * 2 + 1024, 1);
+
+    VkDescriptorAllocator descriptorAllocator;
+    ret |= descriptorAllocator.create(1);
+
+    if (ret != 0)
+    {
+        descriptorAllocator.destroy();
+        ring.destroy();
+        for (size_t i=0; i<blobs.size(); i++)
+        {
+            destroy_storage_image(&blobs[i]);
+        }
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    std::vector<float> in(w * h);
+    for (int i=0; i<w * h; i++)
+    {
+        in[i] = (float)(i % 8);
+    }
+
+    ring.begin_frame();
+    ring.upload(in.data(), blobs[0].image, VK_IMAGE_LAYOUT_UNDEFINED, w, h, 1, sizeof(float));
+    for (size_t i=1; i<blobs.size(); i++)
+    {
+        record_image_barrier(ring.command_buffer(), blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
+    ring.end_frame();
+    ring.wait_idle();
+
+    descriptorAllocator.begin_frame(0);
+
+    fprintf(stderr, "%-8s %-8s %10s %10s %10s\n", "graph", "barriers", "calls", "count", "ms");
+
+    for (int pi=0; pi<2; pi++)
+    {
+        const bool chain = pi == 1;
+
+        for (int ni=0; ni<2; ni++)
+        {
+            const bool naive = ni == 1;
+
+            VkComputeGraph graph;
+            std::vector<int> ids(blobs.size());
+            for (size_t i=0; i<blobs.size(); i++)
+            {
+                ids[i] = graph.add_image(blobs[i].image, VK_IMAGE_LAYOUT_GENERAL);
+            }
+
+            const ShapeConstants shape = make_shape_constants(w, h, 1);
+
+            // each kernel doubles its input
+            int output = 0;
+            for (int i=0; i<fan * 2; i++)
+            {
+                int src;
+                int dst;
+                if (chain)
+                {
+                    src = i == 0 ? 0 : 1 + (i - 1) % 2;
+                    dst = 1 + i % 2;
+                }
+                else
+                {
+                    src = i < fan ? 0 : 1 + i - fan;
+                    dst = 1 + i;
+                }
+
+                const VkImageView imageviews[2] = { blobs[src].imageview, blobs[dst].imageview };
+                VkDescriptorSet descriptorSet = descriptorAllocator.get(cp.descriptorSetLayout, imageviews, 2);
+
+                graph.add_kernel(cp, descriptorSet, shape, w, h, 1, std::vector<int>(1, ids[src]), std::vector<int>(1, ids[dst]));
+
+                output = dst;
+            }
+            const int scale = chain ? 1 << (fan * 2) : 4;
+
+            double best = 1e30;
+            for (int ti=0; ti<3; ti++)
+            {
+                double t0 = get_current_time();
+
+                // the repeats share one command buffer, each continues from the accesses the previous one left
+                ring.begin_frame();
+                graph.reset();
+                for (int li=0; li<loop; li++)
+                {
+                    graph.record(ring.command_buffer(), naive);
+                }
+                ring.end_frame();
+                ring.wait_idle();
+
+                double t1 = get_current_time();
+
+                // first submit warms up the pipeline
+                if (ti > 0)
+                    best = std::min(best, (t1 - t0) / loop);
+            }
+
+            std::vector<float> out(w * h, 0.f);
+            ring.begin_frame();
+            graph.reset();
+            graph.record(ring.command_buffer(), naive);
+            ring.download(blobs[output].image, w, h, 1, sizeof(float), out.data());
+            ring.end_frame();
+            ring.wait_idle();
+
+            int mismatch = 0;
+            for (int i=0; i<w * h; i += 97)
+            {
+                if (out[i] != in[i] * scale)
+                    mismatch++;
+            }
+
+            fprintf(stderr, "%-8s %-8s %10d %10d %10.4f\n", chain ? "chain" : "fan", naive ? "naive" : "minimal", graph.barrier_call_count, graph.barrier_count, best);
+
+            if (mismatch)
+            {
+                fprintf(stderr, "%s %s mismatch %d\n", chain ? "chain" : "fan", naive ? "naive" : "minimal", mismatch);
+            }
+        }
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+
+    for (size_t i=0; i<blobs.size(); i++)
+    {
+        destroy_storage_image(&blobs[i]);
+    }
+
+    destroy_compute_pipeline(&cp);
+
+    return 0;
+}
+
+// compile a few per-device variants in the background while dispatches keep going on the prebuilt kernel
+// the second round finds every variant in the on-disk cache
+static int bench_spirv_compiler()
+{
+    const int w = 256;
+    const int h = 256;
+
+    struct Variant
+    {
+        const char* comp_path;
+        std::vector<std::string> defines;
+    };
+
+    std::vector<Variant> variants;
+    {
+        Variant v;
+        v.comp_path = "imagescale.comp";
+        v.defines.push_back("IMAGE_FORMAT=r32f");// same as imagescale.comp.spv, dispatched below
+        variants.push_back(v);
+
+        if (is_image_format_supported(IMAGE_FORMAT_FP16))
+        {
+            v.defines[0] = "IMAGE_FORMAT=r16f";
+            variants.push_back(v);
+        }
+
+        v.defines[0] = "CHANNEL_LAYOUT=1";
+        variants.push_back(v);
+
+        v.defines[0] = "CHANNEL_LAYOUT=2";
+        variants.push_back(v);
+
+        v.comp_path = "imagetest.comp";
+        v.defines[0] = "BLOB_BUFFER=1";
+        variants.push_back(v);
+    }
+
+    // the first round starts cold
+    const char* target_env = get_spirv_target_env(get_current_gpu_context()->info.properties.apiVersion);
+    for (size_t i=0; i<variants.size(); i++)
+    {
+        std::string source = read_file(variants[i].comp_path);
+        if (source.empty())
+            return -1;
+
+        remove(get_spirv_variant_path(source, variants[i].defines, target_env).c_str());
+    }
+
+    VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkStorageImage blobs[2];
+    int ret = 0;
+    ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[0]);
+    ret |= create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[1]);
+
+    VkStagingRing ring;
+    ret |= ring.create(256, 1);
+
+    VkDescriptorAllocator descriptorAllocator;
+    ret |= descriptorAllocator.create(1);
+
+    if (ret != 0)
+    {
+        descriptorAllocator.destroy();
+        ring.destroy();
+        destroy_storage_image(&blobs[0]);
+        destroy_storage_image(&blobs[1]);
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    ring.begin_frame();
+    for (int i=0; i<2; i++)
+    {
+        record_image_barrier(ring.command_buffer(), blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    }
+    ring.end_frame();
+    ring.wait_idle();
+
+    descriptorAllocator.begin_frame(0);
+
+    const VkImageView imageviews[2] = { blobs[0].imageview, blobs[1].imageview };
+    VkDescriptorSet descriptorSet = descriptorAllocator.get(cp.descriptorSetLayout, imageviews, 2);
+
+    const ShapeConstants shape = make_shape_constants(w, h, 1);
+
+    fprintf(stderr, "%-6s %12s %12s %12s %12s %14s\n", "round", "variants", "request(ms)", "ready(ms)", "dispatches", "switch(ms)");
+
+    for (int ri=0; ri<2; ri++)
+    {
+        VkSpirvCompiler compiler;
+        compiler.create(2);
+
+        double t0 = get_current_time();
+
+        std::vector<std::string> spv_paths(variants.size());
+        for (size_t i=0; i<variants.size(); i++)
+        {
+            spv_paths[i] = compiler.request(variants[i].comp_path, variants[i].defines);
+        }
+
+        double t1 = get_current_time();
+
+        // the request path keeps dispatching the prebuilt kernel until its variant shows up
+        int dispatch_count = 0;
+        while (compiler.query(spv_paths[0]) == 0)
+        {
+            ring.begin_frame();
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+            record_shape_constants(commandBuffer, cp, shape);
+            record_dispatch(commandBuffer, cp, w, h, 1);
+            ring.end_frame();
+            ring.wait_idle();
+
+            dispatch_count++;
+        }
+
+        int failed = 0;
+        for (size_t i=0; i<variants.size(); i++)
+        {
+            if (compiler.wait(spv_paths[i]) != 0)
+                failed++;
+        }
+
+        double t2 = get_current_time();
+
+        // one dispatch of the variant, module and pipeline creation included
+        double switch_time = 0;
+        if (compiler.query(spv_paths[0]) == 1)
+        {
+            double t3 = get_current_time();
+
+            ComputePipeline variant_cp;
+            if (create_compute_pipeline(spv_paths[0].c_str(), descriptorTypes, 2, 8, 8, 1, &variant_cp) == 0)
+            {
+                ring.begin_frame();
+                VkCommandBuffer commandBuffer = ring.command_buffer();
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, variant_cp.pipeline);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, variant_cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+                record_shape_constants(commandBuffer, variant_cp, shape);
+                record_dispatch(commandBuffer, variant_cp, w, h, 1);
+                ring.end_frame();
+                ring.wait_idle();
+            }
+            destroy_compute_pipeline(&variant_cp);
+
+            double t4 = get_current_time();
+
+            switch_time = t4 - t3;
+        }
+
+        compiler.destroy();
+
+        fprintf(stderr, "%-6s %12d %12.3f %12.3f %12d %14.3f\n", ri == 0 ? "cold" : "warm", (int)variants.size(), t1 - t0, t2 - t0, dispatch_count, switch_time);
+
+        if (failed)
+        {
+            fprintf(stderr, "%d variants failed to compile\n", failed);
+            ret = -1;
+            break;
+        }
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+
+    destroy_storage_image(&blobs[0]);
+    destroy_storage_image(&blobs[1]);
+
+    destroy_compute_pipeline(&cp);
+
+    return ret;
+}
+
+// resident set of this process in bytes
+static size_t get_current_rss()
+{
+    FILE* fp = fopen("/proc/self/statm", "rb");
+    if (!fp)
+        return 0;
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    int nscan = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+
+    return nscan == 2 ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+// high water mark of the resident set in bytes, it never goes down
+static size_t get_peak_rss()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+#if __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// a large file into a device buffer, mmap streaming first as the peak resident set only grows, read_file after
+static int bench_stream_load()
+{
+    const int size_mb = 256;
+    const size_t chunk_size = 8 * 1024 * 1024;
+    const char* path = "imagetest.load.tmp";
+
+    const size_t size = (size_t)size_mb * 1024 * 1024;
+
+    // float pattern, written a chunk at a time
+    {
+        FILE* fp = fopen(path, "wb");
+        if (!fp)
+        {
+            fprintf(stderr, "fopen %s failed\n", path);
+            return -1;
+        }
+
+        std::vector<float> chunk(chunk_size / sizeof(float));
+        size_t nwrite = 0;
+        for (size_t pos=0; pos<size; pos+=chunk_size)
+        {
+            for (size_t i=0; i<chunk.size(); i++)
+            {
+                chunk[i] = (float)((pos / sizeof(float) + i) % 1000);
+            }
+            nwrite += fwrite(chunk.data(), 1, chunk_size, fp);
+        }
+        fclose(fp);
+
+        if (nwrite != size)
+        {
+            fprintf(stderr, "write %s failed\n", path);
+            remove(path);
+            return -1;
+        }
+    }
+
+    VkBlob blob;
+    VkStagingRing ring;
+    if (create_blob(BLOB_BACKEND_BUFFER, 1024, (int)(size / sizeof(float) / 1024), 1, &blob) != 0 || ring.create(chunk_size, 3) != 0)
+    {
+        destroy_blob(&blob);
+        ring.destroy();
+        remove(path);
+        return -1;
+    }
+
+    fprintf(stderr, "%-10s %6s %10s %10s %14s\n", "loader", "MB", "ms", "MB/s", "peak_rss(MB)");
+
+    int ret = 0;
+    for (int li=0; li<2; li++)
+    {
+        const bool mapped = li == 0;
+
+        const size_t rss0 = get_current_rss();
+
+        double t0 = get_current_time();
+
+        size_t loaded_size = 0;
+        if (mapped)
+        {
+            ret = stream_file_to_buffer(ring, path, blob.buffer, 0, chunk_size, &loaded_size);
+        }
+        else
+        {
+            std::string data = read_file(path);
+            loaded_size = data.size();
+
+            for (size_t pos=0; pos<data.size() && ret == 0; pos+=chunk_size)
+            {
+                ring.begin_frame();
+                ret = ring.upload(data.data() + pos, std::min(chunk_size, data.size() - pos), blob.buffer, pos);
+                if (ring.end_frame() != 0)
+                    ret = -1;
+            }
+        }
+        ring.wait_idle();
+
+        double t1 = get_current_time();
+
+        const size_t peak_rss = get_peak_rss();
+
+        if (ret != 0 || loaded_size != size)
+        {
+            fprintf(stderr, "%s load failed\n", mapped ? "mmap" : "read_file");
+            ret = -1;
+            break;
+        }
+
+        fprintf(stderr, "%-10s %6d %10.3f %10.1f %14.1f\n", mapped ? "mmap" : "read_file", size_mb, t1 - t0, size_mb / ((t1 - t0) / 1000), (peak_rss > rss0 ? peak_rss - rss0 : 0) / 1024.0 / 1024.0);
+
+        // the first and the last chunk back
+        std::vector<float> head(chunk_size / sizeof(float));
+        std::vector<float> tail(chunk_size / sizeof(float));
+        ring.begin_frame();
+        ring.download(blob.buffer, 0, chunk_size, head.data());
+        ring.end_frame();
+        ring.begin_frame();
+        ring.download(blob.buffer, size - chunk_size, chunk_size, tail.data());
+        ring.end_frame();
+        ring.wait_idle();
+
+        int mismatch = 0;
+        for (size_t i=0; i<head.size(); i++)
+        {
+            if (head[i] != (float)(i % 1000) || tail[i] != (float)(((size - chunk_size) / sizeof(float) + i) % 1000))
+                mismatch++;
+        }
+
+        if (mismatch)
+        {
+            fprintf(stderr, "%s mismatch %d\n", mapped ? "mmap" : "read_file", mismatch);
+        }
+    }
+
+    ring.destroy();
+    destroy_blob(&blob);
+
+    remove(path);
+
+    return ret;
+}
+
+// every reduction over both blob backends against a double precision cpu reference
+// GB/s counts the blob bytes read once, each path runs when the device has it
+static int bench_reduce()
+{
+    const int sizes[] = { 512, 4096 };
+    const int loop = 5;
+
+    GpuContext* ctx = get_current_gpu_context();
+    fprintf(stderr, "subgroup size %u arithmetic %d\n", ctx->subgroupSize, ctx->support_subgroup_arithmetic);
+
+    // room for the upload of the largest blob
+    VkStagingRing ring;
+    VkDescriptorAllocator descriptorAllocator;
+    if (ring.create((VkDeviceSize)sizes[1] * sizes[1] * sizeof(float) + 1024, 1) != 0 || descriptorAllocator.create(1) != 0)
+    {
+        descriptorAllocator.destroy();
+        ring.destroy();
+        return -1;
+    }
+
+    fprintf(stderr, "%-6s %-7s %-7s %-9s %7s %10s %10s %14s %8s\n", "size", "backend", "op", "path", "passes", "ms", "GB/s", "result", "error");
+
+    int ret = 0;
+    for (int si=0; si<2 && ret == 0; si++)
+    {
+        const int w = sizes[si];
+        const int h = sizes[si];
+        const size_t n = (size_t)w * h;
+
+        // distinct values with a single maximum, not at either end
+        std::vector<float> in(n);
+        for (size_t i=0; i<n; i++)
+        {
+            in[i] = (float)((i * 7919) % 100003) / 100003.f - 0.5f;
+        }
+        in[n / 3] = 2.f;
+
+        double sum = 0;
+        float max_value = in[0];
+        int max_index = 0;
+        for (size_t i=0; i<n; i++)
+        {
+            sum += in[i];
+            if (in[i] > max_value)
+            {
+                max_value = in[i];
+                max_index = (int)i;
+            }
+        }
+
+        for (int bi=0; bi<BLOB_BACKEND_COUNT && ret == 0; bi++)
+        {
+            const BlobBackend backend = (BlobBackend)bi;
+
+            VkBlob blob;
+            if (create_blob(backend, w, h, 1, &blob) != 0)
+            {
+                destroy_blob(&blob);
+                ret = -1;
+                break;
+            }
+
+            ring.begin_frame();
+            record_blob_init(ring.command_buffer(), blob);
+            ring.end_frame();
+            ring.wait_idle();
+
+            ring.begin_frame();
+            int upload_ret = upload_blob(ring, in.data(), blob);
+            ring.end_frame();
+            ring.wait_idle();
+
+            if (upload_ret != 0)
+            {
+                destroy_blob(&blob);
+                ret = -1;
+                break;
+            }
+
+            for (int oi=0; oi<REDUCE_OP_COUNT; oi++)
+            {
+                const ReduceOp op = (ReduceOp)oi;
+
+                for (int pi=0; pi<2; pi++)
+                {
+                    const bool use_subgroup = pi == 0;
+                    if (use_subgroup && !ctx->support_subgroup_arithmetic)
+                        continue;
+
+                    VkReduction reduction;
+                    if (reduction.create(op, backend, w, h, 1, use_subgroup) != 0)
+                    {
+                        ret = -1;
+                        break;
+                    }
+
+                    double best = 1e30;
+                    ReduceResult result;
+                    result.value = 0.f;
+                    result.index = -1;
+                    for (int li=0; li<loop; li++)
+                    {
+                        double t0 = get_current_time();
+
+                        descriptorAllocator.begin_frame(0);
+
+                        ring.begin_frame();
+                        reduction.record(ring.command_buffer(), descriptorAllocator, blob);
+                        ring.download(reduction.result_buffer, 0, sizeof(ReduceResult), &result);
+                        ring.end_frame();
+                        ring.wait_idle();
+
+                        double t1 = get_current_time();
+
+                        // first submit warms up the pipelines
+                        if (li > 0)
+                            best = std::min(best, t1 - t0);
+                    }
+
+                    double error = 0;
+                    if (op == REDUCE_SUM)
+                        error = fabs(result.value - sum) / std::max(fabs(sum), 1.0);
+                    if (op == REDUCE_MEAN)
+                        error = fabs(result.value - sum / n) / std::max(fabs(sum / n), 1.0);
+                    if (op == REDUCE_MAX)
+                        error = result.value == max_value ? 0 : 1;
+                    if (op == REDUCE_ARGMAX)
+                        error = result.value == max_value && result.index == max_index ? 0 : 1;
+
+                    fprintf(stderr, "%-6d %-7s %-7s %-9s %7d %10.4f %10.2f %14.6f %8.2g\n", w, backend == BLOB_BACKEND_IMAGE ? "image" : "buffer", get_reduce_op_name(op), reduction.subgroup ? "subgroup" : "shared", reduction.pass_count, best, n * sizeof(float) / (best / 1000) / 1e9, result.value, error);
+
+                    // fp32 partial sums drift from the reference by a few ulp per pass
+                    if (error > 1e-4)
+                    {
+                        fprintf(stderr, "%s %s mismatch\n", get_reduce_op_name(op), reduction.subgroup ? "subgroup" : "shared");
+                    }
+                }
+            }
+
+            destroy_blob(&blob);
+        }
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+
+    return ret;
+}
+
+// square matrices on both blob backends with every tile the device takes, * marks the select_gemm_tile default
+// a few sampled elements of C are checked against a cpu dot product
+static int bench_gemm()
+{
+    const int sizes[] = { 256, 512, 1024 };
+    const int loop = 4;
+
+    const VkPhysicalDeviceLimits& limits = get_current_gpu_context()->info.properties.limits;
+    fprintf(stderr, "maxComputeSharedMemorySize %u maxComputeWorkGroupInvocations %u\n", limits.maxComputeSharedMemorySize, limits.maxComputeWorkGroupInvocations);
+
+    const GemmTileConfig selected = select_gemm_tile();
+
+    // room for the uploads of the largest A and B
+    VkStagingRing ring;
+    VkDescriptorAllocator descriptorAllocator;
+    if (ring.create((VkDeviceSize)sizes[2] * sizes[2] * sizeof(float) * 2 + 1024, 1) != 0 || descriptorAllocator.create(1) != 0)
+    {
+        descriptorAllocator.destroy();
+        ring.destroy();
+        return -1;
+    }
+
+    fprintf(stderr, "%-6s %-7s %-18s %10s %10s %10s\n", "size", "backend", "tile", "shared(B)", "ms", "GFLOP/s");
+
+    int ret = 0;
+    for (int si=0; si<3 && ret == 0; si++)
+    {
+        const int M = sizes[si];
+        const int N = sizes[si];
+        const int K = sizes[si];
+
+        std::vector<float> a((size_t)M * K);
+        std::vector<float> b((size_t)K * N);
+        for (size_t i=0; i<a.size(); i++)
+        {
+            a[i] = (float)((i * 31) % 17) / 17.f - 0.5f;
+        }
+        for (size_t i=0; i<b.size(); i++)
+        {
+            b[i] = (float)((i * 13) % 19) / 19.f - 0.5f;
+        }
+
+        for (int bi=0; bi<BLOB_BACKEND_COUNT && ret == 0; bi++)
+        {
+            const BlobBackend backend = (BlobBackend)bi;
+
+            VkBlob blobs[3];
+            int blob_ret = 0;
+            blob_ret |= create_blob(backend, K, M, 1, &blobs[0]);
+            blob_ret |= create_blob(backend, N, K, 1, &blobs[1]);
+            blob_ret |= create_blob(backend, N, M, 1, &blobs[2]);
+
+            if (blob_ret == 0)
+            {
+                ring.begin_frame();
+                for (int i=0; i<3; i++)
+                {
+                    record_blob_init(ring.command_buffer(), blobs[i]);
+                }
+                ring.end_frame();
+                ring.wait_idle();
+
+                ring.begin_frame();
+                blob_ret |= upload_blob(ring, a.data(), blobs[0]);
+                blob_ret |= upload_blob(ring, b.data(), blobs[1]);
+                ring.end_frame();
+                ring.wait_idle();
+            }
+
+            if (blob_ret != 0)
+            {
+                for (int i=0; i<3; i++)
+                {
+                    destroy_blob(&blobs[i]);
+                }
+                ret = -1;
+                break;
+            }
+
+            std::vector<float> c((size_t)M * N);
+
+            for (int ti=0; ti<gemm_tile_config_count; ti++)
+            {
+                const GemmTileConfig& tile = gemm_tile_configs[ti];
+                if (!is_gemm_tile_supported(tile))
+                    continue;
+
+                ComputePipeline cp;
+                if (create_gemm_pipeline(backend, tile, &cp) != 0)
+                {
+                    destroy_compute_pipeline(&cp);
+                    ret = -1;
+                    break;
+                }
+
+                double best = 1e30;
+                for (int li=0; li<loop; li++)
+                {
+                    descriptorAllocator.begin_frame(0);
+                    VkDescriptorSet descriptorSet = get_blob_descriptor_set(descriptorAllocator, cp.descriptorSetLayout, blobs, 3);
+
+                    double t0 = get_current_time();
+
+                    ring.begin_frame();
+                    record_gemm(ring.command_buffer(), cp, tile, descriptorSet, M, N, K);
+                    ring.end_frame();
+                    ring.wait_idle();
+
+                    double t1 = get_current_time();
+
+                    // first submit warms up the pipeline
+                    if (li > 0)
+                        best = std::min(best, t1 - t0);
+                }
+
+                ring.begin_frame();
+                download_blob(ring, blobs[2], c.data());
+                ring.end_frame();
+                ring.wait_idle();
+
+                int mismatch = 0;
+                for (int i=0; i<64; i++)
+                {
+                    const int y = (i * 37) % M;
+                    const int x = (i * 91) % N;
+
+                    double sum = 0;
+                    for (int k=0; k<K; k++)
+                    {
+                        sum += a[(size_t)y * K + k] * b[(size_t)k * N + x];
+                    }
+
+                    if (fabs(c[(size_t)y * N + x] - sum) > 1e-3 * K)
+                        mismatch++;
+                }
+
+                char tile_name[64];
+                sprintf(tile_name, "%ux%u %ux%u k%u%s", tile.local_size_x, tile.local_size_y, tile.thread_m, tile.thread_n, tile.tile_k, memcmp(&tile, &selected, sizeof(tile)) == 0 ? " *" : "");
+
+                fprintf(stderr, "%-6d %-7s %-18s %10u %10.4f %10.2f\n", M, backend == BLOB_BACKEND_IMAGE ? "image" : "buffer", tile_name, get_gemm_shared_memory_size(tile), best, 2.0 * M * N * K / (best / 1000) / 1e9);
+
+                if (mismatch)
+                {
+                    fprintf(stderr, "%s mismatch %d\n", tile_name, mismatch);
+                }
+
+                destroy_compute_pipeline(&cp);
+            }
+
+            for (int i=0; i<3; i++)
+            {
+                destroy_blob(&blobs[i]);
+            }
+        }
+    }
+
+    descriptorAllocator.destroy();
+    ring.destroy();
+
+    return ret;
+}
+
+// upload, scale and readback in a loop with 1, 2 and 3 frames in flight
+// each frame owns its images and descriptor set so frames never touch the same data
+static int bench_async()
+{
+    VkDevice device = get_gpu_device();
+
+    const int w = 1024;
+    const int h = 1024;
+    const int loop = 50;
+    const int max_frames = 3;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    uint32_t local_size_x = 8;
+    uint32_t local_size_y = 8;
+    autotune_local_size("imagescale.comp.spv", 2, 1024, 1024, &local_size_x, &local_size_y);
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, local_size_x, local_size_y, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkDescriptorPoolSize poolSizes[1] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            2 * max_frames // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = max_frames;
+    descriptorPoolCreateInfo.poolSizeCount = 1;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool;
+    VkResult ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    fprintf(stderr, "%-8s %14s %10s\n", "frames", "per loop(ms)", "speedup");
+
+    double baseline = 0;
+
+    for (int frame_count=1; frame_count<=max_frames; frame_count++)
+    {
+        VkStagingRing ring;
+        if (ring.create((VkDeviceSize)w * h * sizeof(float) * 2 + 1024, frame_count) != 0)
+            break;
+
+        // per-frame resources
+        std::vector<VkStorageImage> bottom_blobs(frame_count);
+        std::vector<VkStorageImage> top_blobs(frame_count);
+        std::vector<VkDescriptorSet> descriptorSets(frame_count);
+        std::vector< std::vector<float> > ins(frame_count, std::vector<float>(w * h));
+        std::vector< std::vector<float> > outs(frame_count, std::vector<float>(w * h));
+        std::vector<VkSubmitHandle> handles(frame_count);
+        std::vector<int> pending(frame_count, 0);
+
+        vkResetDescriptorPool(device, descriptorPool, 0);
+
+        ring.begin_frame();
+        for (int i=0; i<frame_count; i++)
+        {
+            create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &bottom_blobs[i]);
+            create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &top_blobs[i]);
+
+            VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+            descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            descriptorSetAllocateInfo.pNext = 0;
+            descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+            descriptorSetAllocateInfo.descriptorSetCount = 1;
+            descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+            ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSets[i]);
+            if (ret != VK_SUCCESS)
+            {
+                fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+            }
+
+            const VkImageView imageviews[2] = { bottom_blobs[i].imageview, top_blobs[i].imageview };
+            update_descriptor_set_images(descriptorSets[i], imageviews, 2);
+
+            record_image_barrier(ring.command_buffer(), bottom_blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+            record_image_barrier(ring.command_buffer(), top_blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        }
+        ring.end_frame();
+        ring.wait_idle();
+
+        int mismatch = 0;
+
+        double t0 = get_current_time();
+
+        for (int li=0; li<loop; li++)
+        {
+            // blocks only when the slot is still in flight, its readback lands in outs
+            ring.begin_frame();
+
+            const int fi = ring.current_frame();
+
+            if (pending[fi])
+            {
+                const std::vector<float>& in = ins[fi];
+                const std::vector<float>& out = outs[fi];
+                for (int i=0; i<w * h; i += 997)
+                {
+                    if (out[i] != in[i] * 2)
+                        mismatch++;
+                }
+            }
+
+            // host side work for this frame overlaps the frames in flight
+            std::vector<float>& in = ins[fi];
+            for (int i=0; i<w * h; i++)
+            {
+                in[i] = (float)((i + li) % 1000);
+            }
+
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            ring.upload(in.data(), bottom_blobs[fi].image, VK_IMAGE_LAYOUT_GENERAL, w, h, 1, sizeof(float));
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSets[fi], 0, 0);
+            record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+            record_dispatch(commandBuffer, cp, w, h, 1);
+            ring.download(top_blobs[fi].image, w, h, 1, sizeof(float), outs[fi].data());
+            ring.end_frame(&handles[fi]);
+
+            pending[fi] = 1;
+        }
+
+        for (int i=0; i<frame_count; i++)
+        {
+            if (!pending[i])
+                continue;
+
+            ring.wait(handles[i]);
+
+            for (int j=0; j<w * h; j += 997)
+            {
+                if (outs[i][j] != ins[i][j] * 2)
+                    mismatch++;
+            }
+        }
+
+        double t1 = get_current_time();
+
+        const double per_loop = (t1 - t0) / loop;
+        if (frame_count == 1)
+            baseline = per_loop;
+
+        fprintf(stderr, "%-8d %14.3f %10.2f\n", frame_count, per_loop, per_loop > 0 ? baseline / per_loop : 0);
+
+        if (mismatch)
+        {
+            fprintf(stderr, "frames %d mismatch %d\n", frame_count, mismatch);
+        }
+
+        ring.destroy();
+
+        for (int i=0; i<frame_count; i++)
+        {
+            destroy_storage_image(&bottom_blobs[i]);
+            destroy_storage_image(&top_blobs[i]);
+        }
+    }
+
+    vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+    destroy_compute_pipeline(&cp);
+
+    return 0;
+}
+
+// upload of batch k+1 on the transfer queue while batch k computes, readback of batch k after it
+// compared against the same pipeline with every submit on the compute queue
+static int bench_transfer_overlap()
+{
+    VkDevice device = get_gpu_device();
+
+    const int w = 1024;
+    const int h = 1024;
+    const int loop = 50;
+    const int frame_count = 3;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    uint32_t local_size_x = 8;
+    uint32_t local_size_y = 8;
+    autotune_local_size("imagescale.comp.spv", 2, 1024, 1024, &local_size_x, &local_size_y);
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, local_size_x, local_size_y, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    VkDescriptorPoolSize poolSizes[1] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            2 * frame_count // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = frame_count;
+    descriptorPoolCreateInfo.poolSizeCount = 1;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool;
+    VkResult ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        destroy_compute_pipeline(&cp);
+        return -1;
+    }
+
+    // per-slot resources, batch k uses slot k % frame_count
+    std::vector<VkStorageImage> bottom_blobs(frame_count);
+    std::vector<VkStorageImage> top_blobs(frame_count);
+    std::vector<VkDescriptorSet> descriptorSets(frame_count);
+    std::vector<VkSemaphore> upload_semaphores(frame_count);
+    std::vector<VkSemaphore> compute_semaphores(frame_count);
+    std::vector< std::vector<float> > ins(frame_count, std::vector<float>(w * h));
+    std::vector< std::vector<float> > outs(frame_count, std::vector<float>(w * h));
+
+    for (int i=0; i<frame_count; i++)
+    {
+        create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &bottom_blobs[i]);
+        create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &top_blobs[i]);
+
+        VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+        descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        descriptorSetAllocateInfo.pNext = 0;
+        descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+        descriptorSetAllocateInfo.descriptorSetCount = 1;
+        descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+        ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSets[i]);
+        if (ret != VK_SUCCESS)
+        {
+            fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+        }
+
+        const VkImageView imageviews[2] = { bottom_blobs[i].imageview, top_blobs[i].imageview };
+        update_descriptor_set_images(descriptorSets[i], imageviews, 2);
+
+        VkSemaphoreCreateInfo semaphoreCreateInfo;
+        semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreCreateInfo.pNext = 0;
+        semaphoreCreateInfo.flags = 0;
+
+        vkCreateSemaphore(device, &semaphoreCreateInfo, 0, &upload_semaphores[i]);
+        vkCreateSemaphore(device, &semaphoreCreateInfo, 0, &compute_semaphores[i]);
+    }
+
+    const uint32_t compute_family = get_gpu_queueFamilyIndex();
+
+    fprintf(stderr, "transfer queue family %u, compute queue family %u%s\n", get_gpu_transfer_queueFamilyIndex(), compute_family, get_gpu_transfer_queue() == get_gpu_queue() ? ", shared queue" : "");
+    fprintf(stderr, "%-10s %14s %10s\n", "queues", "per loop(ms)", "speedup");
+
+    double baseline = 0;
+
+    for (int qi=0; qi<2; qi++)
+    {
+        const bool transfer = qi == 1;
+
+        VkStagingRing upload_ring;
+        VkStagingRing compute_ring;
+        VkStagingRing download_ring;
+        if (upload_ring.create((VkDeviceSize)w * h * sizeof(float) + 1024, frame_count, transfer) != 0
+            || compute_ring.create(256, frame_count) != 0
+            || download_ring.create((VkDeviceSize)w * h * sizeof(float) + 1024, frame_count, transfer) != 0)
+            break;
+
+        const uint32_t transfer_family = upload_ring.queueFamilyIndex;
+
+        std::vector<VkSubmitHandle> compute_handles(frame_count);
+        std::vector<VkSubmitHandle> download_handles(frame_count);
+        std::vector<int> batches(frame_count, -1);
+
+        int mismatch = 0;
+
+        double t0 = get_current_time();
+
+        for (int k=-1; k<loop; k++)
+        {
+            // prefetch the next batch so its copy runs while this one computes
+            const int next = k + 1;
+            if (next < loop)
+            {
+                const int fi = next % frame_count;
+
+                // the slot images are free once their last compute and readback retired
+                if (batches[fi] >= 0)
+                {
+                    compute_ring.wait(compute_handles[fi]);
+                    download_ring.wait(download_handles[fi]);
+
+                    const int batch = batches[fi];
+                    for (int i=0; i<w * h; i += 997)
+                    {
+                        if (outs[fi][i] != (float)((i + batch) % 1000) * 2)
+                            mismatch++;
+                    }
+                }
+
+                for (int i=0; i<w * h; i++)
+                {
+                    ins[fi][i] = (float)((i + next) % 1000);
+                }
+
+                upload_ring.begin_frame();
+                upload_ring.upload(ins[fi].data(), bottom_blobs[fi].image, VK_IMAGE_LAYOUT_UNDEFINED, w, h, 1, sizeof(float));
+                upload_ring.end_frame(0, 0, 0, upload_semaphores[fi]);
+
+                batches[fi] = next;
+            }
+
+            if (k < 0)
+                continue;
+
+            const int fi = k % frame_count;
+
+            compute_ring.begin_frame();
+            VkCommandBuffer commandBuffer = compute_ring.command_buffer();
+            record_image_acquire(commandBuffer, bottom_blobs[fi].image, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, transfer_family, compute_family);
+            // top is overwritten, its previous contents and owner do not matter
+            record_image_barrier(commandBuffer, top_blobs[fi].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSets[fi], 0, 0);
+            record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+            record_dispatch(commandBuffer, cp, w, h, 1);
+            record_image_release(commandBuffer, top_blobs[fi].image, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, compute_family, transfer_family);
+            compute_ring.end_frame(&compute_handles[fi], upload_semaphores[fi], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, compute_semaphores[fi]);
+
+            download_ring.begin_frame();
+            download_ring.download(top_blobs[fi].image, w, h, 1, sizeof(float), outs[fi].data());
+            download_ring.end_frame(&download_handles[fi], compute_semaphores[fi], VK_PIPELINE_STAGE_TRANSFER_BIT, 0);
+        }
+
+        upload_ring.wait_idle();
+        compute_ring.wait_idle();
+        download_ring.wait_idle();
+
+        double t1 = get_current_time();
+
+        for (int fi=0; fi<frame_count; fi++)
+        {
+            const int batch = batches[fi];
+            if (batch < 0)
+                continue;
+
+            for (int i=0; i<w * h; i += 997)
+            {
+                if (outs[fi][i] != (float)((i + batch) % 1000) * 2)
+                    mismatch++;
+            }
+        }
+
+        const double per_loop = (t1 - t0) / loop;
+        if (!transfer)
+            baseline = per_loop;
+
+        fprintf(stderr, "%-10s %14.3f %10.2f\n", transfer ? "transfer" : "compute", per_loop, per_loop > 0 ? baseline / per_loop : 0);
+
+        if (mismatch)
+        {
+            fprintf(stderr, "%s mismatch %d\n", transfer ? "transfer" : "compute", mismatch);
+        }
+    }
+
+    for (int i=0; i<frame_count; i++)
+    {
+        vkDestroySemaphore(device, upload_semaphores[i], 0);
+        vkDestroySemaphore(device, compute_semaphores[i], 0);
+
+        destroy_storage_image(&bottom_blobs[i]);
+        destroy_storage_image(&top_blobs[i]);
+    }
+
+    vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+    destroy_compute_pipeline(&cp);
+
+    return 0;
+}
+
+// host time per submission of a small dispatch, recorded every time vs a recorded program
+// the patched case swaps the descriptor set variant and writes new parameters before every submit, without recording
+static int bench_recorded_program()
+{
+    VkDevice device = get_gpu_device();
+
+    const int w = 64;
+    const int h = 64;
+    const int loop = 1000;
+
+    const VkDescriptorType descriptorTypes[3] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC };
+
+    // push constants for the recorded every time case, a parameter buffer for the program
+    ComputePipeline cp;
+    ComputePipeline parameter_cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0 || create_compute_pipeline("imagescale_parameter.comp.spv", descriptorTypes, 3, 8, 8, 1, &parameter_cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        destroy_compute_pipeline(&parameter_cp);
+        return -1;
+    }
+
+    VkDescriptorPoolSize poolSizes[2] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            8 // descriptorCount
+        },
+        {
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            2 // descriptorCount
+        }
+    };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = 0;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = 4;
+    descriptorPoolCreateInfo.poolSizeCount = 2;
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool descriptorPool;
+    VkResult ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        destroy_compute_pipeline(&cp);
+        destroy_compute_pipeline(&parameter_cp);
+        return -1;
+    }
+
+    VkStorageImage blob0;
+    VkStorageImage blob1;
+    create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blob0);
+    create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blob1);
+
+    // set 0 scales blob0 into blob1, set 1 the other way round, sets 2 and 3 the same with the parameter buffer
+    const VkDescriptorSetLayout setLayouts[4] = { cp.descriptorSetLayout, cp.descriptorSetLayout, parameter_cp.descriptorSetLayout, parameter_cp.descriptorSetLayout };
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = 0;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 4;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
+
+    VkDescriptorSet descriptorSets[4];
+    ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, descriptorSets);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+    }
+
+    const VkImageView imageviews0[2] = { blob0.imageview, blob1.imageview };
+    const VkImageView imageviews1[2] = { blob1.imageview, blob0.imageview };
+    update_descriptor_set_images(descriptorSets[0], imageviews0, 2);
+    update_descriptor_set_images(descriptorSets[1], imageviews1, 2);
+    update_descriptor_set_images(descriptorSets[2], imageviews0, 2);
+    update_descriptor_set_images(descriptorSets[3], imageviews1, 2);
+
+    VkStagingRing ring;
+    ring.create(256, 1);
+
+    ring.begin_frame();
+    record_image_barrier(ring.command_buffer(), blob0.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    record_image_barrier(ring.command_buffer(), blob1.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    ring.end_frame();
+    ring.wait_idle();
+
+    // record every submission
+    double rerecord_time = 0;
+    for (int li=0; li<loop; li++)
+    {
+        double t0 = get_current_time();
+
+        ring.begin_frame();
+        VkCommandBuffer commandBuffer = ring.command_buffer();
+        record_image_barrier(commandBuffer, blob0.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSets[li % 2], 0, 0);
+        record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+        record_dispatch(commandBuffer, cp, w, h, 1);
+        record_image_barrier(commandBuffer, blob1.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+        ring.end_frame();
+
+        double t1 = get_current_time();
+
+        ring.wait_idle();
+
+        rerecord_time += t1 - t0;
+    }
+
+    ring.destroy();
+
+    VkRecordedProgram program;
+    program.create(sizeof(ShapeConstants));
+
+    const ShapeConstants shape = make_shape_constants(w, h, 1);
+    const int parameter_slot = program.record_parameters(&shape, sizeof(shape));
+
+    // both variants read the shape through the parameter buffer
+    const VkDescriptorBufferInfo descriptorBufferInfo = program.get_parameter_buffer_info(parameter_slot);
+    for (int i=2; i<4; i++)
+    {
+        VkWriteDescriptorSet writeDescriptorSet;
+        writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writeDescriptorSet.pNext = 0;
+        writeDescriptorSet.dstSet = descriptorSets[i];
+        writeDescriptorSet.dstBinding = 2;
+        writeDescriptorSet.dstArrayElement = 0;
+        writeDescriptorSet.descriptorCount = 1;
+        writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        writeDescriptorSet.pImageInfo = 0;
+        writeDescriptorSet.pBufferInfo = &descriptorBufferInfo;
+        writeDescriptorSet.pTexelBufferView = 0;
+
+        vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, 0);
+    }
+
+    program.record_image_barrier(blob0.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    program.record_pipeline(parameter_cp);
+    const int set_slot = program.record_descriptor_set(&descriptorSets[2], 2, parameter_slot);
+    program.record_dispatch(w, h, 1);
+    program.record_image_barrier(blob1.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    // every frame and variant is recorded here, outside the timed loops
+    double build_t0 = get_current_time();
+
+    program.build();
+
+    double build_time = get_current_time() - build_t0;
+
+    const int build_record_count = program.record_count;
+
+    // resubmit the recorded program
+    double reuse_time = 0;
+    for (int li=0; li<loop; li++)
+    {
+        double t0 = get_current_time();
+
+        program.submit();
+
+        double t1 = get_current_time();
+
+        program.wait();
+
+        reuse_time += t1 - t0;
+    }
+
+    const int reuse_record_count = program.record_count - build_record_count;
+
+    // new inputs before every submit, another set variant and rewritten parameters
+    double patch_time = 0;
+    for (int li=0; li<loop; li++)
+    {
+        double t0 = get_current_time();
+
+        const ShapeConstants patched_shape = make_shape_constants(w - li % 2, h, 1);
+        program.patch_descriptor_set(set_slot, li % 2);
+        program.patch_parameters(parameter_slot, &patched_shape);
+        program.submit();
+
+        double t1 = get_current_time();
+
+        program.wait();
+
+        patch_time += t1 - t0;
+    }
+
+    const int patch_record_count = program.record_count - build_record_count - reuse_record_count;
+
+    program.destroy();
+
+    fprintf(stderr, "%-12s %16s %10s\n", "mode", "host(us/submit)", "records");
+    fprintf(stderr, "%-12s %16.3f %10d\n", "rerecord", rerecord_time * 1000 / loop, loop);
+    fprintf(stderr, "%-12s %16.3f %10d\n", "build", build_time * 1000, build_record_count);// once, not per submit
+    fprintf(stderr, "%-12s %16.3f %10d\n", "recorded", reuse_time * 1000 / loop, reuse_record_count);
+    fprintf(stderr, "%-12s %16.3f %10d\n", "patched", patch_time * 1000 / loop, patch_record_count);
+
+    destroy_storage_image(&blob0);
+    destroy_storage_image(&blob1);
+
+    vkDestroyDescriptorPool(device, descriptorPool, 0);
+
+    destroy_compute_pipeline(&cp);
+    destroy_compute_pipeline(&parameter_cp);
+
+    return 0;
+}
+
+// host time to get a descriptor set per dispatch under a high dispatch rate
+// pool: a maxSets = 1 pool per dispatch, allocate: growable pools with an update per dispatch,
+// cached: sets with the same images are reused within the frame
+static int bench_descriptor()
+{
+    const int w = 64;
+    const int h = 64;
+    const int frame_count = 2;
+    const int frame_loop = 20;
+    const int dispatch_count = 1000;
+
+    const VkDescriptorType descriptorTypes[2] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagescale.comp.spv", descriptorTypes, 2, 8, 8, 1, &cp) != 0)
+    {
+        destroy_compute_pipeline(&cp);
+        return -1;
     }
 
-    return imageView;
-}
+    VkStorageImage blobs[4];
+    for (int i=0; i<4; i++)
+    {
+        create_storage_image(IMAGE_STORAGE_DEVICE_OPTIMAL, w, h, &blobs[i]);
+    }
 
-VkDeviceMemory fastMalloc(size_t size, uint32_t memoryTypeIndex)
-{
-    fprintf(stderr, "fastMalloc %lu on %u\n", size, memoryTypeIndex);
-    // new
-    VkMemoryAllocateInfo memoryAllocateInfo;
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = 0;
-    memoryAllocateInfo.allocationSize = size;
-    memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+    VkStagingRing ring;
+    ring.create(256, frame_count);
 
-    VkDeviceMemory ptr = 0;
-    VkResult ret = vkAllocateMemory(get_gpu_device(), &memoryAllocateInfo, 0, &ptr);
-    if (ret != VK_SUCCESS)
+    ring.begin_frame();
+    for (int i=0; i<4; i++)
     {
-        fprintf(stderr, "vkAllocateMemory failed %d\n", ret);
+        record_image_barrier(ring.command_buffer(), blobs[i].image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
     }
+    ring.end_frame();
+    ring.wait_idle();
 
-    return ptr;
-}
+    fprintf(stderr, "%-10s %18s %8s %8s\n", "mode", "host(us/dispatch)", "pools", "reused");
 
-int main()
-{
-    init_gpu_device();
+    for (int mi=0; mi<3; mi++)
+    {
+        const char* mode_name = mi == 0 ? "pool" : mi == 1 ? "allocate" : "cached";
 
-    int w = 8;
-    int h = 8;
+        VkDescriptorAllocator descriptorAllocator;
+        descriptorAllocator.create(frame_count);
 
-    VkResult ret;
+        // one pool per dispatch, destroyed when the frame retires
+        std::vector< std::vector<VkDescriptorPool> > frame_pools(frame_count);
+        int naive_pool_count = 0;
 
-    VkDevice device = get_gpu_device();
-    uint32_t queueFamilyIndex = get_gpu_queueFamilyIndex();
-//     uint32_t memoryTypeIndex = get_gpu_memoryTypeIndex();
+        double descriptor_time = 0;
 
-    int group_x;
-    int group_y;
-    int group_z;
+        for (int fi=0; fi<frame_loop; fi++)
+        {
+            ring.begin_frame();
 
-    VkShaderModule shaderModule;
+            const int frame = ring.current_frame();
 
-    VkDescriptorPool descriptorPool;
+            descriptorAllocator.begin_frame(frame);
 
-    // layer-specific
-    VkDescriptorSetLayout descriptorSetLayout;
-    VkPipelineLayout pipelineLayout;
+            for (size_t i=0; i<frame_pools[frame].size(); i++)
+            {
+                vkDestroyDescriptorPool(get_gpu_device(), frame_pools[frame][i], 0);
+            }
+            frame_pools[frame].clear();
 
-    VkPipeline pipeline;
-    VkDescriptorSet descriptorSet;
+            VkCommandBuffer commandBuffer = ring.command_buffer();
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipeline);
 
-//     ncnn::VkMat top_blob(8, 8, 4u, g_vulkan_devicelocal_allocator);
+            for (int di=0; di<dispatch_count; di++)
+            {
+                // cycle through 4 input and output pairs
+                const VkImageView imageviews[2] = { blobs[di % 4].imageview, blobs[(di + 1) % 4].imageview };
 
-    VkImage image = create_image(VK_IMAGE_TYPE_2D, w, h, 1);
+                double t0 = get_current_time();
 
-    VkImageView imageview = create_imageview(VK_IMAGE_VIEW_TYPE_2D, image);
+                VkDescriptorSet descriptorSet = 0;
+                if (mi == 0)
+                {
+                    VkDescriptorPoolSize poolSizes[1] =
+                    {
+                        {
+                            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                            2 // descriptorCount
+                        }
+                    };
+
+                    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+                    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+                    descriptorPoolCreateInfo.pNext = 0;
+                    descriptorPoolCreateInfo.flags = 0;
+                    descriptorPoolCreateInfo.maxSets = 1;
+                    descriptorPoolCreateInfo.poolSizeCount = 1;
+                    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+
+                    VkDescriptorPool descriptorPool;
+                    vkCreateDescriptorPool(get_gpu_device(), &descriptorPoolCreateInfo, 0, &descriptorPool);
+                    frame_pools[frame].push_back(descriptorPool);
+                    naive_pool_count++;
+
+                    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+                    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+                    descriptorSetAllocateInfo.pNext = 0;
+                    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+                    descriptorSetAllocateInfo.descriptorSetCount = 1;
+                    descriptorSetAllocateInfo.pSetLayouts = &cp.descriptorSetLayout;
+
+                    vkAllocateDescriptorSets(get_gpu_device(), &descriptorSetAllocateInfo, &descriptorSet);
+                    update_descriptor_set_images(descriptorSet, imageviews, 2);
+                }
+                if (mi == 1)
+                {
+                    descriptorSet = descriptorAllocator.allocate(cp.descriptorSetLayout);
+                    update_descriptor_set_images(descriptorSet, imageviews, 2);
+                }
+                if (mi == 2)
+                {
+                    descriptorSet = descriptorAllocator.get(cp.descriptorSetLayout, imageviews, 2);
+                }
 
-    // get image memory layout
-    VkSubresourceLayout subresourceLayout;
-    VkImageSubresource subresource;
-    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    subresource.mipLevel = 0;
-    subresource.arrayLayer = 0;
-    vkGetImageSubresourceLayout(get_gpu_device(), image, &subresource, &subresourceLayout);
+                double t1 = get_current_time();
 
-    fprintf(stderr, "offset = %lu\n", subresourceLayout.offset);
-    fprintf(stderr, "size = %lu\n", subresourceLayout.size);
-    fprintf(stderr, "rowPitch = %lu\n", subresourceLayout.rowPitch);
-    fprintf(stderr, "arrayPitch = %lu\n", subresourceLayout.arrayPitch);
-    fprintf(stderr, "depthPitch = %lu\n", subresourceLayout.depthPitch);
+                descriptor_time += t1 - t0;
 
-    // alloc
-    VkMemoryRequirements memoryRequirements;
-    vkGetImageMemoryRequirements(get_gpu_device(), image, &memoryRequirements);
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cp.pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+                record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+                record_dispatch(commandBuffer, cp, w, h, 1);
 
-    // memoryRequirements.size
-    // memoryRequirements.alignment
-    // memoryRequirements.memoryTypeBits
+                VkMemoryBarrier memoryBarrier;
+                memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                memoryBarrier.pNext = 0;
+                memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+                memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 
-    VkDeviceMemory memory = fastMalloc(memoryRequirements.size, memoryTypeIndex_hostvisible);
+                vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+            }
 
-    ret = vkBindImageMemory(get_gpu_device(), image, memory, 0);
-    if (ret != VK_SUCCESS)
+            ring.end_frame();
+        }
+
+        ring.wait_idle();
+
+        for (int i=0; i<frame_count; i++)
+        {
+            for (size_t j=0; j<frame_pools[i].size(); j++)
+            {
+                vkDestroyDescriptorPool(get_gpu_device(), frame_pools[i][j], 0);
+            }
+        }
+
+        const int pool_count = mi == 0 ? naive_pool_count : descriptorAllocator.pool_count;
+
+        fprintf(stderr, "%-10s %18.3f %8d %8d\n", mode_name, descriptor_time * 1000 / (frame_loop * dispatch_count), pool_count, descriptorAllocator.reuse_count);
+
+        descriptorAllocator.destroy();
+    }
+
+    ring.destroy();
+
+    for (int i=0; i<4; i++)
     {
-        fprintf(stderr, "vkBindImageMemory failed %d\n", ret);
+        destroy_storage_image(&blobs[i]);
     }
 
+    destroy_compute_pipeline(&cp);
 
-    std::string imagetest_comp_spv = read_file("imagetest.comp.spv");
+    return 0;
+}
 
-    // shader module
-    VkShaderModuleCreateInfo shaderModuleCreateInfo;
-    shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    shaderModuleCreateInfo.pNext = 0;
-    shaderModuleCreateInfo.flags = 0;
-    shaderModuleCreateInfo.codeSize = imagetest_comp_spv.size();
-    shaderModuleCreateInfo.pCode = (const uint32_t*)imagetest_comp_spv.data();
+// scale one image over 1 .. n contexts, devices is a comma separated list of physical device indices
+// repeating an index creates several logical devices on that physical device
+static int bench_tile_scheduler(const char* devices)
+{
+    const int w = 4096;
+    const int h = 4096;
+    const int tile_size = 512;
+    const int loop = 5;
 
-    ret = vkCreateShaderModule(device, &shaderModuleCreateInfo, 0, &shaderModule);
-    if (ret != VK_SUCCESS)
+    std::vector<uint32_t> physicalDeviceIndices;
+    if (devices)
+    {
+        const char* p = devices;
+        while (*p)
+        {
+            physicalDeviceIndices.push_back(strtoul(p, (char**)&p, 10));
+            if (*p == ',')
+                p++;
+            else if (*p)
+            {
+                fprintf(stderr, "bad device list %s\n", devices);
+                return -1;
+            }
+        }
+    }
+    else
     {
-        fprintf(stderr, "vkCreateShaderModule failed %d\n", ret);
+        for (size_t i=0; i<g_gpu_infos.size(); i++)
+        {
+            if (g_gpu_infos[i].score >= 0)
+                physicalDeviceIndices.push_back(i);
+        }
     }
 
-    // descriptorset layout
-    VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[1] =
+    // the first entry on the default physical device reuses the default context
+    std::vector<GpuContext*> contexts;
+    bool default_used = false;
+    for (size_t i=0; i<physicalDeviceIndices.size(); i++)
     {
+        if (!default_used && physicalDeviceIndices[i] == get_gpu_context(0)->info.physicalDeviceIndex)
         {
-            0,//binding
-            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,//descriptorType
-            1,//descriptorCount
-            VK_SHADER_STAGE_COMPUTE_BIT,//stageFlags
-            0//pImmutableSamplers
+            contexts.push_back(get_gpu_context(0));
+            default_used = true;
+            continue;
         }
-    };
 
-    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
-    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    descriptorSetLayoutCreateInfo.pNext = 0;
-    descriptorSetLayoutCreateInfo.flags = 0;
-    descriptorSetLayoutCreateInfo.bindingCount = 1;
-    descriptorSetLayoutCreateInfo.pBindings = descriptorSetLayoutBindings;
+        GpuContext* ctx = create_gpu_context(physicalDeviceIndices[i]);
+        if (!ctx)
+            return -1;
 
-    ret = vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCreateInfo, 0, &descriptorSetLayout);
-    if (ret != VK_SUCCESS)
-    {
-        fprintf(stderr, "vkCreateDescriptorSetLayout failed %d\n", ret);
+        contexts.push_back(ctx);
     }
 
-    // pipeline layout
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo;
-    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutCreateInfo.pNext = 0;
-    pipelineLayoutCreateInfo.flags = 0;
-    pipelineLayoutCreateInfo.setLayoutCount = 1;
-    pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout;
-    pipelineLayoutCreateInfo.pushConstantRangeCount = 0;
-    pipelineLayoutCreateInfo.pPushConstantRanges = 0;
-
-    ret = vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, 0, &pipelineLayout);
-    if (ret != VK_SUCCESS)
+    std::vector<float> src(w * h);
+    std::vector<float> dst(w * h);
+    for (int i=0; i<w * h; i++)
     {
-        fprintf(stderr, "vkCreatePipelineLayout failed %d\n", ret);
+        src[i] = (float)(i % 1000);
     }
 
-    // pipeline
-    VkPipelineShaderStageCreateInfo pipelineShaderStageCreateInfo;
-    pipelineShaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    pipelineShaderStageCreateInfo.pNext = 0;
-    pipelineShaderStageCreateInfo.flags = 0;
-    pipelineShaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    pipelineShaderStageCreateInfo.module = shaderModule;
-    pipelineShaderStageCreateInfo.pName = "main";
-    pipelineShaderStageCreateInfo.pSpecializationInfo = 0;
+    fprintf(stderr, "%-8s %12s %10s  %s\n", "devices", "per run(ms)", "speedup", "tiles/stolen per queue");
 
-    VkComputePipelineCreateInfo computePipelineCreateInfo;
-    computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    computePipelineCreateInfo.pNext = 0;
-    computePipelineCreateInfo.flags = 0;
-    computePipelineCreateInfo.stage = pipelineShaderStageCreateInfo;
-    computePipelineCreateInfo.layout = pipelineLayout;
-    computePipelineCreateInfo.basePipelineHandle = 0;
-    computePipelineCreateInfo.basePipelineIndex = 0;
+    double baseline = 0;
 
-    ret = vkCreateComputePipelines(device, 0, 1, &computePipelineCreateInfo, 0, &pipeline);
-    if (ret != VK_SUCCESS)
+    for (size_t n=1; n<=contexts.size(); n++)
     {
-        fprintf(stderr, "vkCreateComputePipelines failed %d\n", ret);
-    }
+        VkTileScheduler scheduler;
+        if (scheduler.create(std::vector<GpuContext*>(contexts.begin(), contexts.begin() + n), "imagescale.comp.spv", tile_size, tile_size) != 0)
+            return -1;
 
-    // descriptor pool
-    VkDescriptorPoolSize poolSizes[1] =
-    {
+        // warm up
+        if (scheduler.run(src.data(), dst.data(), w, h) != 0)
+            return -1;
+
+        double t0 = get_current_time();
+
+        for (int li=0; li<loop; li++)
         {
-            VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-            1 // descriptorCount
+            scheduler.run(src.data(), dst.data(), w, h);
         }
-    };
 
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
-    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descriptorPoolCreateInfo.pNext = 0;
-    descriptorPoolCreateInfo.flags = 0;
-    descriptorPoolCreateInfo.maxSets = 1;
-    descriptorPoolCreateInfo.poolSizeCount = 1;
-    descriptorPoolCreateInfo.pPoolSizes = poolSizes;
+        double t1 = get_current_time();
 
-    ret = vkCreateDescriptorPool(device, &descriptorPoolCreateInfo, 0, &descriptorPool);
-    if (ret != VK_SUCCESS)
-    {
-        fprintf(stderr, "vkCreateDescriptorPool failed %d\n", ret);
+        int mismatch = 0;
+        for (int i=0; i<w * h; i += 997)
+        {
+            if (dst[i] != src[i] * 2)
+                mismatch++;
+        }
+
+        const double per_run = (t1 - t0) / loop;
+        if (n == 1)
+            baseline = per_run;
+
+        fprintf(stderr, "%-8d %12.3f %10.2f ", (int)n, per_run, per_run > 0 ? baseline / per_run : 0);
+        for (int i=0; i<scheduler.worker_count(); i++)
+        {
+            fprintf(stderr, " %d/%d", scheduler.tile_counts[i], scheduler.steal_counts[i]);
+        }
+        fprintf(stderr, "\n");
+
+        if (mismatch)
+        {
+            fprintf(stderr, "devices %d mismatch %d\n", (int)n, mismatch);
+        }
     }
 
-    // descriptorset
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
-    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.pNext = 0;
-    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount = 1;
-    descriptorSetAllocateInfo.pSetLayouts = &descriptorSetLayout;
+    return 0;
+}
 
-    ret = vkAllocateDescriptorSets(device, &descriptorSetAllocateInfo, &descriptorSet);
-    if (ret != VK_SUCCESS)
+// the shape is a push constant, any w and h run on the same pipeline
+static int test_imagetest(int w, int h)
+{
+    VkResult ret;
+
+    VkDevice device = get_gpu_device();
+    uint32_t queueFamilyIndex = get_gpu_queueFamilyIndex();
+//     uint32_t memoryTypeIndex = get_gpu_memoryTypeIndex();
+
+    VkDescriptorSet descriptorSet;
+
+//     ncnn::VkMat top_blob(8, 8, 4u, g_vulkan_devicelocal_allocator);
+
+    VkStorageImage top_blob;
+    if (create_storage_image(IMAGE_STORAGE_HOST_LINEAR, w, h, &top_blob) != 0)
     {
-        fprintf(stderr, "vkAllocateDescriptorSets failed %d\n", ret);
+        fprintf(stderr, "create_storage_image failed\n");
+        return -1;
     }
 
-    // update descriptor set FIXME TODO
-    VkDescriptorImageInfo descriptorImageInfos[1];
+    VkImage image = top_blob.image;
+    VkImageView imageview = top_blob.imageview;
+
+    // get image memory layout
+    const VkSubresourceLayout& subresourceLayout = top_blob.subresourceLayout;
+
+    fprintf(stderr, "offset = %lu\n", subresourceLayout.offset);
+    fprintf(stderr, "size = %lu\n", subresourceLayout.size);
+    fprintf(stderr, "rowPitch = %lu\n", subresourceLayout.rowPitch);
+    fprintf(stderr, "arrayPitch = %lu\n", subresourceLayout.arrayPitch);
+    fprintf(stderr, "depthPitch = %lu\n", subresourceLayout.depthPitch);
+
+    if (get_log_level() >= LOG_LEVEL_INFO)
+        get_gpu_block_allocator(get_gpu_host_visible_memoryTypeIndex())->print_statistics();
+
+    // layer-specific
+    const VkDescriptorType descriptorTypes[1] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
 
-    descriptorImageInfos[0].sampler = 0;
-    descriptorImageInfos[0].imageView = imageview;
-    descriptorImageInfos[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    uint32_t local_size_x = 1;
+    uint32_t local_size_y = 1;
+    // tune on a representative size, the result is shared by every size
+    autotune_local_size("imagetest.comp.spv", 1, 1024, 1024, &local_size_x, &local_size_y);
 
-    VkWriteDescriptorSet writeDescriptorSets[1];
+    ComputePipeline cp;
+    if (create_compute_pipeline("imagetest.comp.spv", descriptorTypes, 1, local_size_x, local_size_y, 1, &cp) != 0)
+    {
+        fprintf(stderr, "create_compute_pipeline failed\n");
+        destroy_storage_image(&top_blob);
+        return -1;
+    }
 
-    writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeDescriptorSets[0].pNext = 0;
-    writeDescriptorSets[0].dstSet = descriptorSet;
-    writeDescriptorSets[0].dstBinding = 0;
-    writeDescriptorSets[0].dstArrayElement = 0;
-    writeDescriptorSets[0].descriptorCount = 1;
-    writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    writeDescriptorSets[0].pImageInfo = &descriptorImageInfos[0];
-    writeDescriptorSets[0].pBufferInfo = 0;
-    writeDescriptorSets[0].pTexelBufferView = 0;
+    VkDescriptorSetLayout descriptorSetLayout = cp.descriptorSetLayout;
+    VkPipelineLayout pipelineLayout = cp.pipelineLayout;
+    VkPipeline pipeline = cp.pipeline;
 
-    vkUpdateDescriptorSets(device, 1, writeDescriptorSets, 0, 0);
+    // descriptorset
+    VkDescriptorAllocator descriptorAllocator;
+    descriptorAllocator.create(1);
+    descriptorAllocator.begin_frame(0);
 
-    group_x = w;
-    group_y = h;
-    group_z = 1;
+    descriptorSet = descriptorAllocator.get(descriptorSetLayout, &imageview, 1);
+    if (!descriptorSet)
+    {
+        fprintf(stderr, "descriptor set allocation failed\n");
+    }
 
     // commandpool and commandbuffer
     VkCommandPoolCreateInfo commandPoolCreateInfo;
@@ -799,7 +10135,8 @@ int main()
 
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0, 0);
 
-    vkCmdDispatch(commandBuffer, group_x, group_y, group_z);
+    record_shape_constants(commandBuffer, cp, make_shape_constants(w, h, 1));
+    record_dispatch(commandBuffer, cp, w, h, 1);
 
     {
         // image layout
@@ -835,8 +10172,7 @@ int main()
     fprintf(stderr, "vulkan record done\n");
 
     // queue
-    VkQueue queue;
-    vkGetDeviceQueue(device, queueFamilyIndex, 0, &queue);
+    VkQueue queue = get_gpu_queue();
 
     // queue submit
     VkSubmitInfo submitInfo;
@@ -850,58 +10186,188 @@ int main()
     submitInfo.signalSemaphoreCount = 0;
     submitInfo.pSignalSemaphores = 0;
 
-    ret = vkQueueSubmit(queue, 1, &submitInfo, 0);
+    VkFenceCreateInfo fenceCreateInfo;
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.pNext = 0;
+    fenceCreateInfo.flags = 0;
+
+    VkFence fence;
+    ret = vkCreateFence(device, &fenceCreateInfo, 0, &fence);
+    if (ret != VK_SUCCESS)
+    {
+        fprintf(stderr, "vkCreateFence failed %d\n", ret);
+    }
+
+    ret = vkQueueSubmit(queue, 1, &submitInfo, fence);
     if (ret != VK_SUCCESS)
     {
         fprintf(stderr, "vkQueueSubmit failed %d\n", ret);
     }
 
-    // queue wait
-    ret = vkQueueWaitIdle(queue);
+    // wait for this submit only, other work on the queue keeps running
+    ret = vkWaitForFences(device, 1, &fence, VK_TRUE, (uint64_t)-1);
     if (ret != VK_SUCCESS)
     {
-        fprintf(stderr, "vkQueueWaitIdle failed %d\n", ret);
+        fprintf(stderr, "vkWaitForFences failed %d\n", ret);
     }
 
+    vkDestroyFence(device, fence, 0);
+
 
     // get result
     {
-    void* mapped_ptr = 0;
-    VkResult ret = vkMapMemory(get_gpu_device(), memory, 0, VK_WHOLE_SIZE, 0, &mapped_ptr);
-    if (ret != VK_SUCCESS)
+    ThreadPool pool;
+    pool.create();
+
+    std::vector<float> result(w * h);
+    readback_storage_image(top_blob, result.data(), READBACK_RAW, 0, &pool);
+
+    pool.destroy();
+
+    int mismatch = 0;
+    for (int i=0; i<w * h; i++)
     {
-        fprintf(stderr, "vkMapMemory failed %d\n", ret);
+        if (result[i] != 233.f)
+            mismatch++;
     }
 
-//     float* ptr = (float*)mapped_ptr;
-//     unsigned char* ptr = (unsigned char*)mapped_ptr;
-    for (int i=0; i<h; i++)
+    // print small results only
+    if (w * h <= 64)
     {
-        float* ptr = (float*)((unsigned char*)mapped_ptr + subresourceLayout.rowPitch * i);
-        for (int j=0; j<w; j++)
+        for (int i=0; i<h; i++)
         {
-            fprintf(stderr, "%f\n", ptr[j]);
-//             fprintf(stderr, "%d\n", ptr[j]);
+            for (int j=0; j<w; j++)
+            {
+                fprintf(stderr, "%f ", result[i * w + j]);
+            }
+            fprintf(stderr, "\n");
         }
     }
 
-    // TODO hold mapped ptr
-    vkUnmapMemory(get_gpu_device(), memory);
+    fprintf(stderr, "imagetest %d x %d, %d mismatch\n", w, h, mismatch);
     }
 
 
-    vkDestroyDescriptorPool(device, descriptorPool, 0);
+    vkDestroyCommandPool(device, commandPool, 0);
+
+    descriptorAllocator.destroy();
+
+    destroy_compute_pipeline(&cp);
+
+    destroy_storage_image(&top_blob);
+
+    return 0;
+}
 
-    vkDestroyPipeline(device, pipeline, 0);
+int main(int argc, char** argv)
+{
+    const char* mode = argc > 1 ? argv[1] : "imagetest";
 
-    vkDestroyPipelineLayout(device, pipelineLayout, 0);
+    const double init_start = get_current_time();
 
-    vkDestroyDescriptorSetLayout(device, descriptorSetLayout, 0);
+    if (init_gpu_device() != 0)
+        return -1;
 
-    vkDestroyShaderModule(device, shaderModule, 0);
+    const double init_time = get_current_time() - init_start;
 
+    int ret = 0;
+    if (strcmp(mode, "imagetest") == 0)
+    {
+        int w = argc > 2 ? atoi(argv[2]) : 8;
+        int h = argc > 3 ? atoi(argv[3]) : w;
+        ret = test_imagetest(w, h);
+    }
+    else if (strcmp(mode, "bench_image_storage") == 0)
+    {
+        ret = bench_image_storage();
+    }
+    else if (strcmp(mode, "bench_pipeline_cache") == 0)
+    {
+        ret = bench_pipeline_cache();
+    }
+    else if (strcmp(mode, "bench_autotune") == 0)
+    {
+        ret = bench_autotune();
+    }
+    else if (strcmp(mode, "bench_dispatch") == 0)
+    {
+        ret = bench_dispatch();
+    }
+    else if (strcmp(mode, "bench_async") == 0)
+    {
+        ret = bench_async();
+    }
+    else if (strcmp(mode, "bench_transfer_overlap") == 0)
+    {
+        ret = bench_transfer_overlap();
+    }
+    else if (strcmp(mode, "bench_recorded_program") == 0)
+    {
+        ret = bench_recorded_program();
+    }
+    else if (strcmp(mode, "bench_descriptor") == 0)
+    {
+        ret = bench_descriptor();
+    }
+    else if (strcmp(mode, "bench_tile_scheduler") == 0)
+    {
+        ret = bench_tile_scheduler(argc > 2 ? argv[2] : 0);
+    }
+    else if (strcmp(mode, "bench_image_format") == 0)
+    {
+        ret = bench_image_format();
+    }
+    else if (strcmp(mode, "bench_blob_backend") == 0)
+    {
+        ret = bench_blob_backend();
+    }
+    else if (strcmp(mode, "bench_channel_layout") == 0)
+    {
+        ret = bench_channel_layout();
+    }
+    else if (strcmp(mode, "bench_readback") == 0)
+    {
+        ret = bench_readback();
+    }
+    else if (strcmp(mode, "bench_host_import") == 0)
+    {
+        ret = bench_host_import();
+    }
+    else if (strcmp(mode, "bench_startup") == 0)
+    {
+        ret = bench_startup(argv[0]);
+    }
+    else if (strcmp(mode, "startup_child") == 0)
+    {
+        ret = startup_child(init_time);
+    }
+    else if (strcmp(mode, "bench_graph") == 0)
+    {
+        ret = bench_graph();
+    }
+    else if (strcmp(mode, "bench_spirv_compiler") == 0)
+    {
+        ret = bench_spirv_compiler();
+    }
+    else if (strcmp(mode, "bench_stream_load") == 0)
+    {
+        ret = bench_stream_load();
+    }
+    else if (strcmp(mode, "bench_reduce") == 0)
+    {
+        ret = bench_reduce();
+    }
+    else if (strcmp(mode, "bench_gemm") == 0)
+    {
+        ret = bench_gemm();
+    }
+    else
+    {
+        fprintf(stderr, "unknown mode %s\n", mode);
+        ret = -1;
+    }
 
     destroy_gpu_device();
 
-    return 0;
+    return ret;
 }